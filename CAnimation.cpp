@@ -0,0 +1,271 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CAnimation.h"
+
+// Includes
+#include <stdexcept>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+pthread_mutex_t CAnimation::s_mutexBudget = PTHREAD_MUTEX_INITIALIZER;
+size_t CAnimation::s_uBudget = 32 * 1024 * 1024;
+size_t CAnimation::s_uBytes = 0;
+
+CAnimation::CAnimation( const uint8_t * const pData, const size_t uSize )
+	:	m_pDecoder(NULL),
+		m_iDecoderNext(0),
+		m_uCachedBytes(0)
+{
+	WebPData data;
+	data.bytes = pData;
+	data.size = uSize;
+	
+	// Frame timing and placement come from the container, no decoding needed
+	WebPDemuxer * const pDemuxer = WebPDemux( &data );
+	if( pDemuxer == NULL )
+		throw std::runtime_error("Invalid animation container");
+	
+	WebPIterator iter;
+	if( WebPDemuxGetFrame( pDemuxer, 1, &iter ) )
+	{
+		do
+		{
+			SFrame frame;
+			
+			// Browsers treat very short frames as 100 ms, so should we
+			frame.iDuration = iter.duration <= 10 ? 100 : iter.duration;
+			frame.iX = iter.x_offset;
+			frame.iY = iter.y_offset;
+			frame.iWidth = iter.width;
+			frame.iHeight = iter.height;
+			frame.bDisposeToBackground = iter.dispose_method == WEBP_MUX_DISPOSE_BACKGROUND;
+			
+			m_vecFrames.push_back(frame);
+		}
+		while( WebPDemuxNextFrame( &iter ) );
+		
+		WebPDemuxReleaseIterator( &iter );
+	}
+	
+	WebPDemuxDelete( pDemuxer );
+	
+	WebPAnimDecoderOptions options;
+	if( m_vecFrames.empty() || !WebPAnimDecoderOptionsInit(&options) )
+		throw std::runtime_error("No frames in animation");
+	
+	// Premultiplied and in the byte order of cairo's ARGB32
+	#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		options.color_mode = MODE_Argb;
+	#else
+		options.color_mode = MODE_bgrA;
+	#endif
+	options.use_threads = 0;
+	
+	m_pDecoder = WebPAnimDecoderNew( &data, &options );
+	if( m_pDecoder == NULL || !WebPAnimDecoderGetInfo( m_pDecoder, &m_info ) )
+	{
+		if( m_pDecoder != NULL )
+			WebPAnimDecoderDelete( m_pDecoder );
+		throw std::runtime_error("Failed to create animation decoder");
+	}
+	
+	m_vecFrames.resize( std::min(m_vecFrames.size(), (size_t)m_info.frame_count) );
+	m_vecCached.resize( m_vecFrames.size(), NULL );
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CAnimation::CAnimation() - %ux%u, %u frames, %u loops\n",
+				m_info.canvas_width, m_info.canvas_height, m_info.frame_count, m_info.loop_count);
+	#endif
+}
+
+CAnimation::~CAnimation()
+{
+	for( std::vector<cairo_surface_t *>::iterator it = m_vecCached.begin(); it != m_vecCached.end(); ++it )
+	{
+		if( *it != NULL )
+			cairo_surface_destroy(*it);
+	}
+	
+	pthread_mutex_lock(&s_mutexBudget);
+	s_uBytes -= m_uCachedBytes;
+	pthread_mutex_unlock(&s_mutexBudget);
+	
+	WebPAnimDecoderDelete( m_pDecoder );
+}
+
+int CAnimation::getWidth() const
+{
+	return m_info.canvas_width;
+}
+
+int CAnimation::getHeight() const
+{
+	return m_info.canvas_height;
+}
+
+int CAnimation::getFrameCount() const
+{
+	return m_vecFrames.size();
+}
+
+int CAnimation::getLoopCount() const
+{
+	return m_info.loop_count;
+}
+
+const CAnimation::SFrame & CAnimation::getFrameInfo( const int iFrame ) const
+{
+	return m_vecFrames[iFrame];
+}
+
+void CAnimation::getChangedRect( const int iFrame, int & iX, int & iY, int & iWidth, int & iHeight ) const
+{
+	// Starting over may change anything
+	if( iFrame == 0 )
+	{
+		iX = iY = 0;
+		iWidth = getWidth();
+		iHeight = getHeight();
+		return;
+	}
+	
+	const SFrame & frame = m_vecFrames[iFrame];
+	int iLeft = frame.iX, iTop = frame.iY;
+	int iRight = frame.iX + frame.iWidth, iBottom = frame.iY + frame.iHeight;
+	
+	// The previous frame was cleared to the background before this one
+	const SFrame & previous = m_vecFrames[iFrame - 1];
+	if( previous.bDisposeToBackground )
+	{
+		iLeft = std::min( iLeft, previous.iX );
+		iTop = std::min( iTop, previous.iY );
+		iRight = std::max( iRight, previous.iX + previous.iWidth );
+		iBottom = std::max( iBottom, previous.iY + previous.iHeight );
+	}
+	
+	iX = iLeft;
+	iY = iTop;
+	iWidth = iRight - iLeft;
+	iHeight = iBottom - iTop;
+}
+
+cairo_surface_t * CAnimation::getFrame( const int iFrame )
+{
+	if( iFrame < 0 || iFrame >= getFrameCount() )
+		return NULL;
+	
+	cairo_surface_t * pFrame = NULL;
+	if( m_vecCached[iFrame] != NULL )
+		pFrame = cairo_surface_reference( m_vecCached[iFrame] );
+	
+	// Frames are composited on top of each other, so the decoder can only
+	// go forward. Keep it right behind playback, one frame per call, so
+	// that an uncached frame costs a single decode when its turn comes.
+	if( m_iDecoderNext > iFrame + 1 )
+	{
+		WebPAnimDecoderReset( m_pDecoder );
+		m_iDecoderNext = 0;
+	}
+	
+	if( pFrame != NULL )
+	{
+		if( m_iDecoderNext <= iFrame && std::find(m_vecCached.begin() + m_iDecoderNext, m_vecCached.end(), (cairo_surface_t *)NULL) != m_vecCached.end() )
+		{
+			cairo_surface_t * const pSkipped = decodeNext();
+			if( pSkipped != NULL )
+				cairo_surface_destroy( pSkipped );
+		}
+		
+		return pFrame;
+	}
+	
+	while( m_iDecoderNext <= iFrame )
+	{
+		if( pFrame != NULL )
+			cairo_surface_destroy( pFrame );
+		
+		pFrame = decodeNext();
+		if( pFrame == NULL )
+			return NULL;
+	}
+	
+	return pFrame;
+}
+
+void CAnimation::setBudget( const size_t uBudget )
+{
+	pthread_mutex_lock(&s_mutexBudget);
+	s_uBudget = uBudget;
+	pthread_mutex_unlock(&s_mutexBudget);
+}
+
+cairo_surface_t * CAnimation::decodeNext()
+{
+	uint8_t * pCanvas;
+	int iTimestamp;
+	
+	if( !WebPAnimDecoderGetNext( m_pDecoder, &pCanvas, &iTimestamp ) )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CAnimation::decodeNext() - Failed to decode frame %i\n", m_iDecoderNext);
+		#endif
+		return NULL;
+	}
+	
+	const int iFrame = m_iDecoderNext++;
+	if( m_vecCached[iFrame] != NULL )
+		return cairo_surface_reference( m_vecCached[iFrame] );
+	
+	// The canvas is reused for the next frame, so take a copy
+	cairo_surface_t * const pFrame = cairo_image_surface_create( CAIRO_FORMAT_ARGB32, getWidth(), getHeight() );
+	if( cairo_surface_status(pFrame) != CAIRO_STATUS_SUCCESS )
+	{
+		cairo_surface_destroy( pFrame );
+		return NULL;
+	}
+	
+	cairo_surface_flush( pFrame );
+	
+	const size_t uRowBytes = (size_t)getWidth() * 4;
+	const int iStride = cairo_image_surface_get_stride( pFrame );
+	unsigned char * const pPixels = cairo_image_surface_get_data( pFrame );
+	
+	for( int y = 0; y < getHeight(); ++y )
+		memcpy( pPixels + (size_t)y * iStride, pCanvas + y * uRowBytes, uRowBytes );
+	
+	cairo_surface_mark_dirty( pFrame );
+	
+	// Keep it if it fits
+	const size_t uBytes = (size_t)iStride * getHeight();
+	bool bKeep = false;
+	
+	pthread_mutex_lock(&s_mutexBudget);
+	if( s_uBytes + uBytes <= s_uBudget )
+	{
+		s_uBytes += uBytes;
+		bKeep = true;
+	}
+	pthread_mutex_unlock(&s_mutexBudget);
+	
+	if( bKeep )
+	{
+		m_vecCached[iFrame] = cairo_surface_reference( pFrame );
+		m_uCachedBytes += uBytes;
+	}
+	
+	return pFrame;
+}
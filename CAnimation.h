@@ -0,0 +1,87 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_CANIMATION
+#define H_CANIMATION
+
+// Includes
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+// Include for image surfaces
+#include <cairo/cairo.h>
+
+// Include for animation decoder
+#include <webp/demux.h>
+
+/* Frames of an animated WebP, composited onto the canvas as premultiplied
+ * ARGB32 surfaces. Frames are kept while they fit in a byte budget shared
+ * by all animations; the rest are decoded again whenever they come up.
+ * Frame info is fixed at construction and may be read from any thread,
+ * getFrame() must only be called from one thread at a time. */
+class CAnimation
+{
+	public: // Types
+		struct SFrame
+		{
+			int iDuration; // Milliseconds, with browser style clamping
+			int iX;
+			int iY;
+			int iWidth;
+			int iHeight;
+			bool bDisposeToBackground;
+		};
+		
+	public: // Functions
+		/* pData must outlive the animation. Throws if it cannot be decoded. */
+		CAnimation( const uint8_t * const pData, const size_t uSize );
+		~CAnimation();
+		
+		int getWidth() const;
+		int getHeight() const;
+		int getFrameCount() const;
+		int getLoopCount() const; // 0 loops forever
+		const SFrame & getFrameInfo( const int iFrame ) const;
+		
+		/* The part of the canvas that differs from the previous frame */
+		void getChangedRect( const int iFrame, int & iX, int & iY, int & iWidth, int & iHeight ) const;
+		
+		/* Returns a new reference to frame iFrame, or NULL */
+		cairo_surface_t * getFrame( const int iFrame );
+		
+		static void setBudget( const size_t uBudget );
+		
+	private: // Functions
+		cairo_surface_t * decodeNext();
+		
+		// Not copyable
+		CAnimation( const CAnimation & );
+		CAnimation & operator=( const CAnimation & );
+		
+	private: // Variables
+		WebPAnimDecoder * m_pDecoder;
+		WebPAnimInfo m_info;
+		std::vector<SFrame> m_vecFrames;
+		std::vector<cairo_surface_t *> m_vecCached;
+		int m_iDecoderNext; // Frame the decoder produces next
+		size_t m_uCachedBytes;
+		
+		static pthread_mutex_t s_mutexBudget;
+		static size_t s_uBudget;
+		static size_t s_uBytes;
+};
+
+#endif
@@ -0,0 +1,255 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CDecodeCore.h"
+
+// Includes
+#include <algorithm>
+#include <cstdlib>
+
+const cairo_user_data_key_t CDecodeCore::s_keyImageData = { 0 };
+
+CWorkQueue * CDecodeCore::s_pStripQueue = NULL;
+unsigned int CDecodeCore::s_uStripThreads = 0;
+
+// Strips are waited for, so they go ahead of any decoding
+const int CDecodeCore::s_iStripPriority = 1 << 30;
+
+// Below this many pixels per strip, handing work to other threads costs
+// more than it saves
+const size_t CDecodeCore::s_uMinStripPixels = 256 * 1024;
+
+const size_t CDecodeCore::s_uLargeImagePixels = 4 * 1024 * 1024;
+const size_t CDecodeCore::s_uSliceSize = 64 * 1024;
+
+void CDecodeCore::setStripQueue( CWorkQueue * const pQueue, const unsigned int uThreads )
+{
+	s_pStripQueue = pQueue;
+	s_uStripThreads = pQueue != NULL ? uThreads : 0;
+}
+
+void CDecodeCore::runStrips( const FStrip pfnStrip, void * const pData, const int iFirstRow, const int iLastRow, const size_t uRowPixels )
+{
+	const int iRows = iLastRow - iFirstRow;
+	if( iRows <= 0 )
+		return;
+	
+	// The caller takes a strip too
+	size_t uStrips = std::min( (size_t)s_uStripThreads + 1, (size_t)iRows * uRowPixels / s_uMinStripPixels );
+	uStrips = std::min( uStrips, (size_t)iRows );
+	
+	CWorkQueue * const pQueue = s_pStripQueue;
+	if( pQueue == NULL || uStrips <= 1 )
+	{
+		pfnStrip( pData, iFirstRow, iLastRow );
+		return;
+	}
+	
+	CStripJob * const pJobs = new CStripJob[uStrips];
+	for( size_t i = 0; i < uStrips; ++i )
+	{
+		pJobs[i].m_pfnStrip = pfnStrip;
+		pJobs[i].m_pData = pData;
+		pJobs[i].m_iFirstRow = iFirstRow + (int)( (int64_t)iRows * i / uStrips );
+		pJobs[i].m_iLastRow = iFirstRow + (int)( (int64_t)iRows * (i + 1) / uStrips );
+		
+		if( i > 0 )
+		{
+			pQueue->setPriority( &pJobs[i], s_iStripPriority );
+			pQueue->push( &pJobs[i] );
+		}
+	}
+	
+	pJobs[0].run();
+	
+	// Takes back whatever is still waiting, and waits for what is running
+	for( size_t i = 1; i < uStrips; ++i )
+	{
+		pQueue->cancel( &pJobs[i] );
+		if( !pJobs[i].m_bDone )
+			pJobs[i].run();
+	}
+	
+	delete[] pJobs;
+}
+
+bool CDecodeCore::isLarge( const int iWidth, const int iHeight )
+{
+	return (size_t)iWidth * iHeight >= s_uLargeImagePixels;
+}
+
+cairo_surface_t * CDecodeCore::createImageSurface( WebPDecoderConfig & config, const int iWidth, const int iHeight, const bool bAlpha )
+{
+	// Points the decoder at a cairo image surface. bgrA is premultiplied
+	// ARGB32 in little endian words, which is what cairo wants; opaque
+	// images come out with alpha 255, so RGB24 reads the same bytes.
+	const cairo_format_t format = bAlpha ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24;
+	const int iStride = cairo_format_stride_for_width( format, iWidth );
+	if( iWidth <= 0 || iHeight <= 0 || iStride <= 0 )
+		return NULL;
+	
+	const size_t uSize = (size_t)iStride * iHeight;
+	uint8_t * const pPixels = static_cast<uint8_t *>( malloc(uSize) );
+	if( pPixels == NULL )
+		return NULL;
+	
+	cairo_surface_t * const pImage = cairo_image_surface_create_for_data( pPixels, format, iWidth, iHeight, iStride );
+	if( cairo_surface_status(pImage) != CAIRO_STATUS_SUCCESS
+			|| cairo_surface_set_user_data( pImage, &s_keyImageData, pPixels, free ) != CAIRO_STATUS_SUCCESS )
+	{
+		cairo_surface_destroy( pImage );
+		free( pPixels );
+		return NULL;
+	}
+	
+	#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		config.output.colorspace = MODE_Argb;
+	#else
+		config.output.colorspace = MODE_bgrA;
+	#endif
+	
+	// The surface owns the pixels, so WebPFreeDecBuffer() leaves them be
+	config.output.is_external_memory = 1;
+	config.output.width = iWidth;
+	config.output.height = iHeight;
+	config.output.u.RGBA.rgba = pPixels;
+	config.output.u.RGBA.stride = iStride;
+	config.output.u.RGBA.size = uSize;
+	
+	return pImage;
+}
+
+cairo_surface_t * CDecodeCore::decode( const uint8_t * const pData, const size_t uSize, const int iWidth, const int iHeight, const CJob * const pJob )
+{
+	WebPDecoderConfig config;
+	if( !WebPInitDecoderConfig(&config)
+			|| WebPGetFeatures( pData, uSize, &config.input ) != VP8_STATUS_OK
+			|| config.input.has_animation )
+		return NULL;
+	
+	// Let libwebp scale while decoding instead of scaling a full size image later
+	const int iDecodeWidth = iWidth > 0 ? iWidth : config.input.width;
+	const int iDecodeHeight = iHeight > 0 ? iHeight : config.input.height;
+	
+	config.options.use_scaling = ( iDecodeWidth != config.input.width || iDecodeHeight != config.input.height );
+	config.options.scaled_width = iDecodeWidth;
+	config.options.scaled_height = iDecodeHeight;
+	config.options.use_threads = isLarge( config.input.width, config.input.height );
+	
+	cairo_surface_t * const pImage = createImageSurface( config, iDecodeWidth, iDecodeHeight, config.input.has_alpha );
+	if( pImage == NULL )
+		return NULL;
+	
+	if( pJob == NULL )
+	{
+		if( WebPDecode( pData, uSize, &config ) != VP8_STATUS_OK )
+		{
+			cairo_surface_destroy( pImage );
+			return NULL;
+		}
+		
+		return pImage;
+	}
+	
+	// Cancellation never has to wait for more than a slice
+	WebPIDecoder * const pIDecoder = WebPIDecode( NULL, 0, &config );
+	if( pIDecoder == NULL )
+	{
+		cairo_surface_destroy( pImage );
+		return NULL;
+	}
+	
+	VP8StatusCode status = VP8_STATUS_SUSPENDED;
+	for( size_t uDecoded = 0; status == VP8_STATUS_SUSPENDED && uDecoded < uSize && !pJob->isCancelled(); )
+	{
+		uDecoded = std::min( uDecoded + s_uSliceSize, uSize );
+		status = WebPIUpdate( pIDecoder, pData, uDecoded );
+	}
+	
+	WebPIDelete( pIDecoder );
+	
+	if( status != VP8_STATUS_OK )
+	{
+		cairo_surface_destroy( pImage );
+		return NULL;
+	}
+	
+	return pImage;
+}
+
+bool CDecodeCore::scale( cairo_surface_t * const pSource, cairo_surface_t * const pTarget, const CScaler::EFilter eFilter, const int iFirstRow, const int iLastRow )
+{
+	SScale scale;
+	scale.pSource = pSource;
+	scale.pTarget = pTarget;
+	scale.eFilter = eFilter;
+	scale.bFailed = false;
+	
+	// Every strip filters the source rows it needs itself, so strips only
+	// share the rows at their edges
+	runStrips( scaleStrip, &scale, iFirstRow, iLastRow, cairo_image_surface_get_width(pTarget) );
+	return !scale.bFailed;
+}
+
+void CDecodeCore::scaleStrip( void * const pData, const int iFirstRow, const int iLastRow )
+{
+	SScale * const pScale = static_cast<SScale *>(pData);
+	
+	// Both surfaces hold four bytes per pixel, premultiplied when there is
+	// alpha, so the kernels apply as they are
+	const bool bPremultiplied = cairo_image_surface_get_format(pScale->pTarget) == CAIRO_FORMAT_ARGB32;
+	
+	if( !CScaler::scale( cairo_image_surface_get_data(pScale->pSource), cairo_image_surface_get_width(pScale->pSource),
+			cairo_image_surface_get_height(pScale->pSource), cairo_image_surface_get_stride(pScale->pSource),
+			cairo_image_surface_get_data(pScale->pTarget), cairo_image_surface_get_width(pScale->pTarget),
+			cairo_image_surface_get_height(pScale->pTarget), cairo_image_surface_get_stride(pScale->pTarget), bPremultiplied,
+			pScale->eFilter, iFirstRow, iLastRow ) )
+		pScale->bFailed = true;
+}
+
+cairo_surface_t * CDecodeCore::createScaled( cairo_surface_t * const pSource, const int iWidth, const int iHeight, const CScaler::EFilter eFilter )
+{
+	cairo_surface_t * const pTarget = cairo_image_surface_create( cairo_image_surface_get_format(pSource), iWidth, iHeight );
+	if( cairo_surface_status(pTarget) != CAIRO_STATUS_SUCCESS )
+	{
+		cairo_surface_destroy( pTarget );
+		return NULL;
+	}
+	
+	if( !scale( pSource, pTarget, eFilter, 0, iHeight ) )
+	{
+		cairo_surface_destroy( pTarget );
+		return NULL;
+	}
+	
+	cairo_surface_mark_dirty( pTarget );
+	return pTarget;
+}
+
+void CDecodeCore::fitSize( int & iWidth, int & iHeight, const int iMaxWidth, const int iMaxHeight )
+{
+	// A limit of 0 or less leaves that side alone
+	double dScale = 1.0;
+	if( iMaxWidth > 0 && iWidth > iMaxWidth )
+		dScale = std::min( dScale, (double)iMaxWidth / iWidth );
+	if( iMaxHeight > 0 && iHeight > iMaxHeight )
+		dScale = std::min( dScale, (double)iMaxHeight / iHeight );
+	
+	if( dScale < 1.0 )
+	{
+		iWidth = std::max( 1, (int)( iWidth * dScale + 0.5 ) );
+		iHeight = std::max( 1, (int)( iHeight * dScale + 0.5 ) );
+	}
+}
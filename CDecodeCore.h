@@ -0,0 +1,112 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_CDECODECORE
+#define H_CDECODECORE
+
+// Includes
+#include <stdint.h>
+#include <cstddef>
+
+// Include for image surfaces
+#include <cairo/cairo.h>
+
+// Include for decoding
+#include <webp/decode.h>
+
+#include "CScaler.h"
+#include "CWorkQueue.h"
+
+/* Decoding and scaling shared by the plugin and webp-npapi-tool, so both
+ * produce the same pixels. Images are cairo image surfaces holding
+ * premultiplied ARGB32, or RGB24 when opaque. Safe to use from any thread. */
+class CDecodeCore
+{
+	public: // Types
+		/* Works on rows [iFirstRow, iLastRow) of something, see runStrips() */
+		typedef void (*FStrip)( void * const pData, const int iFirstRow, const int iLastRow );
+		
+	public: // Functions
+		/* Lets large images be worked on in row strips on pQueue, which runs
+		 * uThreads threads. Without a queue everything runs on the caller. */
+		static void setStripQueue( CWorkQueue * const pQueue, const unsigned int uThreads );
+		
+		/* Splits rows [iFirstRow, iLastRow) into strips when there is enough
+		 * work, runs one on the calling thread and the others on the strip
+		 * queue, and returns once all are done. Strips nobody picked up yet
+		 * are run by the caller, so this may be called from the queue too. */
+		static void runStrips( const FStrip pfnStrip, void * const pData, const int iFirstRow, const int iLastRow, const size_t uRowPixels );
+		
+		/* Whether an image is big enough for libwebp to use threads of its own */
+		static bool isLarge( const int iWidth, const int iHeight );
+		
+		/* Points the output of config at a new surface, which owns the pixels */
+		static cairo_surface_t * createImageSurface( WebPDecoderConfig & config, const int iWidth, const int iHeight, const bool bAlpha );
+		
+		/* Decodes a still image, scaled by libwebp to iWidth x iHeight unless
+		 * those are 0. Returns NULL for animations. With a job the data goes
+		 * in slices, and NULL is returned as soon as the job is cancelled. */
+		static cairo_surface_t * decode( const uint8_t * const pData, const size_t uSize, const int iWidth = 0, const int iHeight = 0, const CJob * const pJob = NULL );
+		
+		/* Scales rows [iFirstRow, iLastRow) of pTarget from pSource, whose
+		 * rows they depend on must be decoded, see CScaler::getRowsAvailable() */
+		static bool scale( cairo_surface_t * const pSource, cairo_surface_t * const pTarget, const CScaler::EFilter eFilter, const int iFirstRow, const int iLastRow );
+		
+		/* Returns a new surface with all of pSource scaled to iWidth x iHeight */
+		static cairo_surface_t * createScaled( cairo_surface_t * const pSource, const int iWidth, const int iHeight, const CScaler::EFilter eFilter );
+		
+		/* Shrinks iWidth x iHeight to fit iMaxWidth x iMaxHeight, keeping the
+		 * aspect ratio. Never enlarges. */
+		static void fitSize( int & iWidth, int & iHeight, const int iMaxWidth, const int iMaxHeight );
+		
+	private: // Types
+		/* One strip of a runStrips() call */
+		class CStripJob : public CJob
+		{
+			public:
+				CStripJob() : m_bDone(false) {}
+				void run() { m_pfnStrip( m_pData, m_iFirstRow, m_iLastRow ); m_bDone = true; }
+				
+				FStrip m_pfnStrip;
+				void * m_pData;
+				int m_iFirstRow;
+				int m_iLastRow;
+				volatile bool m_bDone;
+		};
+		
+		struct SScale
+		{
+			cairo_surface_t * pSource;
+			cairo_surface_t * pTarget;
+			CScaler::EFilter eFilter;
+			volatile bool bFailed;
+		};
+		
+	private: // Functions
+		static void scaleStrip( void * const pData, const int iFirstRow, const int iLastRow );
+		
+	private: // Variables
+		/* Frees the pixels behind surfaces from createImageSurface() */
+		static const cairo_user_data_key_t s_keyImageData;
+		
+		static CWorkQueue * s_pStripQueue;
+		static unsigned int s_uStripThreads;
+		static const int s_iStripPriority;
+		static const size_t s_uMinStripPixels;
+		static const size_t s_uLargeImagePixels;
+		static const size_t s_uSliceSize;
+};
+
+#endif
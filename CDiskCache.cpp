@@ -0,0 +1,326 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CDiskCache.h"
+
+// Includes
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const uint32_t CDiskCache::s_uMagic = 0x43504e57; // "WNPC"
+const uint32_t CDiskCache::s_uVersion = 1;
+const size_t CDiskCache::s_uHeaderSize = 64; // Keeps the pixels aligned
+const cairo_user_data_key_t CDiskCache::s_keyMapping = { 0 };
+
+CDiskCache::CDiskCache()
+	:	m_uBudget(0),
+		m_uBytesSincePrune(0)
+{
+	pthread_mutex_init(&m_mutexPrune, NULL);
+}
+
+CDiskCache::~CDiskCache()
+{
+	pthread_mutex_destroy(&m_mutexPrune);
+}
+
+bool CDiskCache::open( const size_t uBudget )
+{
+	if( uBudget == 0 )
+		return false;
+	
+	std::string strBase;
+	const char * const szCacheHome = getenv("XDG_CACHE_HOME");
+	const char * const szHome = getenv("HOME");
+	
+	// Relative paths are to be ignored, says the spec
+	if( szCacheHome != NULL && szCacheHome[0] == '/' )
+		strBase = szCacheHome;
+	else if( szHome != NULL && szHome[0] == '/' )
+		strBase = std::string(szHome) + "/.cache";
+	else
+		return false;
+	
+	const std::string strDirectory = strBase + "/webp-npapi";
+	if( ( mkdir( strBase.c_str(), 0700 ) != 0 && errno != EEXIST )
+			|| ( mkdir( strDirectory.c_str(), 0700 ) != 0 && errno != EEXIST ) )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CDiskCache::open() - Cannot create %s\n", strDirectory.c_str());
+		#endif
+		return false;
+	}
+	
+	m_strDirectory = strDirectory;
+	m_uBudget = uBudget;
+	
+	// The first store looks at what earlier sessions left behind
+	m_uBytesSincePrune = uBudget;
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CDiskCache::open() - Caching up to %u MiB in %s\n", (unsigned int)(uBudget / (1024 * 1024)), strDirectory.c_str());
+	#endif
+	
+	return true;
+}
+
+bool CDiskCache::isEnabled() const
+{
+	return m_uBudget > 0;
+}
+
+cairo_surface_t * CDiskCache::load( const uint64_t uHash, const size_t uDataSize, const int iWidth, const int iHeight )
+{
+	if( !isEnabled() || iWidth <= 0 || iHeight <= 0 )
+		return NULL;
+	
+	const int fd = ::open( getPath( uHash, uDataSize, iWidth, iHeight ).c_str(), O_RDONLY );
+	if( fd < 0 )
+		return NULL;
+	
+	struct stat fileStat;
+	void * pMapping = MAP_FAILED;
+	
+	// Private and writable, so that nothing we do to the pixels reaches the file
+	if( fstat(fd, &fileStat) == 0 && (size_t)fileStat.st_size > s_uHeaderSize )
+		pMapping = mmap( NULL, fileStat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+	
+	// Recently used, as far as pruning goes
+	if( pMapping != MAP_FAILED )
+		futimens( fd, NULL );
+	
+	close(fd);
+	
+	if( pMapping == MAP_FAILED )
+		return NULL;
+	
+	SHeader header;
+	memcpy( &header, pMapping, sizeof(header) );
+	
+	const cairo_format_t format = (cairo_format_t)header.iFormat;
+	const bool bValid = header.uMagic == s_uMagic && header.uVersion == s_uVersion
+			&& header.uHash == uHash && header.uDataSize == uDataSize
+			&& header.iWidth == iWidth && header.iHeight == iHeight
+			&& ( format == CAIRO_FORMAT_ARGB32 || format == CAIRO_FORMAT_RGB24 )
+			&& header.iStride == cairo_format_stride_for_width( format, iWidth )
+			&& (size_t)fileStat.st_size == s_uHeaderSize + (size_t)header.iStride * iHeight;
+	
+	SMapping * const pOwner = new SMapping;
+	pOwner->pData = pMapping;
+	pOwner->uSize = fileStat.st_size;
+	
+	if( !bValid )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CDiskCache::load() - Ignoring a damaged file for %016llx\n", (unsigned long long)uHash);
+		#endif
+		unmap( pOwner );
+		return NULL;
+	}
+	
+	cairo_surface_t * const pImage = cairo_image_surface_create_for_data( static_cast<unsigned char *>(pMapping) + s_uHeaderSize,
+			format, iWidth, iHeight, header.iStride );
+	if( cairo_surface_status(pImage) != CAIRO_STATUS_SUCCESS
+			|| cairo_surface_set_user_data( pImage, &s_keyMapping, pOwner, unmap ) != CAIRO_STATUS_SUCCESS )
+	{
+		cairo_surface_destroy( pImage );
+		unmap( pOwner );
+		return NULL;
+	}
+	
+	return pImage;
+}
+
+void CDiskCache::store( const uint64_t uHash, const size_t uDataSize, cairo_surface_t * const pImage )
+{
+	if( !isEnabled() )
+		return;
+	
+	const int iWidth = cairo_image_surface_get_width( pImage );
+	const int iHeight = cairo_image_surface_get_height( pImage );
+	const std::string strPath = getPath( uHash, uDataSize, iWidth, iHeight );
+	
+	// Someone, maybe another process, got there first
+	if( access( strPath.c_str(), F_OK ) == 0 )
+		return;
+	
+	char auHeader[s_uHeaderSize];
+	memset( auHeader, 0, sizeof(auHeader) );
+	
+	SHeader header;
+	header.uMagic = s_uMagic;
+	header.uVersion = s_uVersion;
+	header.uHash = uHash;
+	header.uDataSize = uDataSize;
+	header.iWidth = iWidth;
+	header.iHeight = iHeight;
+	header.iStride = cairo_image_surface_get_stride( pImage );
+	header.iFormat = cairo_image_surface_get_format( pImage );
+	memcpy( auHeader, &header, sizeof(header) );
+	
+	// Written under a temporary name and renamed, so readers only ever
+	// see whole files
+	std::string strTemp = m_strDirectory + "/.tmp-XXXXXX";
+	const int fd = mkstemp( &strTemp[0] );
+	if( fd < 0 )
+		return;
+	
+	const uint8_t * const pPixels = cairo_image_surface_get_data( pImage );
+	const size_t uPixelBytes = (size_t)header.iStride * iHeight;
+	
+	bool bWritten = ::write( fd, auHeader, s_uHeaderSize ) == (ssize_t)s_uHeaderSize;
+	for( size_t uOffset = 0; bWritten && uOffset < uPixelBytes; )
+	{
+		const ssize_t iWritten = ::write( fd, pPixels + uOffset, uPixelBytes - uOffset );
+		if( iWritten < 0 && errno == EINTR )
+			continue;
+		
+		bWritten = iWritten > 0;
+		if( bWritten )
+			uOffset += iWritten;
+	}
+	
+	// On disk before the name is, or a crash could leave a file whose header
+	// checks out over pixels that never made it
+	if( bWritten && fsync(fd) != 0 )
+		bWritten = false;
+	
+	if( close(fd) != 0 )
+		bWritten = false;
+	
+	if( !bWritten || rename( strTemp.c_str(), strPath.c_str() ) != 0 )
+	{
+		unlink( strTemp.c_str() );
+		return;
+	}
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CDiskCache::store() - Stored %ix%i for %016llx\n", iWidth, iHeight, (unsigned long long)uHash);
+	#endif
+	
+	// Look at the whole directory now and then, not after every file
+	pthread_mutex_lock(&m_mutexPrune);
+	m_uBytesSincePrune += s_uHeaderSize + uPixelBytes;
+	const bool bPrune = m_uBytesSincePrune >= m_uBudget / 8;
+	if( bPrune )
+		m_uBytesSincePrune = 0;
+	pthread_mutex_unlock(&m_mutexPrune);
+	
+	if( bPrune )
+		prune();
+}
+
+bool CDiskCache::isMapped( cairo_surface_t * const pImage )
+{
+	return cairo_surface_get_user_data( pImage, &s_keyMapping ) != NULL;
+}
+
+std::string CDiskCache::getPath( const uint64_t uHash, const size_t uDataSize, const int iWidth, const int iHeight ) const
+{
+	char szName[96];
+	snprintf( szName, sizeof(szName), "/%016llx-%llx-%ix%i.px", (unsigned long long)uHash, (unsigned long long)uDataSize, iWidth, iHeight );
+	return m_strDirectory + szName;
+}
+
+void CDiskCache::prune()
+{
+	// Other processes prune the same directory, one at a time is plenty
+	const std::string strLock = m_strDirectory + "/.lock";
+	const int fdLock = ::open( strLock.c_str(), O_RDWR | O_CREAT, 0600 );
+	if( fdLock < 0 )
+		return;
+	
+	if( flock( fdLock, LOCK_EX | LOCK_NB ) != 0 )
+	{
+		close(fdLock);
+		return;
+	}
+	
+	DIR * const pDir = opendir( m_strDirectory.c_str() );
+	if( pDir == NULL )
+	{
+		close(fdLock);
+		return;
+	}
+	
+	std::vector< std::pair<time_t, std::string> > vecFiles;
+	size_t uTotal = 0;
+	const time_t now = time(NULL);
+	
+	while( const dirent * const pEntry = readdir(pDir) )
+	{
+		const std::string strPath = m_strDirectory + "/" + pEntry->d_name;
+		const size_t uLength = strlen(pEntry->d_name);
+		
+		struct stat fileStat;
+		if( stat( strPath.c_str(), &fileStat ) != 0 || !S_ISREG(fileStat.st_mode) )
+			continue;
+		
+		// Left behind by a process that died while writing
+		if( strncmp( pEntry->d_name, ".tmp-", 5 ) == 0 )
+		{
+			if( now - fileStat.st_mtime > 3600 )
+				unlink( strPath.c_str() );
+			continue;
+		}
+		
+		if( uLength < 3 || strcmp( pEntry->d_name + uLength - 3, ".px" ) != 0 )
+			continue;
+		
+		vecFiles.push_back( std::make_pair( fileStat.st_mtime, strPath ) );
+		uTotal += fileStat.st_size;
+	}
+	
+	closedir(pDir);
+	
+	// Oldest first, down to a bit under budget so we do not prune on every store
+	if( uTotal > m_uBudget )
+	{
+		std::sort( vecFiles.begin(), vecFiles.end() );
+		
+		const size_t uTarget = m_uBudget - m_uBudget / 8;
+		for( size_t i = 0; i < vecFiles.size() && uTotal > uTarget; ++i )
+		{
+			struct stat fileStat;
+			if( stat( vecFiles[i].second.c_str(), &fileStat ) == 0 && unlink( vecFiles[i].second.c_str() ) == 0 )
+				uTotal -= std::min( uTotal, (size_t)fileStat.st_size );
+		}
+		
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CDiskCache::prune() - %u MiB left\n", (unsigned int)(uTotal / (1024 * 1024)));
+		#endif
+	}
+	
+	flock( fdLock, LOCK_UN );
+	close(fdLock);
+}
+
+void CDiskCache::unmap( void * pMapping )
+{
+	SMapping * const pOwner = static_cast<SMapping *>(pMapping);
+	munmap( pOwner->pData, pOwner->uSize );
+	delete pOwner;
+}
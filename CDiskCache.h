@@ -0,0 +1,100 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_CDISKCACHE
+#define H_CDISKCACHE
+
+// Includes
+#include <pthread.h>
+#include <stdint.h>
+#include <cstddef>
+#include <string>
+
+// Include for image surfaces
+#include <cairo/cairo.h>
+
+/* Decoded pixels kept on disk across sessions, one file per image keyed by
+ * a hash of the compressed bytes and the decoded size. Hits are mapped and
+ * painted from as they are. Files are only ever created by renaming a
+ * finished temporary file and only ever removed by unlinking, so any number
+ * of processes can share the directory; a mapping outlives the unlink.
+ * Least recently used files go once the directory is over budget. */
+class CDiskCache
+{
+	public: // Functions
+		CDiskCache();
+		~CDiskCache();
+		
+		/* Uses $XDG_CACHE_HOME/webp-npapi, or ~/.cache/webp-npapi. A budget
+		 * of 0 leaves the cache disabled. */
+		bool open( const size_t uBudget );
+		bool isEnabled() const;
+		
+		/* Maps the pixels stored for the image at exactly iWidth x iHeight.
+		 * The surface owns the mapping. Returns NULL on a miss. */
+		cairo_surface_t * load( const uint64_t uHash, const size_t uDataSize, const int iWidth, const int iHeight );
+		
+		/* Writes pImage out unless it is there already. May block on the
+		 * disk, so keep it off the browser thread. */
+		void store( const uint64_t uHash, const size_t uDataSize, cairo_surface_t * const pImage );
+		
+		/* Whether pImage came from load(). Its pixels are clean file pages
+		 * the kernel can drop and read back, not heap memory. */
+		static bool isMapped( cairo_surface_t * const pImage );
+		
+	private: // Types
+		/* At the start of every file, padded to s_uHeaderSize */
+		struct SHeader
+		{
+			uint32_t uMagic;
+			uint32_t uVersion;
+			uint64_t uHash;
+			uint64_t uDataSize; // Of the compressed image, against hash collisions
+			int32_t iWidth;
+			int32_t iHeight;
+			int32_t iStride;
+			int32_t iFormat; // cairo_format_t
+		};
+		
+		struct SMapping
+		{
+			void * pData;
+			size_t uSize;
+		};
+		
+	private: // Functions
+		std::string getPath( const uint64_t uHash, const size_t uDataSize, const int iWidth, const int iHeight ) const;
+		void prune();
+		
+		static void unmap( void * pMapping );
+		
+		// Not copyable
+		CDiskCache( const CDiskCache & );
+		CDiskCache & operator=( const CDiskCache & );
+		
+	private: // Variables
+		std::string m_strDirectory;
+		size_t m_uBudget;
+		
+		pthread_mutex_t m_mutexPrune;
+		size_t m_uBytesSincePrune; // Written by us since we last looked
+		
+		static const uint32_t s_uMagic;
+		static const uint32_t s_uVersion;
+		static const size_t s_uHeaderSize;
+		static const cairo_user_data_key_t s_keyMapping;
+};
+
+#endif
@@ -0,0 +1,188 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CImageCache.h"
+
+// Includes
+#include <cstdio>
+
+const uint64_t CImageCache::s_uHashBasis = 14695981039346656037ULL;
+
+CImageCache::CImageCache( const size_t uBudget )
+	:	m_uBudget(uBudget),
+		m_uBytes(0)
+{
+	pthread_mutex_init(&m_mutexCache, NULL);
+}
+
+CImageCache::~CImageCache()
+{
+	// Instances have been destroyed by now, so nobody is using these
+	for( std::list<CEntry *>::iterator it = m_listLRU.begin(); it != m_listLRU.end(); ++it )
+	{
+		cairo_surface_destroy( (*it)->m_pSurface );
+		delete *it;
+	}
+	
+	pthread_mutex_destroy(&m_mutexCache);
+}
+
+void CImageCache::setBudget( const size_t uBudget )
+{
+	pthread_mutex_lock(&m_mutexCache);
+	m_uBudget = uBudget;
+	evict();
+	pthread_mutex_unlock(&m_mutexCache);
+}
+
+CImageCache::CEntry * CImageCache::acquire( const std::string & strSource, const int iMinWidth, const int iMinHeight, cairo_surface_t ** const ppSurface )
+{
+	CEntry * pFound = NULL;
+	*ppSurface = NULL;
+	
+	pthread_mutex_lock(&m_mutexCache);
+	
+	// All hashes for a source sort together, pick the most recently used one
+	std::map<std::pair<std::string, uint64_t>, CEntry *>::const_iterator it = m_mapEntries.lower_bound( std::make_pair(strSource, (uint64_t)0) );
+	for( ; it != m_mapEntries.end() && it->first.first == strSource; ++it )
+	{
+		CEntry * const pEntry = it->second;
+		
+		const int iWidth = cairo_image_surface_get_width( pEntry->m_pSurface );
+		const int iHeight = cairo_image_surface_get_height( pEntry->m_pSurface );
+		
+		const bool bFits = ( iWidth >= iMinWidth || iWidth == pEntry->m_iImageWidth )
+				&& ( iHeight >= iMinHeight || iHeight == pEntry->m_iImageHeight );
+		
+		if( bFits && (pFound == NULL || pEntry->m_itLRU == m_listLRU.begin()) )
+			pFound = pEntry;
+	}
+	
+	if( pFound != NULL )
+	{
+		++pFound->m_uUsers;
+		m_listLRU.splice( m_listLRU.begin(), m_listLRU, pFound->m_itLRU );
+		*ppSurface = cairo_surface_reference( pFound->m_pSurface );
+		
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CImageCache::acquire() - Hit for %s, %u users\n", strSource.c_str(), pFound->m_uUsers);
+		#endif
+	}
+	
+	pthread_mutex_unlock(&m_mutexCache);
+	return pFound;
+}
+
+CImageCache::CEntry * CImageCache::insert( const std::string & strSource, const uint64_t uHash, cairo_surface_t * const pSurface, const int iImageWidth, const int iImageHeight, cairo_surface_t ** const ppSurface )
+{
+	const std::pair<std::string, uint64_t> key( strSource, uHash );
+	const size_t uBytes = (size_t)cairo_image_surface_get_stride(pSurface) * cairo_image_surface_get_height(pSurface);
+	
+	pthread_mutex_lock(&m_mutexCache);
+	
+	CEntry * pEntry = NULL;
+	std::map<std::pair<std::string, uint64_t>, CEntry *>::iterator it = m_mapEntries.find(key);
+	
+	if( it != m_mapEntries.end() )
+	{
+		// Keep whichever decode is larger
+		pEntry = it->second;
+		if( uBytes > pEntry->m_uBytes )
+		{
+			cairo_surface_destroy( pEntry->m_pSurface );
+			pEntry->m_pSurface = cairo_surface_reference( pSurface );
+			
+			m_uBytes += uBytes - pEntry->m_uBytes;
+			pEntry->m_uBytes = uBytes;
+		}
+		
+		m_listLRU.splice( m_listLRU.begin(), m_listLRU, pEntry->m_itLRU );
+	}
+	else
+	{
+		pEntry = new CEntry;
+		pEntry->m_key = key;
+		pEntry->m_uHash = uHash;
+		pEntry->m_pSurface = cairo_surface_reference( pSurface );
+		pEntry->m_iImageWidth = iImageWidth;
+		pEntry->m_iImageHeight = iImageHeight;
+		pEntry->m_uBytes = uBytes;
+		pEntry->m_uUsers = 0;
+		
+		m_listLRU.push_front(pEntry);
+		pEntry->m_itLRU = m_listLRU.begin();
+		m_mapEntries[key] = pEntry;
+		m_uBytes += uBytes;
+	}
+	
+	++pEntry->m_uUsers;
+	*ppSurface = cairo_surface_reference( pEntry->m_pSurface );
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CImageCache::insert() - %s cached, %u of %u bytes in use\n", strSource.c_str(), (unsigned int)m_uBytes, (unsigned int)m_uBudget);
+	#endif
+	
+	evict();
+	
+	pthread_mutex_unlock(&m_mutexCache);
+	return pEntry;
+}
+
+void CImageCache::release( CEntry * const pEntry )
+{
+	pthread_mutex_lock(&m_mutexCache);
+	
+	--pEntry->m_uUsers;
+	evict();
+	
+	pthread_mutex_unlock(&m_mutexCache);
+}
+
+void CImageCache::evict()
+{
+	// Must be called with m_mutexCache held
+	std::list<CEntry *>::iterator it = m_listLRU.end();
+	
+	while( m_uBytes > m_uBudget && it != m_listLRU.begin() )
+	{
+		--it;
+		
+		CEntry * const pEntry = *it;
+		if( pEntry->m_uUsers > 0 )
+			continue;
+		
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CImageCache::evict() - Dropping %s (%u bytes)\n", pEntry->m_key.first.c_str(), (unsigned int)pEntry->m_uBytes);
+		#endif
+		
+		m_uBytes -= pEntry->m_uBytes;
+		m_mapEntries.erase( pEntry->m_key );
+		it = m_listLRU.erase(it);
+		
+		cairo_surface_destroy( pEntry->m_pSurface );
+		delete pEntry;
+	}
+}
+
+uint64_t CImageCache::hash( const uint8_t * const pData, const size_t uSize, uint64_t uHash )
+{
+	for( size_t i = 0; i < uSize; ++i )
+	{
+		uHash ^= pData[i];
+		uHash *= 1099511628211ULL;
+	}
+	
+	return uHash;
+}
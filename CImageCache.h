@@ -0,0 +1,94 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_CIMAGECACHE
+#define H_CIMAGECACHE
+
+// Includes
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <list>
+
+// Include for image surfaces
+#include <cairo/cairo.h>
+
+/* Decoded images shared between plugin instances, keyed by the src argument
+ * and a hash of the compressed bytes. Entries with users are never evicted;
+ * the rest are dropped least recently used first once over the byte budget. */
+class CImageCache
+{
+	public: // Types
+		class CEntry
+		{
+			friend class CImageCache;
+			
+			public: // Functions
+				uint64_t getHash() const { return m_uHash; }
+				int getImageWidth() const { return m_iImageWidth; }
+				int getImageHeight() const { return m_iImageHeight; }
+				
+			private: // Variables
+				std::pair<std::string, uint64_t> m_key;
+				uint64_t m_uHash;
+				cairo_surface_t * m_pSurface;
+				int m_iImageWidth;
+				int m_iImageHeight;
+				size_t m_uBytes;
+				unsigned int m_uUsers;
+				std::list<CEntry *>::iterator m_itLRU;
+		};
+		
+	public: // Functions
+		CImageCache( const size_t uBudget );
+		~CImageCache();
+		
+		void setBudget( const size_t uBudget );
+		
+		/* Finds the most recent image for strSource decoded at least at the
+		 * given size (or at its natural size) and adds a user to it. The
+		 * entry's pixels may be replaced by insert() at any time, so
+		 * *ppSurface gets a reference of its own, to be destroyed by the
+		 * caller. */
+		CEntry * acquire( const std::string & strSource, const int iMinWidth, const int iMinHeight, cairo_surface_t ** const ppSurface );
+		
+		/* Adds or upgrades the image for strSource and uHash, and adds a user
+		 * to it. The cache takes its own reference to pSurface, and
+		 * *ppSurface gets a reference to whichever pixels the entry kept. */
+		CEntry * insert( const std::string & strSource, const uint64_t uHash, cairo_surface_t * const pSurface, const int iImageWidth, const int iImageHeight, cairo_surface_t ** const ppSurface );
+		
+		void release( CEntry * const pEntry );
+		
+		/* 64-bit FNV-1a, pass the previous result to hash data in pieces */
+		static uint64_t hash( const uint8_t * const pData, const size_t uSize, const uint64_t uHash = s_uHashBasis );
+		
+	public: // Variables
+		static const uint64_t s_uHashBasis;
+		
+	private: // Functions
+		void evict();
+		
+	private: // Variables
+		pthread_mutex_t m_mutexCache;
+		
+		std::map<std::pair<std::string, uint64_t>, CEntry *> m_mapEntries;
+		std::list<CEntry *> m_listLRU; // Most recently used first
+		
+		size_t m_uBudget;
+		size_t m_uBytes;
+};
+
+#endif
@@ -0,0 +1,208 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CImagePyramid.h"
+#include "CDecodeCore.h"
+
+// Includes
+#include <cstdio>
+
+pthread_mutex_t CImagePyramid::s_mutexPyramids = PTHREAD_MUTEX_INITIALIZER;
+std::set<CImagePyramid *> CImagePyramid::s_setPyramids;
+size_t CImagePyramid::s_uBudget = 32 * 1024 * 1024;
+size_t CImagePyramid::s_uBytes = 0;
+uint64_t CImagePyramid::s_uClock = 0;
+
+CImagePyramid::CImagePyramid( cairo_surface_t * const pBase )
+	:	m_pBase( cairo_surface_reference(pBase) )
+{
+	pthread_mutex_lock(&s_mutexPyramids);
+	s_setPyramids.insert(this);
+	pthread_mutex_unlock(&s_mutexPyramids);
+}
+
+CImagePyramid::~CImagePyramid()
+{
+	pthread_mutex_lock(&s_mutexPyramids);
+	
+	s_setPyramids.erase(this);
+	
+	for( std::vector<SLevel>::iterator it = m_vecLevels.begin(); it != m_vecLevels.end(); ++it )
+	{
+		if( it->pSurface != NULL )
+		{
+			s_uBytes -= getBytes(it->pSurface);
+			cairo_surface_destroy(it->pSurface);
+		}
+	}
+	
+	pthread_mutex_unlock(&s_mutexPyramids);
+	
+	cairo_surface_destroy(m_pBase);
+}
+
+cairo_surface_t * CImagePyramid::getBase() const
+{
+	return m_pBase;
+}
+
+cairo_surface_t * CImagePyramid::getLevel( const int iWidth, const int iHeight )
+{
+	// Count how many times we can halve and still cover the target
+	const int iBaseWidth = cairo_image_surface_get_width(m_pBase);
+	const int iBaseHeight = cairo_image_surface_get_height(m_pBase);
+	
+	size_t uLevels = 0;
+	while( (iBaseWidth >> (uLevels + 1)) >= iWidth && (iBaseHeight >> (uLevels + 1)) >= iHeight
+			&& (iBaseWidth >> (uLevels + 1)) > 0 && (iBaseHeight >> (uLevels + 1)) > 0 )
+		++uLevels;
+	
+	if( uLevels == 0 )
+		return m_pBase;
+	
+	pthread_mutex_lock(&s_mutexPyramids);
+	
+	++s_uClock;
+	
+	if( m_vecLevels.size() < uLevels )
+	{
+		SLevel empty = { NULL, 0 };
+		m_vecLevels.resize( uLevels, empty );
+	}
+	
+	// Build any missing level from the one above it
+	cairo_surface_t * pLevel = m_pBase;
+	for( size_t i = 0; i < uLevels; ++i )
+	{
+		SLevel & level = m_vecLevels[i];
+		
+		if( level.pSurface == NULL )
+		{
+			#ifdef WEBPNPAPI_DEBUG
+				printf("CImagePyramid::getLevel() - Building level %u\n", (unsigned int)(i + 1));
+			#endif
+			
+			level.pSurface = downsample(pLevel);
+			if( level.pSurface == NULL )
+				break;
+			
+			s_uBytes += getBytes(level.pSurface);
+		}
+		
+		level.uLastUse = s_uClock;
+		pLevel = level.pSurface;
+	}
+	
+	evict();
+	
+	pthread_mutex_unlock(&s_mutexPyramids);
+	return pLevel;
+}
+
+void CImagePyramid::setBudget( const size_t uBudget )
+{
+	pthread_mutex_lock(&s_mutexPyramids);
+	s_uBudget = uBudget;
+	evict();
+	pthread_mutex_unlock(&s_mutexPyramids);
+}
+
+cairo_surface_t * CImagePyramid::downsample( cairo_surface_t * const pSource )
+{
+	// 2x2 box filter, which is exact for halving and works on premultiplied
+	// pixels as they are
+	const int iWidth = cairo_image_surface_get_width(pSource) / 2;
+	const int iHeight = cairo_image_surface_get_height(pSource) / 2;
+	
+	cairo_surface_t * const pTarget = cairo_image_surface_create( cairo_image_surface_get_format(pSource), iWidth, iHeight );
+	if( cairo_surface_status(pTarget) != CAIRO_STATUS_SUCCESS )
+	{
+		cairo_surface_destroy(pTarget);
+		return NULL;
+	}
+	
+	cairo_surface_flush(pTarget);
+	
+	// Large levels are halved in strips on other threads too
+	SDownsample downsample;
+	downsample.pSource = pSource;
+	downsample.pTarget = pTarget;
+	CDecodeCore::runStrips( downsampleStrip, &downsample, 0, iHeight, iWidth );
+	
+	cairo_surface_mark_dirty(pTarget);
+	return pTarget;
+}
+
+void CImagePyramid::downsampleStrip( void * const pData, const int iFirstRow, const int iLastRow )
+{
+	const SDownsample * const pDownsample = static_cast<const SDownsample *>(pData);
+	const int iWidth = cairo_image_surface_get_width(pDownsample->pTarget);
+	const int iChannels = 4;
+	
+	const int iSourceStride = cairo_image_surface_get_stride(pDownsample->pSource);
+	const int iTargetStride = cairo_image_surface_get_stride(pDownsample->pTarget);
+	const unsigned char * const pSourcePixels = cairo_image_surface_get_data(pDownsample->pSource);
+	unsigned char * const pTargetPixels = cairo_image_surface_get_data(pDownsample->pTarget);
+	
+	for( int y = iFirstRow; y < iLastRow; ++y )
+	{
+		const unsigned char * pRow0 = pSourcePixels + (2 * y) * iSourceStride;
+		const unsigned char * pRow1 = pRow0 + iSourceStride;
+		unsigned char * pOut = pTargetPixels + y * iTargetStride;
+		
+		for( int x = 0; x < iWidth; ++x )
+		{
+			for( int c = 0; c < iChannels; ++c )
+				pOut[c] = ( pRow0[c] + pRow0[c + iChannels] + pRow1[c] + pRow1[c + iChannels] + 2 ) >> 2;
+			
+			pRow0 += 2 * iChannels;
+			pRow1 += 2 * iChannels;
+			pOut += iChannels;
+		}
+	}
+}
+
+size_t CImagePyramid::getBytes( cairo_surface_t * const pSurface )
+{
+	return (size_t)cairo_image_surface_get_stride(pSurface) * cairo_image_surface_get_height(pSurface);
+}
+
+void CImagePyramid::evict()
+{
+	// Must be called with s_mutexPyramids held. Levels used by the current
+	// call carry the current clock and are left alone.
+	while( s_uBytes > s_uBudget )
+	{
+		SLevel * pOldest = NULL;
+		
+		for( std::set<CImagePyramid *>::iterator it = s_setPyramids.begin(); it != s_setPyramids.end(); ++it )
+		{
+			std::vector<SLevel> & vecLevels = (*it)->m_vecLevels;
+			for( std::vector<SLevel>::iterator itLevel = vecLevels.begin(); itLevel != vecLevels.end(); ++itLevel )
+			{
+				if( itLevel->pSurface != NULL && itLevel->uLastUse != s_uClock
+						&& (pOldest == NULL || itLevel->uLastUse < pOldest->uLastUse) )
+					pOldest = &*itLevel;
+			}
+		}
+		
+		if( pOldest == NULL )
+			break;
+		
+		s_uBytes -= getBytes(pOldest->pSurface);
+		cairo_surface_destroy(pOldest->pSurface);
+		pOldest->pSurface = NULL;
+	}
+}
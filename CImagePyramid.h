@@ -0,0 +1,80 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_CIMAGEPYRAMID
+#define H_CIMAGEPYRAMID
+
+// Includes
+#include <pthread.h>
+#include <stdint.h>
+#include <set>
+#include <vector>
+
+// Include for image surfaces
+#include <cairo/cairo.h>
+
+/* Power-of-two downsampled copies of an image, built on demand so that a
+ * resize can start from the nearest larger level instead of full size.
+ * Levels of all pyramids share one byte budget and are dropped least
+ * recently used first; the full size image itself is never dropped. */
+class CImagePyramid
+{
+	public: // Functions
+		CImagePyramid( cairo_surface_t * const pBase );
+		~CImagePyramid();
+		
+		cairo_surface_t * getBase() const;
+		
+		/* Returns the smallest level at least iWidth x iHeight. No reference
+		 * is added, and the level may be evicted by the next call. */
+		cairo_surface_t * getLevel( const int iWidth, const int iHeight );
+		
+		static void setBudget( const size_t uBudget );
+		
+	private: // Types
+		struct SLevel
+		{
+			cairo_surface_t * pSurface;
+			uint64_t uLastUse;
+		};
+		
+		struct SDownsample
+		{
+			cairo_surface_t * pSource;
+			cairo_surface_t * pTarget;
+		};
+		
+	private: // Functions
+		static cairo_surface_t * downsample( cairo_surface_t * const pSource );
+		static void downsampleStrip( void * const pData, const int iFirstRow, const int iLastRow );
+		static size_t getBytes( cairo_surface_t * const pSurface );
+		static void evict();
+		
+		// Not copyable
+		CImagePyramid( const CImagePyramid & );
+		CImagePyramid & operator=( const CImagePyramid & );
+		
+	private: // Variables
+		cairo_surface_t * const m_pBase;
+		std::vector<SLevel> m_vecLevels; // Level i is 1/2^(i+1) of the base
+		
+		static pthread_mutex_t s_mutexPyramids;
+		static std::set<CImagePyramid *> s_setPyramids;
+		static size_t s_uBudget;
+		static size_t s_uBytes;
+		static uint64_t s_uClock;
+};
+
+#endif
@@ -0,0 +1,146 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CMemoryBudget.h"
+
+// Includes
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+
+namespace
+{
+	/* Orders candidates by when they were last visible */
+	bool seenEarlier( const std::pair<uint64_t, CMemoryBudget::CClient *> & a, const std::pair<uint64_t, CMemoryBudget::CClient *> & b )
+	{
+		return a.first < b.first;
+	}
+}
+
+CMemoryBudget::CMemoryBudget( const size_t uBudget )
+	:	m_uBudget(uBudget),
+		m_uBytes(0),
+		m_uClock(0)
+{
+	pthread_mutex_init(&m_mutexBudget, NULL);
+}
+
+CMemoryBudget::~CMemoryBudget()
+{
+	pthread_mutex_destroy(&m_mutexBudget);
+}
+
+void CMemoryBudget::setBudget( const size_t uBudget )
+{
+	pthread_mutex_lock(&m_mutexBudget);
+	m_uBudget = uBudget;
+	pthread_mutex_unlock(&m_mutexBudget);
+}
+
+void CMemoryBudget::add( CClient * const pClient )
+{
+	SClient client;
+	client.uBytes = 0;
+	client.bVisible = false;
+	client.uLastSeen = 0;
+	
+	pthread_mutex_lock(&m_mutexBudget);
+	m_mapClients.insert( std::make_pair(pClient, client) );
+	pthread_mutex_unlock(&m_mutexBudget);
+}
+
+void CMemoryBudget::remove( CClient * const pClient )
+{
+	pthread_mutex_lock(&m_mutexBudget);
+	
+	std::map<CClient *, SClient>::iterator it = m_mapClients.find(pClient);
+	if( it != m_mapClients.end() )
+	{
+		m_uBytes -= it->second.uBytes;
+		m_mapClients.erase(it);
+	}
+	
+	pthread_mutex_unlock(&m_mutexBudget);
+}
+
+void CMemoryBudget::setUsage( CClient * const pClient, const size_t uBytes )
+{
+	pthread_mutex_lock(&m_mutexBudget);
+	
+	std::map<CClient *, SClient>::iterator it = m_mapClients.find(pClient);
+	if( it != m_mapClients.end() )
+	{
+		m_uBytes = m_uBytes - it->second.uBytes + uBytes;
+		it->second.uBytes = uBytes;
+	}
+	
+	pthread_mutex_unlock(&m_mutexBudget);
+}
+
+void CMemoryBudget::setVisible( CClient * const pClient, const bool bVisible )
+{
+	pthread_mutex_lock(&m_mutexBudget);
+	
+	std::map<CClient *, SClient>::iterator it = m_mapClients.find(pClient);
+	if( it != m_mapClients.end() )
+	{
+		// Going out of view counts as the last time it was seen
+		if( it->second.bVisible && !bVisible )
+			it->second.uLastSeen = ++m_uClock;
+		
+		it->second.bVisible = bVisible;
+	}
+	
+	pthread_mutex_unlock(&m_mutexBudget);
+}
+
+void CMemoryBudget::trim()
+{
+	std::vector< std::pair<uint64_t, CClient *> > vecCandidates;
+	
+	pthread_mutex_lock(&m_mutexBudget);
+	
+	if( m_uBytes > m_uBudget )
+	{
+		for( std::map<CClient *, SClient>::const_iterator it = m_mapClients.begin(); it != m_mapClients.end(); ++it )
+		{
+			if( !it->second.bVisible && it->second.uBytes > 0 )
+				vecCandidates.push_back( std::make_pair(it->second.uLastSeen, it->first) );
+		}
+	}
+	
+	pthread_mutex_unlock(&m_mutexBudget);
+	
+	std::sort( vecCandidates.begin(), vecCandidates.end(), seenEarlier );
+	
+	// Clients release without our lock held, as they take their own locks
+	// and report back through setUsage()
+	for( size_t i = 0; i < vecCandidates.size(); ++i )
+	{
+		pthread_mutex_lock(&m_mutexBudget);
+		const size_t uBytes = m_uBytes;
+		const size_t uBudget = m_uBudget;
+		pthread_mutex_unlock(&m_mutexBudget);
+		
+		if( uBytes <= uBudget )
+			break;
+		
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CMemoryBudget::trim() - %u bytes in use, releasing an invisible instance\n", (unsigned int)uBytes);
+		#endif
+		
+		vecCandidates[i].second->releasePixels();
+	}
+}
@@ -0,0 +1,77 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_CMEMORYBUDGET
+#define H_CMEMORYBUDGET
+
+// Includes
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+
+/* Pixel memory of all plugin instances, held against one process wide
+ * budget. Instances report what they use and whether they are visible;
+ * once over budget, the instances that went out of view longest ago are
+ * asked to drop the pixels they can decode again later. */
+class CMemoryBudget
+{
+	public: // Types
+		class CClient
+		{
+			public:
+				virtual ~CClient() {}
+				
+				/* Frees whatever can be decoded again and reports the new
+				 * usage through setUsage() */
+				virtual void releasePixels() = 0;
+		};
+		
+	public: // Functions
+		CMemoryBudget( const size_t uBudget );
+		~CMemoryBudget();
+		
+		void setBudget( const size_t uBudget );
+		
+		void add( CClient * const pClient );
+		void remove( CClient * const pClient );
+		
+		/* May be called from any thread */
+		void setUsage( CClient * const pClient, const size_t uBytes );
+		void setVisible( CClient * const pClient, const bool bVisible );
+		
+		/* Asks invisible clients to release their pixels until we are back
+		 * under budget. Clients are only added, removed and released on the
+		 * browser thread, so this must be called there too. */
+		void trim();
+		
+	private: // Types
+		struct SClient
+		{
+			size_t uBytes;
+			bool bVisible;
+			uint64_t uLastSeen; // When it was last visible, by m_uClock
+		};
+		
+	private: // Variables
+		pthread_mutex_t m_mutexBudget;
+		
+		std::map<CClient *, SClient> m_mapClients;
+		
+		size_t m_uBudget;
+		size_t m_uBytes;
+		uint64_t m_uClock;
+};
+
+#endif
@@ -17,12 +17,19 @@
 
 // Includes
 #include <stdexcept>
+#include <algorithm>
+#include <cstddef>
 #include <webp/decode.h>
 #include <cstring>
 #include <cstdlib>
 #include <gtk/gtk.h>
 #include <gdk/gdkx.h>
-#include <fstream>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
 
 const std::string CPlugin::s_strPluginName("webp-npapi");
 const std::string CPlugin::s_strPluginDescription(" (Image viewer for WebP)");
@@ -30,9 +37,110 @@ const std::string CPlugin::s_strPluginVersion("1.0.0.0");
 	
 NPNetscapeFuncs * CPlugin::s_pBrowserFunctions = NULL;
 
+CWorkQueue CPlugin::s_decodeQueue;
+const size_t CPlugin::s_uDecodeSliceSize = CStreamBuffer::s_uBlockSize;
+const int32_t CPlugin::s_iMaxWriteSize = 4 * CStreamBuffer::s_uBlockSize;
+
+CWorkQueue CPlugin::s_saveQueue;
+CPlugin::CSaveJob CPlugin::s_saveJob;
+pthread_mutex_t CPlugin::s_mutexSaves = PTHREAD_MUTEX_INITIALIZER;
+std::deque<CPlugin::SSaveRequest *> CPlugin::s_dequeSaves;
+CPlugin::SSaveRequest * CPlugin::s_pSaveWriting = NULL;
+volatile unsigned long CPlugin::s_uNextSaveTemp = 0;
+
+CImageCache CPlugin::s_imageCache(0);
+const size_t CPlugin::s_uDefaultCacheSize = 64 * 1024 * 1024;
+
+CDiskCache CPlugin::s_diskCache;
+CPlugin::CStoreJob CPlugin::s_storeJob;
+pthread_mutex_t CPlugin::s_mutexStores = PTHREAD_MUTEX_INITIALIZER;
+std::deque<CPlugin::SDiskStore> CPlugin::s_dequeStores;
+const size_t CPlugin::s_uMaxPendingStores = 8;
+
+CMemoryBudget CPlugin::s_memoryBudget(0);
+const size_t CPlugin::s_uDefaultMemoryBudget = 256 * 1024 * 1024;
+
+int CPlugin::s_iLookAhead = 0;
+const int CPlugin::s_iDefaultLookAhead = 512;
+
+bool CPlugin::s_bSeekStreams = true;
+const uint32_t CPlugin::s_uSeekHeaderSize = 4096;
+
+std::set<CPlugin *> CPlugin::s_setInstances;
+unsigned long CPlugin::s_uNextInstanceId = 0;
+
 void CPlugin::setBrowserFunctions( NPNetscapeFuncs * const pBrowserFunctions )
 {
 	s_pBrowserFunctions = pBrowserFunctions;
+	CScriptObject::setBrowserFunctions( pBrowserFunctions );
+}
+
+bool CPlugin::initialize()
+{
+	CTrace::initialize();
+	
+	// Cache budget in megabytes can be overridden from the environment
+	size_t uCacheSize = s_uDefaultCacheSize;
+	const char * const szCacheSize = getenv("WEBPNPAPI_CACHE_MB");
+	if( szCacheSize != NULL )
+		uCacheSize = strtoul(szCacheSize, NULL, 10) * 1024 * 1024;
+	
+	s_imageCache.setBudget( uCacheSize );
+	
+	// The disk cache is shared by every browser process, so it is opt-in
+	const char * const szDiskCacheSize = getenv("WEBPNPAPI_DISK_CACHE_MB");
+	if( szDiskCacheSize != NULL )
+		s_diskCache.open( strtoul(szDiskCacheSize, NULL, 10) * 1024 * 1024 );
+	
+	size_t uMemoryBudget = s_uDefaultMemoryBudget;
+	const char * const szMemoryBudget = getenv("WEBPNPAPI_MEMORY_MB");
+	if( szMemoryBudget != NULL )
+		uMemoryBudget = strtoul(szMemoryBudget, NULL, 10) * 1024 * 1024;
+	
+	s_memoryBudget.setBudget( uMemoryBudget );
+	
+	s_iLookAhead = s_iDefaultLookAhead;
+	const char * const szLookAhead = getenv("WEBPNPAPI_LOOKAHEAD_PX");
+	if( szLookAhead != NULL )
+		s_iLookAhead = atoi(szLookAhead);
+	
+	// For hosts whose byte range requests misbehave
+	const char * const szSeek = getenv("WEBPNPAPI_SEEK");
+	if( szSeek != NULL )
+		s_bSeekStreams = atoi(szSeek) != 0;
+	
+	CScaler::initialize();
+	
+	const char * const szPyramidSize = getenv("WEBPNPAPI_PYRAMID_MB");
+	if( szPyramidSize != NULL )
+		CImagePyramid::setBudget( strtoul(szPyramidSize, NULL, 10) * 1024 * 1024 );
+	
+	const char * const szAnimationSize = getenv("WEBPNPAPI_ANIMATION_MB");
+	if( szAnimationSize != NULL )
+		CAnimation::setBudget( strtoul(szAnimationSize, NULL, 10) * 1024 * 1024 );
+	
+	// One decode thread per core
+	long lCores = sysconf(_SC_NPROCESSORS_ONLN);
+	if( lCores < 1 )
+		lCores = 1;
+	
+	// Large images are scaled in strips on the decode threads as well
+	CDecodeCore::setStripQueue( &s_decodeQueue, lCores );
+	
+	// Saves get a thread of their own, so they never wait for decoding.
+	// Disk cache writes share it, but a save goes first.
+	s_saveQueue.setPriority( &s_storeJob, -1 );
+	return s_decodeQueue.start( lCores ) && s_saveQueue.start( 1 );
+}
+
+void CPlugin::shutdown()
+{
+	// Finishes the files that are still being saved, but not the disk cache
+	s_saveQueue.stop();
+	discardPendingStores();
+	CDecodeCore::setStripQueue( NULL, 0 );
+	s_decodeQueue.stop();
+	CTrace::shutdown();
 }
 
 const std::string & CPlugin::getPluginName()
@@ -55,10 +163,69 @@ CPlugin::CPlugin( const NPP instance, const NPMIMEType mimeType, const uint16_t
 		m_bEmbedded( mode == NP_EMBED ),
 		m_mapArgs( mapArgs ),
 		m_npp(instance),
+		m_uInstanceId( ++s_uNextInstanceId ),
+		m_window(),
 		m_pStream(NULL),
-		m_pImageRawData(NULL),
-		m_pImagePixbuf(NULL),
-		m_pImageScaledPixbuf(NULL)
+		m_bStreamAsFile( mapArgs.count("stream") && mapArgs.find("stream")->second == "file" ),
+		m_pMappedData(NULL),
+		m_pSharedData(NULL),
+		m_bStreamDone(false),
+		m_bStreamFailed(false),
+		m_bSeekStream(false),
+		m_uStreamRequested(0),
+		m_eHeaderStatus(VP8_STATUS_NOT_ENOUGH_DATA),
+		m_decodeJob(this),
+		m_pIDecoder(NULL),
+		m_pDecodeSurface(NULL),
+		m_uDecodedBytes(0),
+		m_bDecodeComplete(false),
+		m_bDecodeFailed(false),
+		m_bAnimated(false),
+		m_uStreamHash(0),
+		m_bStreamHashed(false),
+		m_pCacheEntry(NULL),
+		m_pCacheSurface(NULL),
+		m_pImageSurface(NULL),
+		m_pImageScaledSurface(NULL),
+		m_pImagePyramid(NULL),
+		m_eScaleFilter( CScaler::getFilter(mapArgs.count("filter") ? mapArgs.find("filter")->second.c_str() : NULL) ),
+		m_iDecodedRows(0),
+		m_pSnapshot(NULL),
+		m_pRetiredSnapshots(NULL),
+		m_iImageWidth(0),
+		m_iImageHeight(0),
+		m_iTargetWidth( m_bHasSize ? getPixelArg(mapArgs, "width") : 0 ),
+		m_iTargetHeight( m_bHasSize ? getPixelArg(mapArgs, "height") : 0 ),
+		m_iHintWidth(0),
+		m_iHintHeight(0),
+		m_iScaledRows(0),
+		m_pScaledFrom(NULL),
+		m_bXRenderFailed(false),
+		m_pSurface(NULL),
+		m_iSurfaceWidth(0),
+		m_iSurfaceHeight(0),
+		m_iSurfaceRows(0),
+		m_xidDrawable(None),
+		m_gdkDrawable(NULL),
+		m_iInvalidFirstRow(0),
+		m_iInvalidLastRow(0),
+		m_bInvalidatePosted(false),
+		m_bInvalidateAll(false),
+		m_pAnimation(NULL),
+		m_iAnimFrame(0),
+		m_iAnimWanted(0),
+		m_iAnimLoops(0),
+		m_pAnimNextSurface(NULL),
+		m_bAnimFrameLate(false),
+		m_uAnimTimer(0),
+		m_bAnimPaused(false),
+		m_budgetClient(this),
+		m_bPixelsReleased(false),
+		m_bDecodeAllowed( !m_bEmbedded ),
+		m_eDecodeMode(DECODE_AUTO),
+		m_pScriptObject(NULL),
+		m_traceCounters(),
+		m_uStreamStart(0)
 {
 	#ifdef WEBPNPAPI_DEBUG
 		printf("CPlugin::CPlugin() - Constructor starts!\n");
@@ -77,8 +244,16 @@ CPlugin::CPlugin( const NPP instance, const NPMIMEType mimeType, const uint16_t
 	s_pBrowserFunctions->getvalue(instance, NPNVSupportsWindowless, &browserSupportsWindowless);
 	if( !browserSupportsWindowless )
 		throw std::runtime_error("Windowless mode not supported by the browser");
+	
+	// Decoded rows are handed back to the browser thread asynchronously
+	if( s_pBrowserFunctions->size < ( offsetof(NPNetscapeFuncs, pluginthreadasynccall) + sizeof(void*) ) 
+			|| s_pBrowserFunctions->pluginthreadasynccall == NULL )
+		throw std::runtime_error("NPN_PluginThreadAsyncCall not supported by the browser");
 
 	s_pBrowserFunctions->setvalue(instance, NPPVpluginWindowBool, (void*) false);
+	
+	if( !WebPInitDecoderConfig(&m_decoderConfig) )
+		throw std::runtime_error("libwebp version mismatch");
 
 	// Initialize mutexes
 	if( pthread_mutex_init(&m_mutexImage, NULL) != 0 )
@@ -109,6 +284,9 @@ CPlugin::CPlugin( const NPP instance, const NPMIMEType mimeType, const uint16_t
 	gtk_widget_show(gtkItemSavePNG);
 	gtk_widget_show(gtkItemSaveWebP);
 	gtk_widget_show(gtkItemAbout);
+	
+	s_setInstances.insert(this);
+	s_memoryBudget.add(&m_budgetClient);
 		
 	#ifdef WEBPNPAPI_DEBUG
 		printf("CPlugin::CPlugin() - Done\n");
@@ -117,6 +295,39 @@ CPlugin::CPlugin( const NPP instance, const NPMIMEType mimeType, const uint16_t
 
 CPlugin::~CPlugin()
 {
+	// Stop any pending async calls from reaching us
+	s_setInstances.erase(this);
+	s_memoryBudget.remove(&m_budgetClient);
+	CTrace::summary( this, m_traceCounters );
+	
+	// The page may hold on to the object for longer
+	if( m_pScriptObject != NULL )
+	{
+		m_pScriptObject->detach();
+		s_pBrowserFunctions->releaseobject( m_pScriptObject );
+	}
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::~CPlugin() - Cancelling decode\n");
+	#endif
+	
+	// Files we are still saving are written anyway, they just report to nobody
+	pthread_mutex_lock(&s_mutexSaves);
+	for( std::deque<SSaveRequest *>::const_iterator it = s_dequeSaves.begin(); it != s_dequeSaves.end(); ++it )
+	{
+		if( (*it)->pPlugin == this )
+			(*it)->pPlugin = NULL;
+	}
+	if( s_pSaveWriting != NULL && s_pSaveWriting->pPlugin == this )
+		s_pSaveWriting->pPlugin = NULL;
+	pthread_mutex_unlock(&s_mutexSaves);
+	
+	// Waits for at most one slice if the decoder is running right now
+	s_decodeQueue.cancel(&m_decodeJob);
+	unscheduleAnimationTimer();
+	
+	releaseCacheEntry();
+	
 	// Remove menu
 	gtk_widget_destroy(m_gtkMenu);
 	
@@ -130,24 +341,53 @@ CPlugin::~CPlugin()
 	pthread_mutex_destroy(&m_mutexStream);
 	
 	#ifdef WEBPNPAPI_DEBUG
-		printf("CPlugin::~CPlugin() - g_object_unref(m_pImageScaledPixbuf)\n");
+		printf("CPlugin::~CPlugin() - cairo_surface_destroy(m_pImageScaledSurface)\n");
 	#endif
 
-	if( m_pImageScaledPixbuf != NULL );
-		g_object_unref( m_pImageScaledPixbuf );
+	if( m_pImageScaledSurface != NULL )
+		cairo_surface_destroy( m_pImageScaledSurface );
+	
+	delete m_pImagePyramid;
+	
+	if( m_pSurface != NULL )
+		cairo_surface_destroy( m_pSurface );
+	
+	forgetDrawables();
 	
 	#ifdef WEBPNPAPI_DEBUG
-		printf("CPlugin::~CPlugin() - g_object_unref(m_pImagePixbuf)\n");
+		printf("CPlugin::~CPlugin() - cairo_surface_destroy(m_pImageSurface)\n");
 	#endif
 
-	if( m_pImagePixbuf != NULL )
-		g_object_unref( m_pImagePixbuf );
+	if( m_pImageSurface != NULL )
+		cairo_surface_destroy( m_pImageSurface );
+	
+	// The decode job is gone, nothing publishes any more
+	reclaimSnapshots();
+	if( m_pSnapshot != NULL )
+		releaseSnapshot( m_pSnapshot );
+	
+	if( m_pScaledFrom != NULL )
+		cairo_surface_destroy( m_pScaledFrom );
 		
 	#ifdef WEBPNPAPI_DEBUG
-		printf("CPlugin::~CPlugin() - free(m_pImageRawData)\n");
+		printf("CPlugin::~CPlugin() - WebPIDelete(m_pIDecoder)\n");
 	#endif	
 
-	free(m_pImageRawData); // We use free() since it's allocated by libwebp
+	if( m_pIDecoder != NULL )
+		WebPIDelete( m_pIDecoder );
+	
+	// Only set if the header was parsed but no rows were published
+	if( m_pDecodeSurface != NULL )
+		cairo_surface_destroy( m_pDecodeSurface );
+	
+	if( m_pAnimNextSurface != NULL )
+		cairo_surface_destroy( m_pAnimNextSurface );
+	
+	delete m_pAnimation;
+	
+	// Save dialogs may still hold on to it
+	if( m_pSharedData != NULL )
+		m_pSharedData->release();
 }
 
 NPError CPlugin::setWindow(const NPWindow * const window)
@@ -156,23 +396,98 @@ NPError CPlugin::setWindow(const NPWindow * const window)
 		printf("CPlugin::setWindow() - Window set\n");
 	#endif
 	
+	// The browser may replace its drawable on a resize, and X reuses XIDs
+	if( window->width != m_window.width || window->height != m_window.height )
+		forgetDrawables();
+	
 	m_window = *window;
+	
+	// Animations only play while some of the instance is visible
+	const bool bVisible = isVisible();
+	if( !bVisible && !m_bAnimPaused )
+	{
+		m_bAnimPaused = true;
+		unscheduleAnimationTimer();
+	}
+	else if( bVisible && m_bAnimPaused )
+	{
+		m_bAnimPaused = false;
+		scheduleAnimationTimer();
+	}
+	
+	s_memoryBudget.setVisible( &m_budgetClient, bVisible );
+	
+	// Moving may bring us, or others, close enough to the visible area
+	allowNearbyDecodes();
+	
+	if( bVisible && m_bPixelsReleased )
+		restorePixels();
+	
+	// The decoder targets the window size, and needs to run again if the
+	// window has grown past what we decoded
+	bool bRedecode = false;
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		m_iTargetWidth = m_window.width;
+		m_iTargetHeight = m_window.height;
+		bRedecode = needsRedecode();
+		
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	if( bRedecode )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CPlugin::setWindow() - Window grew to %ix%i, decoding again\n", m_window.width, m_window.height);
+		#endif
+		scheduleDecode();
+	}
+	
+	// Others may have become fair game by us coming into view
+	s_memoryBudget.trim();
+	
 	return NPERR_NO_ERROR;
 }
 
 NPError CPlugin::newStream(const NPMIMEType mimeType, const NPStream * const stream, const NPBool seekable, uint16_t * const stype)
 {
+	CTrace::CScope scope( "newStream", this );
+	if( CTrace::isEnabled() )
+		m_uStreamStart = CTrace::now();
+	
 	if( pthread_mutex_lock(&m_mutexStream) == 0 )
 	{
 		// We should only ever accept one stream
 		if( m_pStream == NULL && strcmp(mimeType, "image/webp") == 0)
 		{
-			// Pre-allocate memory if size is known
-			if( stream->end > 0 )
-				m_strStreamData.reserve( stream->end );
-
 			m_pStream = stream;
-			*stype = NP_NORMAL;
+			
+			// Embeds that are never scrolled to only cost us their header
+			m_bSeekStream = seekable && stream->end > 0 && !m_bStreamAsFile && s_bSeekStreams;
+			
+			// Pre-allocate memory if size is known and all of it is coming
+			if( stream->end > 0 && !m_bStreamAsFile && !m_bSeekStream )
+				m_streamData.reserve( stream->end );
+			
+			if( m_bStreamAsFile )
+				*stype = NP_ASFILEONLY;
+			else if( m_bSeekStream )
+				*stype = NP_SEEK;
+			else
+				*stype = NP_NORMAL;
+			
+			// Show a copy decoded by another instance right away, the stream
+			// is still needed to check that it really is the same image
+			if( attachCachedImage() )
+			{
+				NPRect rect;
+				rect.top = 0;
+				rect.left = 0;
+				rect.bottom = m_window.height;
+				rect.right = m_window.width;
+				
+				s_pBrowserFunctions->invalidaterect(m_npp, &rect);
+			}
 		}
 		else
 		{
@@ -184,6 +499,10 @@ NPError CPlugin::newStream(const NPMIMEType mimeType, const NPStream * const str
 		const bool bAccepted = (m_pStream != NULL);
 		pthread_mutex_unlock(&m_mutexStream);
 		
+		// Ranges can only be asked for once the browser knows the mode
+		if( bAccepted && m_bSeekStream )
+			s_pBrowserFunctions->pluginthreadasynccall( m_npp, asyncRequestRanges, this );
+		
 		if( bAccepted )
 			return NPERR_NO_ERROR;
 		else
@@ -200,52 +519,25 @@ NPError CPlugin::newStream(const NPMIMEType mimeType, const NPStream * const str
 
 NPError CPlugin::destroyStream(const NPStream * const stream, const NPReason reason)
 {
+	CTrace::CScope scope( "destroyStream", this );
+	
+	// Nothing more can be asked for, whatever the reason
+	if( m_pStream == stream )
+		m_bSeekStream = false;
+	
 	if( pthread_mutex_lock(&m_mutexStream) == 0 )
 	{
 		if( m_pStream == stream && reason == NPRES_DONE )
 		{
-			if( pthread_mutex_lock( &m_mutexImage ) == 0 )
-			{
-				int iWidth, iHeight;
-				m_pImageRawData = WebPDecodeRGB( (uint8_t *)(m_strStreamData.c_str()),m_strStreamData.size(), &iWidth, &iHeight);		
-				if( m_pImageRawData != NULL )
-				{
-					// Create pixbuf
-					m_pImagePixbuf = gdk_pixbuf_new_from_data(
-								m_pImageRawData, 
-								GDK_COLORSPACE_RGB, 
-								0, 8, iWidth, iHeight, iWidth * 3,
-								  NULL, NULL );
-								  
-					#ifdef WEBPNPAPI_DEBUG
-						printf("CPlugin::destroyStream() - Image decoded with size %ix%i, forcing redraw\n", iWidth, iHeight );
-					#endif
-					
-					// Force redraw
-					NPRect rect;
-					rect.top = 0;
-					rect.left = 0;
-					rect.bottom = m_window.height;
-					rect.right = m_window.width;
-					
-					s_pBrowserFunctions->invalidaterect(m_npp, &rect);
-					s_pBrowserFunctions->forceredraw(m_npp);
-				}
-				else
-				{
-					#ifdef WEBPNPAPI_DEBUG
-						printf("CPlugin::destroyStream() - Failed to decode image\n");
-					#endif
-				}
-				
-				pthread_mutex_unlock( &m_mutexImage );
-			}
-			else
-			{
-				#ifdef WEBPNPAPI_DEBUG
-					printf("CPlugin::destroyStream() - Failed to lock image mutex\n");
-				#endif
-			}
+			// Decoding has been running since the first write() if we were
+			// near view, the decode job invalidates the whole window once
+			// the last row is done
+			#ifdef WEBPNPAPI_DEBUG
+				printf("CPlugin::destroyStream() - Stream done after %u bytes\n", (unsigned int)getStreamSize());
+			#endif
+			
+			// Stream data is immutable from here on
+			m_bStreamDone = true;
 		}
 		else if( reason != NPRES_DONE )
 		{
@@ -253,8 +545,14 @@ NPError CPlugin::destroyStream(const NPStream * const stream, const NPReason rea
 				printf("CPlugin::destroyStream() - Stream destroyed but not done\n");
 			#endif		
 		}
-				
+		
+		const bool bStreamDone = m_bStreamDone;
 		pthread_mutex_unlock(&m_mutexStream);
+		
+		// Catch a resize that happened while we were still streaming
+		if( bStreamDone )
+			scheduleDecode();
+		
 		return NPERR_NO_ERROR;
 	}
 	else
@@ -272,10 +570,11 @@ int32_t CPlugin::writeReady(const NPStream * const stream)
 	
 	if( pthread_mutex_lock(&m_mutexStream) == 0 )
 	{
-		if( stream->end > 0 )
-			returnSize = stream->end - m_strStreamData.size();
-		else
-			returnSize = m_strStreamData.max_size() - m_strStreamData.size();
+		// Take a few blocks at a time, or just what is left if we know the size
+		returnSize = s_iMaxWriteSize;
+		
+		if( stream->end > m_streamData.size() && stream->end - m_streamData.size() < (uint32_t)s_iMaxWriteSize )
+			returnSize = stream->end - m_streamData.size();
 	
 		pthread_mutex_unlock( &m_mutexStream );
 	}
@@ -295,20 +594,66 @@ int32_t CPlugin::writeReady(const NPStream * const stream)
 
 int32_t CPlugin::write(const NPStream * const stream, const int32_t offset, const int32_t len, const void * const buffer)
 {	
-	if( pthread_mutex_lock(&m_mutexStream) == 0 )
+	CTrace::CScope scope( "write", this );
+	
+	if( CTrace::lock( &m_mutexStream, &m_traceCounters.uLockWaitUs ) == 0 )
 	{
 		int32_t returnLen = NPERR_GENERIC_ERROR;
+		bool bHeader = false;
+		bool bRangeDone = false;
+		bool bFailed = false;
 		
-		if( m_pStream == stream )
+		if( m_pStream == stream && !m_bStreamFailed )
 		{
-			if( len > 0 )
-				m_strStreamData.append( static_cast<const char *>(buffer), len );
+			// Browsers may still write() in file mode, the file has it all.
+			// In seek mode anything but the next bytes is a range we did not
+			// ask for.
+			if( len > 0 && !m_bStreamAsFile && ( !m_bSeekStream || (uint32_t)offset == m_streamData.size() ) )
+				bFailed = !m_streamData.append( buffer, len );
+			
+			bRangeDone = m_bSeekStream && m_streamData.size() >= m_uStreamRequested;
+			
+			// Only the first few writes get here
+			if( m_eHeaderStatus == VP8_STATUS_NOT_ENOUGH_DATA )
+				bHeader = sniffHeader() == VP8_STATUS_OK;
 			
 			returnLen = len;
 		}
+		
+		// Out of memory, a negative length makes the browser drop the stream
+		// and the decode job gives up once it sees m_bStreamFailed
+		if( bFailed )
+		{
+			#ifdef WEBPNPAPI_DEBUG
+				printf("CPlugin::write() - Out of memory after %u bytes\n", (unsigned int)m_streamData.size());
+			#endif
+			
+			m_bStreamFailed = true;
+			bRangeDone = false;
+			returnLen = -1;
+		}
 
 		pthread_mutex_unlock(&m_mutexStream);
 		
+		if( bHeader )
+			publishHeader();
+		
+		// Decide on the next range once we are out of the browser's write()
+		if( bRangeDone )
+			s_pBrowserFunctions->pluginthreadasynccall( m_npp, asyncRequestRanges, this );
+		
+		if( returnLen > 0 && CTrace::isEnabled() )
+		{
+			if( m_traceCounters.uBytesReceived == 0 && m_uStreamStart != 0 )
+				m_traceCounters.uFirstByteUs = CTrace::now() - m_uStreamStart;
+			
+			m_traceCounters.uBytesReceived += returnLen;
+			CTrace::counter( "bytes_received", this, m_traceCounters.uBytesReceived );
+		}
+		
+		if( ( returnLen > 0 || bFailed ) && !m_bStreamAsFile )
+			scheduleDecode();
+		
 		#ifdef WEBPNPAPI_DEBUG
 			printf("CPlugin::write() - Read %i bytes\n", returnLen);
 		#endif
@@ -324,230 +669,2131 @@ int32_t CPlugin::write(const NPStream * const stream, const int32_t offset, cons
 	}
 }
 
-int16_t CPlugin::handleEvent(const void * const pEvent)
+void CPlugin::scheduleDecode()
 {
-	const XEvent * const nativeEvent = static_cast<const XEvent * const>(pEvent);
+	// Embeds that may never be scrolled to only store their bytes
+	if( !m_bDecodeAllowed )
+		return;
 	
-	switch( nativeEvent->type )
-	{
-		case ButtonPress:
-		{
-			if( (nativeEvent->xbutton).button == Button3  )
-				spawnPopup();
-		}
-		break;
-		
-		case GraphicsExpose:
-		{
-			const XGraphicsExposeEvent * const pExpose = &nativeEvent->xgraphicsexpose;
-			
-			//GdkNativeWindow nativeWinId = (XID)(pExpose->drawable);
-			//GdkNativeWindow nativeWinId = (XID)(m_window.window);
-			//GdkDrawable * const gdkWindow = GDK_DRAWABLE( gdk_x11_window_foreign_new_for_display(pExpose->display, pExpose->drawable) );
-			//printf("drawable: %p\n", pExpose->drawable);
-			GdkPixmap * const gdkPixmap = gdk_pixmap_foreign_new(pExpose->drawable);
-						 
-			if( gdkPixmap )
-			{
-				gdk_drawable_set_colormap( GDK_DRAWABLE(gdkPixmap), gdk_colormap_get_system() ); // Should the colormap be freed?
-				drawWindow(gdkPixmap);
-				g_object_unref(gdkPixmap);
-			}
-			else
-			{
-				#ifdef WEBPNPAPI_DEBUG
-					printf("CPlugin::handleEvent() - No drawable\n");
-				#endif
-			}
-		}		
-		break;
-		
-		default:
-			return 0;
-		break;
-	}
-
-	return 1;
+	// Run inline if the decode threads are gone
+	if( !s_decodeQueue.push(&m_decodeJob) )
+		decodePending();
 }
 
-void CPlugin::drawWindow( GdkDrawable * const gdkDrawable )
+void CPlugin::allowDecode()
 {
+	if( m_bDecodeAllowed )
+		return;
+	
 	#ifdef WEBPNPAPI_DEBUG
-		printf("CPlugin::drawWindow() - Start\n");
+		printf("CPlugin::allowDecode() - %s is near view, decoding\n", getSource().c_str());
 	#endif
-					
-	if(!m_npp)
-		return;
-
-	// Make sure we have a pixbuf before we draw anything
-	if( pthread_mutex_trylock( &m_mutexImage ) == 0 )
-	{
-		if( m_pImagePixbuf != NULL )
-		{
-			// Scale image to window size
-			bool bScale = false;
-			
-			if( m_pImageScaledPixbuf == NULL )
-				bScale = true;
-			else if(gdk_pixbuf_get_height(m_pImageScaledPixbuf) != m_window.height 
-					|| gdk_pixbuf_get_width(m_pImageScaledPixbuf) != m_window.width)
-				bScale = true;
-
-			if( bScale )
-			{
-				if( m_pImageScaledPixbuf != NULL )
-					g_object_unref(m_pImageScaledPixbuf);
-
-				#ifdef WEBPNPAPI_DEBUG
-					printf("CPlugin::drawWindow() - Scaling to %ix%i\n", m_window.width, m_window.height);
-				#endif		
-							
-				m_pImageScaledPixbuf = gdk_pixbuf_scale_simple( m_pImagePixbuf, m_window.width, m_window.height, GDK_INTERP_BILINEAR );
-			}
-
-			// Paint to target area using Cairo
-			#ifdef WEBPNPAPI_DEBUG
-				printf("CPlugin::drawWindow() - Drawing commenced\n");
-			#endif
-			
-			cairo_t * pCairoContext = gdk_cairo_create(gdkDrawable);
-
-			gdk_cairo_set_source_pixbuf( pCairoContext, m_pImageScaledPixbuf, m_window.x, m_window.y );
-			cairo_rectangle( pCairoContext, m_window.x, m_window.y, m_window.width, m_window.height );
-			cairo_fill(pCairoContext);
-
-			cairo_destroy(pCairoContext);
-			
-			
-		}
-		else
-		{
-			#ifdef WEBPNPAPI_DEBUG
-				printf("CPlugin::drawWindow() - No pixbuf\n");
-			#endif
-		}		
-
-		pthread_mutex_unlock( &m_mutexImage );
-	}
-	else
-	{
-		#ifdef WEBPNPAPI_DEBUG
-			printf("CPlugin::drawWindow() - Mutex busy\n");
-		#endif	
-	}
+	
+	// Catch up on whatever has been streamed so far, and fetch the rest
+	// if we only had the header
+	m_bDecodeAllowed = true;
+	scheduleDecode();
+	requestRanges();
 }
 
-void CPlugin::spawnPopup()
-{
-	// Popup
-	gtk_menu_popup( GTK_MENU(m_gtkMenu) , NULL, NULL, NULL, NULL, 0, gtk_get_current_event_time() );
-	gtk_widget_show(m_gtkMenu);
-		
-	// Done
-	return;
-}
-		
-void CPlugin::saveAsPNG( GtkMenuItem * pItem, gpointer pThis )
+bool CPlugin::isNearView( const NPRect & view ) const
 {
-	/* A dirty solution, we copy all the data we need,
-	 * in the case that the instance is deleted before we finish here.
-	 * Ugly? Very. */
-	 
-	#ifdef WEBPNPAPI_DEBUG
-		printf("CPlugin::saveAsPNG() - Begin\n");
-	#endif
-		 
-	  
-	CPlugin * const pInstance = static_cast<CPlugin *>(pThis);
-	
-	std::string strFilename = "Unnamed";
-	std::map<std::string, std::string>::const_iterator itSrc = pInstance->m_mapArgs.find("src");
+	if( isVisible() )
+		return true;
 	
-	if( itSrc != pInstance->m_mapArgs.end() )
-		strFilename = itSrc->second;
-		
-	std::string::size_type posSuffix = strFilename.rfind(".");
-	if( posSuffix != std::string::npos )
-		strFilename.erase( posSuffix );
-	strFilename.append(".png");
+	if( m_eDecodeMode == DECODE_LAZY )
+		return false;
 	
-	#ifdef WEBPNPAPI_DEBUG
-		printf("CPlugin::saveAsPNG() - Trying to lock mutex.\n");
-	#endif
+	if( view.right <= view.left || view.bottom <= view.top || s_iLookAhead <= 0 || m_window.width == 0 || m_window.height == 0 )
+		return false;
 	
-	GdkPixbuf * pPixbufCopy = NULL;
-	if( pthread_mutex_lock( &pInstance->m_mutexImage ) == 0 )
-	{
-		#ifdef WEBPNPAPI_DEBUG
-			printf("CPlugin::saveAsPNG() - Copying pixbuf\n");
-		#endif
+	// Window and clip rectangles share the drawable's coordinates
+	const int64_t iLeft = (int64_t)m_window.x - s_iLookAhead;
+	const int64_t iTop = (int64_t)m_window.y - s_iLookAhead;
+	const int64_t iRight = (int64_t)m_window.x + m_window.width + s_iLookAhead;
+	const int64_t iBottom = (int64_t)m_window.y + m_window.height + s_iLookAhead;
 	
-		if( pInstance->m_pImagePixbuf != NULL )
-			pPixbufCopy = gdk_pixbuf_copy(pInstance->m_pImagePixbuf);
-				
-		pthread_mutex_unlock( &pInstance->m_mutexImage );
-	}
+	return iLeft < view.right && iRight > view.left && iTop < view.bottom && iBottom > view.top;
+}
+
+void CPlugin::allowNearbyDecodes()
+{
+	// Runs on the browser thread. We are never told where the viewport is,
+	// so the bounds of what all instances see stand in for it.
+	NPRect view;
+	view.top = view.left = view.bottom = view.right = 0;
 	
-	if( pPixbufCopy != NULL )
-	{ 
-		strFilename = saveFileDialog(strFilename);
-		if( !strFilename.empty() )
+	for( std::set<CPlugin *>::const_iterator it = s_setInstances.begin(); it != s_setInstances.end(); ++it )
+	{
+		const NPRect & clip = (*it)->m_window.clipRect;
+		if( clip.right <= clip.left || clip.bottom <= clip.top )
+			continue;
+		
+		if( view.right <= view.left )
+			view = clip;
+		else
 		{
-			GError * err = NULL; // Initialize to null
-			gdk_pixbuf_save( pPixbufCopy, strFilename.c_str(), "png", &err, NULL); // Save as png and discard errors. We can't do anything.
-			//printf("Saving file resulted in the following message: %s", err->message);
+			view.left = std::min( view.left, clip.left );
+			view.top = std::min( view.top, clip.top );
+			view.right = std::max( view.right, clip.right );
+			view.bottom = std::max( view.bottom, clip.bottom );
 		}
-		
-		g_object_unref(pPixbufCopy);
+	}
+	
+	for( std::set<CPlugin *>::const_iterator it = s_setInstances.begin(); it != s_setInstances.end(); ++it )
+	{
+		if( !(*it)->m_bDecodeAllowed && (*it)->isNearView( view ) )
+			(*it)->allowDecode();
 	}
 }
 
-void CPlugin::saveAsWebP( GtkMenuItem * pItem, gpointer pThis )
+void CPlugin::decodePending()
 {
-	/* A dirty solution, we copy all the data we need,
-	 * in the case that the instance is deleted before we finish here.
-	 * Ugly? Very. */
-	 
-	CPlugin * const pInstance = static_cast<CPlugin *>(pThis);
-	
-	bool bHasImage = false;
-	std::string strStreamCopy;
-	
-	// Check if instance has a pixbuf
-	if( pthread_mutex_lock( &pInstance->m_mutexImage ) == 0 )
+	// Runs on a decode thread. Rows are shown as they arrive until the
+	// stream is done.
+	if( !isStreamDone() )
 	{
-		if( pInstance->m_pImagePixbuf != NULL )
-			bHasImage = true;
+		decodeStream();
 		
-		pthread_mutex_unlock( &pInstance->m_mutexImage );
+		if( m_decodeJob.isCancelled() || !isStreamDone() )
+			return;
 	}
 	
-	if( bHasImage )
+	// The rest needs all of the compressed bytes, which no longer change.
+	// From here on the bytes are shared, so saving never has to copy them.
+	// A stream whose size was known is a single block already.
+	linearizeStreamData();
+	
+	if( !m_bStreamHashed )
 	{
-		// Copy stream data
-		if( pthread_mutex_lock( &pInstance->m_mutexStream ) == 0 )
+		const uint8_t * pSegment;
+		size_t uOffset = 0, uSegmentSize;
+		
+		// In slices, a mapped file is a single segment however large
+		uint64_t uHash = CImageCache::s_uHashBasis;
+		while( (uSegmentSize = std::min( getStreamSegment(uOffset, &pSegment), s_uDecodeSliceSize )) > 0 )
 		{
-			strStreamCopy = pInstance->m_strStreamData;
-			pthread_mutex_unlock( &pInstance->m_mutexStream );
+			if( m_decodeJob.isCancelled() )
+				return;
+			
+			uHash = CImageCache::hash( pSegment, uSegmentSize, uHash );
+			uOffset += uSegmentSize;
 		}
 		
-		// Open dialog
-		std::string strFilename = "Unnamed";
-		std::map<std::string, std::string>::const_iterator itSrc = pInstance->m_mapArgs.find("src");
-		if( itSrc != pInstance->m_mapArgs.end() )
-			strFilename = itSrc->second;
-		strFilename = saveFileDialog(strFilename);
+		m_uStreamHash = uHash;
+		m_bStreamHashed = true;
 		
-		if( !strFilename.empty() )
-		{
-			// Output as WebP
-			std::ofstream fileOut( strFilename.c_str() );
-			if( fileOut.is_open() )
-			{
-				fileOut.write( strStreamCopy.c_str(), strStreamCopy.size() );
+		// The image we borrowed turned out to be different, decode our own
+		verifyCachedImage();
+	}
+	
+	// Pixels from an earlier session beat decoding what is left
+	if( !m_bDecodeComplete && !m_bAnimated )
+		loadDiskImage();
+	
+	decodeStream();
+	
+	if( m_decodeJob.isCancelled() )
+		return;
+	
+	if( m_bAnimated )
+	{
+		decodeAnimation();
+		return;
+	}
+	
+	if( !m_bDecodeComplete )
+		return;
+	
+	bool bRedecode = false;
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		bRedecode = needsRedecode();
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	if( bRedecode )
+		redecode();
+	
+	if( m_decodeJob.isCancelled() )
+		return;
+	
+	updateCache();
+	storeDiskImage();
+}
+
+bool CPlugin::isStreamDone()
+{
+	bool bStreamDone = false;
+	if( pthread_mutex_lock(&m_mutexStream) == 0 )
+	{
+		bStreamDone = m_bStreamDone;
+		pthread_mutex_unlock(&m_mutexStream);
+	}
+	
+	return bStreamDone;
+}
+
+void CPlugin::decodeStream()
+{
+	// Data is handed to the decoder in slices so that cancellation never
+	// has to wait for a whole image
+	while( !m_decodeJob.isCancelled() && !m_bDecodeComplete && !m_bDecodeFailed && !m_bAnimated )
+	{
+		if( m_pIDecoder == NULL && !createDecoder() )
+			break;
+		
+		if( CTrace::lock( &m_mutexStream, &m_traceCounters.uLockWaitUs ) != 0 )
+			break;
+		
+		// Stored bytes never move, so the decoder can read them after we
+		// let go of the lock. A mapped file is a single segment.
+		const uint8_t * const pMappedData = m_pMappedData;
+		const uint8_t * pSlice;
+		const size_t uSliceSize = std::min( getStreamSegment(m_uDecodedBytes, &pSlice), s_uDecodeSliceSize );
+		m_uDecodedBytes += uSliceSize;
+		
+		// write() ran out of memory, what we have will never be whole
+		const bool bStreamFailed = m_bStreamFailed;
+		
+		pthread_mutex_unlock(&m_mutexStream);
+		
+		if( bStreamFailed )
+		{
+			m_bDecodeFailed = true;
+			break;
+		}
+		
+		if( uSliceSize == 0 )
+			break;
+		
+		VP8StatusCode status;
+		{
+			CTrace::CScope scope( "decodeSlice", this, &m_traceCounters.uDecodeUs );
+			
+			if( pMappedData != NULL )
+				status = WebPIUpdate( m_pIDecoder, pMappedData, m_uDecodedBytes );
+			else
+				status = WebPIAppend( m_pIDecoder, pSlice, uSliceSize );
+		}
+		
+		if( status != VP8_STATUS_OK && status != VP8_STATUS_SUSPENDED )
+		{
+			#ifdef WEBPNPAPI_DEBUG
+				printf("CPlugin::decodeStream() - Decoder failed with status %i\n", status);
+			#endif
+			m_bDecodeFailed = true;
+			break;
+		}
+		
+		publishRows( status == VP8_STATUS_OK );
+		
+		if( status == VP8_STATUS_OK )
+		{
+			// The pixels live on in m_pImageSurface
+			WebPIDelete( m_pIDecoder );
+			m_pIDecoder = NULL;
+			m_bDecodeComplete = true;
+		}
+	}
+}
+
+void CPlugin::decodeAnimation()
+{
+	// Runs on a decode thread once the stream is done
+	if( m_bDecodeFailed )
+		return;
+	
+	if( m_pAnimation == NULL )
+	{
+		CAnimation * pAnimation = NULL;
+		try
+		{
+			pAnimation = new CAnimation( linearizeStreamData(), getStreamSize() );
+		}
+		catch( std::exception & e )
+		{
+			#ifdef WEBPNPAPI_DEBUG
+				printf("CPlugin::decodeAnimation() - %s\n", e.what());
+			#endif
+			m_bDecodeFailed = true;
+			return;
+		}
+		
+		if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+		{
+			m_pAnimation = pAnimation;
+			m_iImageWidth = pAnimation->getWidth();
+			m_iImageHeight = pAnimation->getHeight();
+			
+			pthread_mutex_unlock( &m_mutexImage );
+		}
+		else
+		{
+			delete pAnimation;
+			return;
+		}
+	}
+	
+	// Prepare whichever frame the browser thread is going to show next
+	while( !m_decodeJob.isCancelled() )
+	{
+		int iWanted = -1;
+		if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+		{
+			if( m_pAnimNextSurface == NULL )
+				iWanted = m_iAnimWanted;
+			pthread_mutex_unlock( &m_mutexImage );
+		}
+		
+		if( iWanted < 0 )
+			break;
+		
+		cairo_surface_t * pFrame;
+		{
+			CTrace::CScope scope( "decodeFrame", this, &m_traceCounters.uDecodeUs );
+			pFrame = m_pAnimation->getFrame( iWanted );
+		}
+		
+		if( pFrame == NULL )
+		{
+			m_bDecodeFailed = true;
+			break;
+		}
+		
+		bool bPost = false;
+		if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+		{
+			if( iWanted != m_iAnimWanted )
+				cairo_surface_destroy( pFrame );
+			else if( m_pImageSurface == NULL )
+			{
+				// The first frame goes on screen right away
+				m_pImageSurface = pFrame;
+				m_iDecodedRows = m_pAnimation->getHeight();
+				publishSnapshot();
+				m_iAnimFrame = iWanted;
+				m_iAnimWanted = m_pAnimation->getFrameCount() > 1 ? iWanted + 1 : -1;
+				m_bInvalidateAll = true;
+				bPost = true;
+			}
+			else
+			{
+				m_pAnimNextSurface = pFrame;
+				bPost = m_bAnimFrameLate;
+			}
+			
+			pthread_mutex_unlock( &m_mutexImage );
+		}
+		else
+			cairo_surface_destroy( pFrame );
+		
+		if( bPost )
+			s_pBrowserFunctions->pluginthreadasynccall( m_npp, asyncAnimate, this );
+	}
+}
+
+VP8StatusCode CPlugin::sniffHeader()
+{
+	// Must be called with m_mutexStream held. The header always fits in the
+	// first block, and is parsed once it is all there.
+	if( m_eHeaderStatus == VP8_STATUS_NOT_ENOUGH_DATA )
+	{
+		const uint8_t * pHeader;
+		const size_t uHeaderSize = getStreamSegment( 0, &pHeader );
+		
+		if( uHeaderSize > 0 )
+			m_eHeaderStatus = WebPGetFeatures( pHeader, uHeaderSize, &m_headerFeatures );
+	}
+	
+	return m_eHeaderStatus;
+}
+
+void CPlugin::publishHeader()
+{
+	// Script sees the size before any pixels exist. m_headerFeatures no
+	// longer changes once parsed.
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		if( m_iImageWidth == 0 )
+		{
+			m_iImageWidth = m_headerFeatures.width;
+			m_iImageHeight = m_headerFeatures.height;
+		}
+		
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::publishHeader() - Image is %ix%i%s%s\n", m_headerFeatures.width, m_headerFeatures.height,
+				m_headerFeatures.has_alpha ? ", alpha" : "", m_headerFeatures.has_animation ? ", animated" : "");
+	#endif
+}
+
+bool CPlugin::createDecoder()
+{
+	// We need the header to pick the decode size, which write() has
+	// usually parsed already
+	VP8StatusCode status = VP8_STATUS_NOT_ENOUGH_DATA;
+	if( pthread_mutex_lock(&m_mutexStream) == 0 )
+	{
+		status = m_bStreamFailed ? VP8_STATUS_OUT_OF_MEMORY : sniffHeader();
+		if( status == VP8_STATUS_OK )
+			m_decoderConfig.input = m_headerFeatures;
+		pthread_mutex_unlock(&m_mutexStream);
+	}
+	
+	if( status == VP8_STATUS_NOT_ENOUGH_DATA )
+		return false;
+	
+	if( status != VP8_STATUS_OK )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CPlugin::createDecoder() - Invalid header, status %i\n", status);
+		#endif
+		m_bDecodeFailed = true;
+		return false;
+	}
+	
+	// The incremental decoder does not do animations, those are decoded
+	// from the whole stream once it is done
+	if( m_decoderConfig.input.has_animation )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CPlugin::createDecoder() - Animated image, waiting for the whole stream\n");
+		#endif
+		
+		m_bAnimated = true;
+		return false;
+	}
+	
+	int iWidth = 0, iHeight = 0;
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		m_iImageWidth = m_decoderConfig.input.width;
+		m_iImageHeight = m_decoderConfig.input.height;
+		getDecodeSize( iWidth, iHeight );
+		
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	// Let libwebp scale while decoding instead of scaling a full size image later
+	m_decoderConfig.options.use_scaling = ( iWidth != m_decoderConfig.input.width || iHeight != m_decoderConfig.input.height );
+	m_decoderConfig.options.scaled_width = iWidth;
+	m_decoderConfig.options.scaled_height = iHeight;
+	m_decoderConfig.options.use_threads = CDecodeCore::isLarge( m_decoderConfig.input.width, m_decoderConfig.input.height );
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::createDecoder() - Image is %ix%i, decoding at %ix%i\n", 
+			m_decoderConfig.input.width, m_decoderConfig.input.height, iWidth, iHeight);
+	#endif
+	
+	// Rows go straight into the pixels cairo paints from
+	if( m_pDecodeSurface != NULL )
+		cairo_surface_destroy( m_pDecodeSurface );
+	
+	m_pDecodeSurface = CDecodeCore::createImageSurface( m_decoderConfig, iWidth, iHeight, m_decoderConfig.input.has_alpha );
+	if( m_pDecodeSurface == NULL )
+	{
+		m_bDecodeFailed = true;
+		return false;
+	}
+	
+	// The decoder keeps pointers into m_decoderConfig
+	m_pIDecoder = WebPIDecode( NULL, 0, &m_decoderConfig );
+	
+	if( m_pIDecoder == NULL )
+		m_bDecodeFailed = true;
+	
+	return m_pIDecoder != NULL;
+}
+
+void CPlugin::publishRows( const bool bComplete )
+{
+	int iLastRow, iWidth, iHeight, iStride;
+	uint8_t * const pRows = WebPIDecGetRGB( m_pIDecoder, &iLastRow, &iWidth, &iHeight, &iStride );
+	
+	// Header not parsed yet or no complete rows
+	if( pRows == NULL || iLastRow <= 0 )
+		return;
+	
+	bool bPost = false;
+	if( CTrace::lock( &m_mutexImage, &m_traceCounters.uLockWaitUs ) == 0 )
+	{
+		// The decoder keeps writing to the same pixels, hand them over the
+		// first time there is something to see
+		if( m_pImageSurface == NULL )
+		{
+			m_pImageSurface = m_pDecodeSurface;
+			m_pDecodeSurface = NULL;
+		}
+		
+		if( iLastRow > m_iDecodedRows )
+		{
+			// Grow the band that the browser thread has yet to invalidate
+			if( m_iInvalidLastRow == m_iInvalidFirstRow )
+				m_iInvalidFirstRow = m_iDecodedRows;
+			m_iInvalidLastRow = iLastRow;
+			
+			#ifdef WEBPNPAPI_DEBUG
+				printf("CPlugin::publishRows() - Rows %i to %i of %i decoded\n", m_iDecodedRows, iLastRow, iHeight);
+			#endif
+			
+			m_iDecodedRows = iLastRow;
+			publishSnapshot();
+		}
+		
+		if( bComplete )
+			m_bInvalidateAll = true;
+		
+		// One async call in flight at a time is enough
+		if( !m_bInvalidatePosted && (m_bInvalidateAll || m_iInvalidLastRow > m_iInvalidFirstRow) )
+		{
+			m_bInvalidatePosted = true;
+			bPost = true;
+		}
+		
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	if( bPost )
+		s_pBrowserFunctions->pluginthreadasynccall( m_npp, asyncInvalidate, this );
+}
+
+void CPlugin::publishSnapshot()
+{
+	// Must be called with m_mutexImage held, which keeps publishers in order
+	SSnapshot * const pSnapshot = new SSnapshot;
+	pSnapshot->pSurface = m_pImageSurface != NULL ? cairo_surface_reference( m_pImageSurface ) : NULL;
+	pSnapshot->iRows = m_pImageSurface != NULL ? m_iDecodedRows : 0;
+	pSnapshot->iImageWidth = m_iImageWidth;
+	pSnapshot->iImageHeight = m_iImageHeight;
+	pSnapshot->bAnimated = m_pAnimation != NULL;
+	pSnapshot->iRefs = 1; // Held by m_pSnapshot until retired
+	pSnapshot->pNextRetired = NULL;
+	
+	// The fields have to be visible before the pointer is
+	__sync_synchronize();
+	SSnapshot * const pOld = __sync_lock_test_and_set( &m_pSnapshot, pSnapshot );
+	
+	if( pOld == NULL )
+		return;
+	
+	// Readers may still be looking at it, so leave it to the browser thread.
+	// It only ever takes the whole list, so a plain push is safe.
+	do
+	{
+		pOld->pNextRetired = m_pRetiredSnapshots;
+	}
+	while( !__sync_bool_compare_and_swap( &m_pRetiredSnapshots, pOld->pNextRetired, pOld ) );
+}
+
+CPlugin::SSnapshot * CPlugin::loadSnapshot()
+{
+	// Any thread may read the pointer, but only the browser thread may use
+	// the snapshot without taking a reference
+	return __sync_val_compare_and_swap( &m_pSnapshot, (SSnapshot *)NULL, (SSnapshot *)NULL );
+}
+
+void CPlugin::reclaimSnapshots()
+{
+	// Runs on the browser thread, between reads
+	SSnapshot * pRetired = __sync_lock_test_and_set( &m_pRetiredSnapshots, (SSnapshot *)NULL );
+	
+	while( pRetired != NULL )
+	{
+		SSnapshot * const pNext = pRetired->pNextRetired;
+		releaseSnapshot( pRetired );
+		pRetired = pNext;
+	}
+}
+
+void CPlugin::releaseSnapshot( SSnapshot * const pSnapshot )
+{
+	if( __sync_sub_and_fetch( &pSnapshot->iRefs, 1 ) > 0 )
+		return;
+	
+	if( pSnapshot->pSurface != NULL )
+		cairo_surface_destroy( pSnapshot->pSurface );
+	
+	delete pSnapshot;
+}
+
+void CPlugin::redecode()
+{
+	// Runs on a decode thread once the stream is done, so the stream data
+	// no longer changes and can be read without the lock
+	int iWidth = 0, iHeight = 0;
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		getDecodeSize( iWidth, iHeight );
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::redecode() - Decoding again at %ix%i\n", iWidth, iHeight);
+	#endif
+	
+	CTrace::CScope scope( "redecode", this, &m_traceCounters.uDecodeUs );
+	const uint8_t * const pData = linearizeStreamData();
+	
+	cairo_surface_t * const pImage = pData != NULL ? CDecodeCore::decode( pData, getStreamSize(), iWidth, iHeight, &m_decodeJob ) : NULL;
+	if( pImage == NULL )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CPlugin::redecode() - Failed to decode image, or cancelled\n");
+		#endif
+		return;
+	}
+	
+	// Swap in the new pixels, the old ones can go once nobody paints them
+	bool bPost = false;
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		if( m_pImageSurface != NULL )
+			cairo_surface_destroy( m_pImageSurface );
+		
+		m_pImageSurface = pImage;
+		m_iDecodedRows = iHeight;
+		publishSnapshot();
+		
+		m_bInvalidateAll = true;
+		bPost = !m_bInvalidatePosted;
+		m_bInvalidatePosted = true;
+		
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	else
+		cairo_surface_destroy( pImage );
+	
+	if( bPost )
+		s_pBrowserFunctions->pluginthreadasynccall( m_npp, asyncInvalidate, this );
+}
+
+void CPlugin::getDecodeSize( int & iWidth, int & iHeight ) const
+{
+	// Must be called with m_mutexImage held. Never decode larger than the
+	// image itself, and fall back to full size before we know the window.
+	iWidth = m_iImageWidth;
+	iHeight = m_iImageHeight;
+	
+	// A size asked for from script wins over the window
+	const bool bHint = m_iHintWidth > 0 && m_iHintHeight > 0;
+	const int iTargetWidth = bHint ? m_iHintWidth : m_iTargetWidth;
+	const int iTargetHeight = bHint ? m_iHintHeight : m_iTargetHeight;
+	
+	if( iTargetWidth > 0 && iTargetWidth < iWidth )
+		iWidth = iTargetWidth;
+	if( iTargetHeight > 0 && iTargetHeight < iHeight )
+		iHeight = iTargetHeight;
+}
+
+bool CPlugin::needsRedecode() const
+{
+	// Must be called with m_mutexImage held
+	if( !isImageComplete() )
+		return false;
+	
+	int iWidth, iHeight;
+	getDecodeSize( iWidth, iHeight );
+	
+	return iWidth > cairo_image_surface_get_width( m_pImageSurface ) || iHeight > cairo_image_surface_get_height( m_pImageSurface );
+}
+
+bool CPlugin::attachCachedImage()
+{
+	// Called from newStream(), before the decode job has run
+	if( getSource().empty() )
+		return false;
+	
+	int iMinWidth = 0, iMinHeight = 0;
+	if( pthread_mutex_lock( &m_mutexImage ) != 0 )
+		return false;
+	
+	iMinWidth = m_iTargetWidth;
+	iMinHeight = m_iTargetHeight;
+	pthread_mutex_unlock( &m_mutexImage );
+	
+	cairo_surface_t * pShared = NULL;
+	CImageCache::CEntry * const pEntry = s_imageCache.acquire( getSource(), iMinWidth, iMinHeight, &pShared );
+	if( pEntry == NULL )
+		return false;
+	
+	// Under the lock, getPixelBytes() looks at m_pCacheSurface
+	if( pthread_mutex_lock( &m_mutexImage ) != 0 )
+	{
+		cairo_surface_destroy( pShared );
+		s_imageCache.release( pEntry );
+		return false;
+	}
+	
+	m_pCacheEntry = pEntry;
+	m_pCacheSurface = pShared;
+	m_pImageSurface = cairo_surface_reference( m_pCacheSurface );
+	m_iDecodedRows = cairo_image_surface_get_height( m_pImageSurface );
+	m_iImageWidth = m_pCacheEntry->getImageWidth();
+	m_iImageHeight = m_pCacheEntry->getImageHeight();
+	publishSnapshot();
+	
+	pthread_mutex_unlock( &m_mutexImage );
+	
+	m_bDecodeComplete = true;
+	return true;
+}
+
+bool CPlugin::verifyCachedImage()
+{
+	// Runs on a decode thread once m_uStreamHash is known
+	if( m_pCacheEntry == NULL || m_pCacheEntry->getHash() == m_uStreamHash )
+		return true;
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::verifyCachedImage() - Cached image for %s is stale\n", getSource().c_str());
+	#endif
+	
+	releaseCacheEntry();
+	
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		if( m_pImageSurface != NULL )
+			cairo_surface_destroy( m_pImageSurface );
+		
+		m_pImageSurface = NULL;
+		m_iDecodedRows = 0;
+		publishSnapshot();
+		
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	// Start over from the first byte
+	m_bDecodeComplete = false;
+	m_uDecodedBytes = 0;
+	return false;
+}
+
+void CPlugin::releaseCacheEntry()
+{
+	// Detached under the lock, getPixelBytes() looks at m_pCacheSurface
+	cairo_surface_t * pSurface = NULL;
+	CImageCache::CEntry * pEntry = NULL;
+	
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		pSurface = m_pCacheSurface;
+		pEntry = m_pCacheEntry;
+		m_pCacheSurface = NULL;
+		m_pCacheEntry = NULL;
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	if( pSurface != NULL )
+		cairo_surface_destroy( pSurface );
+	
+	if( pEntry != NULL )
+		s_imageCache.release( pEntry );
+}
+
+void CPlugin::updateCache()
+{
+	// Runs on a decode thread with a complete image
+	if( getSource().empty() )
+		return;
+	
+	cairo_surface_t * pImage = NULL;
+	int iImageWidth = 0, iImageHeight = 0;
+	
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		if( m_pImageSurface != NULL )
+			pImage = cairo_surface_reference( m_pImageSurface );
+		
+		iImageWidth = m_iImageWidth;
+		iImageHeight = m_iImageHeight;
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	if( pImage == NULL )
+		return;
+	
+	// Share our pixels unless we are already sharing these exact ones. We
+	// hold a reference to those, so the comparison cannot be fooled by a
+	// surface freed and allocated again at the same address.
+	if( m_pCacheEntry == NULL || m_pCacheSurface != pImage )
+	{
+		cairo_surface_t * pShared = NULL;
+		CImageCache::CEntry * const pEntry = s_imageCache.insert( getSource(), m_uStreamHash, pImage, iImageWidth, iImageHeight, &pShared );
+		
+		releaseCacheEntry();
+		
+		if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+		{
+			m_pCacheEntry = pEntry;
+			m_pCacheSurface = pShared;
+			pthread_mutex_unlock( &m_mutexImage );
+		}
+		else
+		{
+			if( pShared != NULL )
+				cairo_surface_destroy( pShared );
+			if( pEntry != NULL )
+				s_imageCache.release( pEntry );
+		}
+	}
+	
+	cairo_surface_destroy( pImage );
+}
+
+bool CPlugin::loadDiskImage()
+{
+	// Runs on a decode thread once m_uStreamHash is known. Animations are
+	// not cached, so the header has to say this is a still image. Pages are
+	// mapped lazily, so a cancelled job never waits here for the disk.
+	if( !s_diskCache.isEnabled() || m_eHeaderStatus != VP8_STATUS_OK || m_headerFeatures.has_animation || m_decodeJob.isCancelled() )
+		return false;
+	
+	int iWidth = 0, iHeight = 0;
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		getDecodeSize( iWidth, iHeight );
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	cairo_surface_t * pImage;
+	{
+		CTrace::CScope scope( "loadDiskImage", this, &m_traceCounters.uDecodeUs );
+		pImage = s_diskCache.load( m_uStreamHash, getStreamSize(), iWidth, iHeight );
+	}
+	
+	if( pImage == NULL )
+		return false;
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::loadDiskImage() - Found %ix%i pixels for %s on disk\n", iWidth, iHeight, getSource().c_str());
+	#endif
+	
+	// Whatever was decoded so far is not needed any more
+	if( m_pIDecoder != NULL )
+	{
+		WebPIDelete( m_pIDecoder );
+		m_pIDecoder = NULL;
+	}
+	
+	if( m_pDecodeSurface != NULL )
+	{
+		cairo_surface_destroy( m_pDecodeSurface );
+		m_pDecodeSurface = NULL;
+	}
+	
+	bool bPost = false;
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		if( m_pImageSurface != NULL )
+			cairo_surface_destroy( m_pImageSurface );
+		
+		m_pImageSurface = pImage;
+		m_iDecodedRows = iHeight;
+		publishSnapshot();
+		
+		m_bInvalidateAll = true;
+		bPost = !m_bInvalidatePosted;
+		m_bInvalidatePosted = true;
+		
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	else
+		cairo_surface_destroy( pImage );
+	
+	if( bPost )
+		s_pBrowserFunctions->pluginthreadasynccall( m_npp, asyncInvalidate, this );
+	
+	m_bDecodeComplete = true;
+	return true;
+}
+
+void CPlugin::storeDiskImage()
+{
+	// Runs on a decode thread with a complete still image
+	if( !s_diskCache.isEnabled() || m_pAnimation != NULL )
+		return;
+	
+	cairo_surface_t * pImage = NULL;
+	int iWidth = 0, iHeight = 0;
+	
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		if( m_pImageSurface != NULL )
+			pImage = cairo_surface_reference( m_pImageSurface );
+		
+		getDecodeSize( iWidth, iHeight );
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	if( pImage == NULL )
+		return;
+	
+	// Pixels borrowed at some other size would never be looked up, and
+	// mapped ones are in there already
+	if( cairo_image_surface_get_width( pImage ) != iWidth || cairo_image_surface_get_height( pImage ) != iHeight
+			|| CDiskCache::isMapped( pImage ) )
+	{
+		cairo_surface_destroy( pImage );
+		return;
+	}
+	
+	// Writing out the pixels would hold up decoding for everyone on a slow
+	// disk, so leave it to s_saveQueue. The cache is only a hint, and when
+	// too much is waiting already this image does without.
+	SDiskStore store = { m_uStreamHash, getStreamSize(), pImage };
+	
+	pthread_mutex_lock(&s_mutexStores);
+	const bool bQueued = s_dequeStores.size() < s_uMaxPendingStores;
+	if( bQueued )
+		s_dequeStores.push_back( store );
+	pthread_mutex_unlock(&s_mutexStores);
+	
+	if( !bQueued )
+		cairo_surface_destroy( pImage );
+	else if( !s_saveQueue.push( &s_storeJob ) )
+		discardPendingStores();
+}
+
+void CPlugin::writePendingStore()
+{
+	// Runs on s_saveQueue
+	pthread_mutex_lock(&s_mutexStores);
+	if( s_dequeStores.empty() )
+	{
+		pthread_mutex_unlock(&s_mutexStores);
+		return;
+	}
+	
+	const SDiskStore store = s_dequeStores.front();
+	s_dequeStores.pop_front();
+	const bool bMore = !s_dequeStores.empty();
+	pthread_mutex_unlock(&s_mutexStores);
+	
+	{
+		CTrace::CScope scope( "storeDiskImage" );
+		s_diskCache.store( store.uHash, store.uDataSize, store.pImage );
+	}
+	
+	cairo_surface_destroy( store.pImage );
+	
+	// One file per run, so a save queued meanwhile goes next
+	if( bMore )
+		s_saveQueue.push( &s_storeJob );
+}
+
+void CPlugin::discardPendingStores()
+{
+	pthread_mutex_lock(&s_mutexStores);
+	std::deque<SDiskStore> dequeStores;
+	dequeStores.swap( s_dequeStores );
+	pthread_mutex_unlock(&s_mutexStores);
+	
+	for( std::deque<SDiskStore>::iterator it = dequeStores.begin(); it != dequeStores.end(); ++it )
+		cairo_surface_destroy( it->pImage );
+}
+
+const std::string & CPlugin::getSource() const
+{
+	static const std::string strNone;
+	
+	std::map<std::string, std::string>::const_iterator itSrc = m_mapArgs.find("src");
+	if( itSrc != m_mapArgs.end() )
+		return itSrc->second;
+	
+	return strNone;
+}
+
+void CPlugin::requestRanges()
+{
+	// Runs on the browser thread, whenever a range is done or we may decode
+	if( !m_bSeekStream )
+		return;
+	
+	uint32_t uOffset = 0, uLength = 0;
+	bool bClose = false;
+	
+	if( pthread_mutex_lock(&m_mutexStream) == 0 )
+	{
+		const uint32_t uReceived = m_streamData.size();
+		
+		// Wait for the range in flight
+		if( uReceived >= m_uStreamRequested )
+		{
+			const uint32_t uNeeded = getNeededSize();
+			
+			if( uReceived >= uNeeded )
+				bClose = true;
+			else if( m_uStreamRequested == 0 )
+				uLength = std::min( s_uSeekHeaderSize, uNeeded );
+			else if( m_bDecodeAllowed || m_eHeaderStatus == VP8_STATUS_NOT_ENOUGH_DATA )
+			{
+				// WebP cannot decode a smaller image from fewer bytes, so
+				// past the header it is all or nothing
+				uLength = uNeeded - uReceived;
+			}
+			
+			uOffset = uReceived;
+			m_uStreamRequested = uOffset + uLength;
+		}
+		
+		pthread_mutex_unlock(&m_mutexStream);
+	}
+	
+	if( bClose )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CPlugin::requestRanges() - All %u bytes fetched, closing the stream\n", uOffset);
+		#endif
+		
+		// The browser answers with destroyStream(), which finishes the image
+		m_bSeekStream = false;
+		s_pBrowserFunctions->destroystream( m_npp, const_cast<NPStream *>(m_pStream), NPRES_DONE );
+		return;
+	}
+	
+	if( uLength == 0 )
+		return;
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::requestRanges() - Requesting %u bytes at %u\n", uLength, uOffset);
+	#endif
+	
+	NPByteRange range;
+	range.offset = uOffset;
+	range.length = uLength;
+	range.next = NULL;
+	
+	if( s_pBrowserFunctions->requestread( const_cast<NPStream *>(m_pStream), &range ) != NPERR_NO_ERROR )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CPlugin::requestRanges() - Request failed, set WEBPNPAPI_SEEK=0 for this browser\n");
+		#endif
+		
+		m_bSeekStream = false;
+		s_pBrowserFunctions->destroystream( m_npp, const_cast<NPStream *>(m_pStream), NPRES_NETWORK_ERR );
+	}
+}
+
+void CPlugin::asyncRequestRanges( void * pThis )
+{
+	// Runs on the browser thread, possibly after the instance was destroyed
+	CPlugin * const pInstance = static_cast<CPlugin *>(pThis);
+	if( s_setInstances.count(pInstance) != 0 )
+		pInstance->requestRanges();
+}
+
+uint32_t CPlugin::getNeededSize() const
+{
+	// Must be called with m_mutexStream held. The RIFF header says where
+	// the image ends, bytes a server adds after that are not worth fetching.
+	uint32_t uNeeded = m_pStream->end;
+	
+	const uint8_t * pHeader;
+	if( m_streamData.getSegment( 0, &pHeader ) >= 8 && memcmp( pHeader, "RIFF", 4 ) == 0 )
+	{
+		const uint32_t uRiffEnd = 8 + ( pHeader[4] | pHeader[5] << 8 | pHeader[6] << 16 | (uint32_t)pHeader[7] << 24 );
+		if( uRiffEnd >= 12 && uRiffEnd < uNeeded )
+			uNeeded = uRiffEnd;
+	}
+	
+	return uNeeded;
+}
+
+size_t CPlugin::getStreamSize() const
+{
+	// Must be called with m_mutexStream held, or once m_bStreamDone is set
+	if( m_pSharedData != NULL )
+		return m_pSharedData->getSize();
+	
+	return m_streamData.size();
+}
+
+size_t CPlugin::getStreamSegment( const size_t uOffset, const uint8_t ** const ppData ) const
+{
+	// Must be called with m_mutexStream held, or once m_bStreamDone is set
+	if( m_pSharedData != NULL )
+	{
+		*ppData = m_pSharedData->getData() + uOffset;
+		return uOffset < m_pSharedData->getSize() ? m_pSharedData->getSize() - uOffset : 0;
+	}
+	
+	return m_streamData.getSegment( uOffset, ppData );
+}
+
+const uint8_t * CPlugin::linearizeStreamData()
+{
+	// Only the decode job may call this, once m_bStreamDone is set. It is the
+	// only reader of segments that does not hold m_mutexStream, and the
+	// segments are freed once the bytes move into m_pSharedData.
+	const uint8_t * pData = NULL;
+	if( pthread_mutex_lock(&m_mutexStream) == 0 )
+	{
+		if( m_pSharedData == NULL )
+		{
+			const size_t uSize = m_streamData.size();
+			const uint8_t * const pDetached = m_streamData.detach();
+			
+			if( pDetached != NULL )
+				m_pSharedData = new CSharedBuffer( pDetached, uSize, CSharedBuffer::freeData );
+		}
+		
+		if( m_pSharedData != NULL )
+			pData = m_pSharedData->getData();
+		
+		pthread_mutex_unlock(&m_mutexStream);
+	}
+	
+	return pData;
+}
+
+CSharedBuffer * CPlugin::shareStreamData()
+{
+	// NULL until the stream is done. Until the decode job has moved the
+	// bytes into m_pSharedData, which it may never do for an embed that is
+	// not in view, the caller gets a copy; only the decode job may detach.
+	CSharedBuffer * pShared = NULL;
+	if( pthread_mutex_lock(&m_mutexStream) == 0 )
+	{
+		if( m_pSharedData != NULL )
+			pShared = m_pSharedData->retain();
+		else if( m_bStreamDone && m_streamData.size() > 0 )
+		{
+			const size_t uSize = m_streamData.size();
+			uint8_t * const pCopy = static_cast<uint8_t *>( malloc(uSize) );
+			
+			const uint8_t * pSegment;
+			size_t uOffset = 0, uSegmentSize;
+			while( pCopy != NULL && (uSegmentSize = m_streamData.getSegment(uOffset, &pSegment)) > 0 )
+			{
+				memcpy( pCopy + uOffset, pSegment, uSegmentSize );
+				uOffset += uSegmentSize;
+			}
+			
+			if( pCopy != NULL )
+				pShared = new CSharedBuffer( pCopy, uSize, CSharedBuffer::freeData );
+		}
+		
+		pthread_mutex_unlock(&m_mutexStream);
+	}
+	
+	return pShared;
+}
+
+void CPlugin::asyncInvalidate( void * pThis )
+{
+	// Runs on the browser thread, possibly after the instance was destroyed
+	CPlugin * const pInstance = static_cast<CPlugin *>(pThis);
+	if( s_setInstances.count(pInstance) == 0 )
+		return;
+	
+	pInstance->reclaimSnapshots();
+	
+	int iFirstRow = 0, iLastRow = 0, iImageHeight = 0;
+	bool bAll = false;
+	
+	if( CTrace::lock( &pInstance->m_mutexImage, &pInstance->m_traceCounters.uLockWaitUs ) == 0 )
+	{
+		iFirstRow = pInstance->m_iInvalidFirstRow;
+		iLastRow = pInstance->m_iInvalidLastRow;
+		bAll = pInstance->m_bInvalidateAll;
+		
+		if( pInstance->m_pImageSurface != NULL )
+			iImageHeight = cairo_image_surface_get_height( pInstance->m_pImageSurface );
+		
+		pInstance->m_iInvalidFirstRow = pInstance->m_iInvalidLastRow = 0;
+		pInstance->m_bInvalidateAll = false;
+		pInstance->m_bInvalidatePosted = false;
+		
+		pthread_mutex_unlock( &pInstance->m_mutexImage );
+	}
+	
+	if( bAll )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CPlugin::asyncInvalidate() - Image complete, forcing redraw\n");
+		#endif
+		
+		pInstance->invalidateRows( 0, iImageHeight, iImageHeight );
+		s_pBrowserFunctions->forceredraw( pInstance->m_npp );
+	}
+	else if( iLastRow > iFirstRow )
+		pInstance->invalidateRows( iFirstRow, iLastRow, iImageHeight );
+	
+	pInstance->reportUsage();
+}
+
+void CPlugin::invalidateRows( const int iFirstRow, const int iLastRow, const int iImageHeight ) const
+{
+	if( iImageHeight <= 0 || m_window.width == 0 || m_window.height == 0 )
+		return;
+	
+	// Map the band of image rows to window rows, with one row of slack
+	// on each side for the bilinear filter
+	const int64_t iWindowHeight = m_window.height;
+	
+	int64_t iTop = (iFirstRow * iWindowHeight) / iImageHeight - 1;
+	int64_t iBottom = (iLastRow * iWindowHeight + iImageHeight - 1) / iImageHeight + 1;
+	
+	if( iTop < 0 )
+		iTop = 0;
+	if( iBottom > iWindowHeight )
+		iBottom = iWindowHeight;
+	
+	NPRect rect;
+	rect.top = iTop;
+	rect.left = 0;
+	rect.bottom = iBottom;
+	rect.right = m_window.width;
+	
+	s_pBrowserFunctions->invalidaterect(m_npp, &rect);
+}
+
+void CPlugin::invalidateImageRect( const int iX, const int iY, const int iWidth, const int iHeight, const int iImageWidth, const int iImageHeight ) const
+{
+	if( iImageWidth <= 0 || iImageHeight <= 0 || m_window.width == 0 || m_window.height == 0 )
+		return;
+	
+	// Map the image rectangle to window pixels, grown by the widest filter
+	// support so that scaled neighbours are redrawn too
+	const int iSlack = 3;
+	const int64_t iWindowWidth = m_window.width;
+	const int64_t iWindowHeight = m_window.height;
+	
+	const int64_t iLeft = std::max( (int64_t)0, ((iX - iSlack) * iWindowWidth) / iImageWidth );
+	const int64_t iTop = std::max( (int64_t)0, ((iY - iSlack) * iWindowHeight) / iImageHeight );
+	const int64_t iRight = std::min( iWindowWidth, ((iX + iWidth + iSlack) * iWindowWidth + iImageWidth - 1) / iImageWidth );
+	const int64_t iBottom = std::min( iWindowHeight, ((iY + iHeight + iSlack) * iWindowHeight + iImageHeight - 1) / iImageHeight );
+	
+	if( iLeft >= iRight || iTop >= iBottom )
+		return;
+	
+	NPRect rect;
+	rect.top = iTop;
+	rect.left = iLeft;
+	rect.bottom = iBottom;
+	rect.right = iRight;
+	
+	s_pBrowserFunctions->invalidaterect(m_npp, &rect);
+}
+
+void CPlugin::asyncAnimate( void * pThis )
+{
+	// Runs on the browser thread once a frame the decode job was asked for
+	// is ready, possibly after the instance was destroyed
+	CPlugin * const pInstance = static_cast<CPlugin *>(pThis);
+	if( s_setInstances.count(pInstance) == 0 )
+		return;
+	
+	bool bLate = false;
+	if( pthread_mutex_lock( &pInstance->m_mutexImage ) == 0 )
+	{
+		bLate = pInstance->m_bAnimFrameLate;
+		pthread_mutex_unlock( &pInstance->m_mutexImage );
+	}
+	
+	if( bLate )
+		pInstance->showNextFrame();
+	else
+	{
+		// The first frame, which starts the clock
+		asyncInvalidate( pThis );
+		pInstance->scheduleAnimationTimer();
+	}
+}
+
+void CPlugin::animationTimer( NPP instance, uint32_t uTimer )
+{
+	CPlugin * const pInstance = static_cast<CPlugin *>(instance->pdata);
+	if( s_setInstances.count(pInstance) == 0 || pInstance->m_uAnimTimer != uTimer )
+		return;
+	
+	pInstance->m_uAnimTimer = 0;
+	pInstance->showNextFrame();
+}
+
+void CPlugin::scheduleAnimationTimer()
+{
+	if( m_uAnimTimer != 0 || m_bAnimPaused )
+		return;
+	
+	if( s_pBrowserFunctions->size < ( offsetof(NPNetscapeFuncs, scheduletimer) + sizeof(void*) ) 
+			|| s_pBrowserFunctions->scheduletimer == NULL )
+		return;
+	
+	int iDuration = 0;
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		if( m_pAnimation != NULL && m_pImageSurface != NULL && m_iAnimWanted >= 0 )
+			iDuration = m_pAnimation->getFrameInfo( m_iAnimFrame ).iDuration;
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	if( iDuration > 0 )
+		m_uAnimTimer = s_pBrowserFunctions->scheduletimer( m_npp, iDuration, false, animationTimer );
+}
+
+void CPlugin::unscheduleAnimationTimer()
+{
+	if( m_uAnimTimer == 0 )
+		return;
+	
+	s_pBrowserFunctions->unscheduletimer( m_npp, m_uAnimTimer );
+	m_uAnimTimer = 0;
+}
+
+void CPlugin::showNextFrame()
+{
+	// Runs on the browser thread when the current frame's time is up
+	int iX = 0, iY = 0, iWidth = 0, iHeight = 0;
+	int iImageWidth = 0, iImageHeight = 0;
+	bool bShown = false, bMore = false;
+	
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		if( m_pAnimNextSurface == NULL )
+			m_bAnimFrameLate = m_iAnimWanted >= 0;
+		else
+		{
+			cairo_surface_destroy( m_pImageSurface );
+			m_pImageSurface = m_pAnimNextSurface;
+			m_pAnimNextSurface = NULL;
+			m_bAnimFrameLate = false;
+			
+			m_iAnimFrame = m_iAnimWanted;
+			publishSnapshot();
+			
+			// Stop on the last frame once all loops are played
+			if( m_iAnimFrame + 1 < m_pAnimation->getFrameCount() )
+				m_iAnimWanted = m_iAnimFrame + 1;
+			else if( m_pAnimation->getLoopCount() > 0 && ++m_iAnimLoops >= m_pAnimation->getLoopCount() )
+				m_iAnimWanted = -1;
+			else
+				m_iAnimWanted = 0;
+			
+			m_pAnimation->getChangedRect( m_iAnimFrame, iX, iY, iWidth, iHeight );
+			iImageWidth = m_pAnimation->getWidth();
+			iImageHeight = m_pAnimation->getHeight();
+			
+			bShown = true;
+			bMore = m_iAnimWanted >= 0;
+		}
+		
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	if( !bShown )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CPlugin::showNextFrame() - Frame not ready yet\n");
+		#endif
+		return;
+	}
+	
+	invalidateImageRect( iX, iY, iWidth, iHeight, iImageWidth, iImageHeight );
+	
+	if( bMore )
+	{
+		scheduleAnimationTimer();
+		scheduleDecode();
+	}
+}
+
+bool CPlugin::isImageComplete() const
+{
+	// Must be called with m_mutexImage held
+	return m_pImageSurface != NULL && m_iDecodedRows == cairo_image_surface_get_height( m_pImageSurface );
+}
+
+void CPlugin::releasePixels()
+{
+	// Runs on the browser thread when we are out of view and over budget.
+	// Only finished still images can be decoded again from what we keep.
+	if( m_bPixelsReleased )
+		return;
+	
+	// We are asked on every paint while over budget, so never wait for a
+	// decode that is still busy with the image. Read without the job
+	// withdrawn this is only a hint, hence the second look below.
+	if( !isReleasable() )
+		return;
+	
+	s_decodeQueue.withdraw( &m_decodeJob );
+	
+	if( !isReleasable() )
+	{
+		// Let it finish what it was doing
+		scheduleDecode();
+		return;
+	}
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::releasePixels() - Releasing %s\n", getSource().c_str());
+	#endif
+	
+	cairo_surface_t * pImage = NULL;
+	cairo_surface_t * pScaled = NULL;
+	CImagePyramid * pPyramid = NULL;
+	
+	if( pthread_mutex_lock( &m_mutexImage ) != 0 )
+		return;
+	
+	pImage = m_pImageSurface;
+	pScaled = m_pImageScaledSurface;
+	pPyramid = m_pImagePyramid;
+	
+	m_pImageSurface = NULL;
+	m_pImageScaledSurface = NULL;
+	m_pImagePyramid = NULL;
+	m_iDecodedRows = 0;
+	m_iInvalidFirstRow = m_iInvalidLastRow = 0;
+	m_bInvalidateAll = false;
+	publishSnapshot();
+	
+	pthread_mutex_unlock( &m_mutexImage );
+	
+	reclaimSnapshots();
+	if( m_pScaledFrom != NULL )
+		cairo_surface_destroy( m_pScaledFrom );
+	m_pScaledFrom = NULL;
+	
+	delete pPyramid;
+	if( pScaled != NULL )
+		cairo_surface_destroy( pScaled );
+	if( pImage != NULL )
+		cairo_surface_destroy( pImage );
+	
+	if( m_pSurface != NULL )
+		cairo_surface_destroy( m_pSurface );
+	m_pSurface = NULL;
+	m_xRenderer.destroyImage();
+	
+	// The cache may hold on to the pixels a while longer
+	releaseCacheEntry();
+	
+	// When we are back, the disk cache maps the pixels again if it still
+	// has them; otherwise start over from the first byte
+	m_bDecodeComplete = false;
+	m_uDecodedBytes = 0;
+	m_bPixelsReleased = true;
+	
+	s_memoryBudget.setUsage( &m_budgetClient, 0 );
+}
+
+bool CPlugin::isReleasable() const
+{
+	return m_bStreamHashed && m_bDecodeComplete && !m_bDecodeFailed && !m_bAnimated;
+}
+
+bool CPlugin::isVisible() const
+{
+	return m_window.clipRect.right > m_window.clipRect.left && m_window.clipRect.bottom > m_window.clipRect.top;
+}
+
+void CPlugin::restorePixels()
+{
+	// Runs on the browser thread once we are in view again. The cache may
+	// still have our pixels, otherwise the decode job starts over.
+	m_bPixelsReleased = false;
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::restorePixels() - Restoring %s\n", getSource().c_str());
+	#endif
+	
+	s_decodeQueue.withdraw( &m_decodeJob );
+	
+	if( attachCachedImage() )
+		verifyCachedImage();
+	
+	scheduleDecode();
+}
+
+void CPlugin::reportUsage()
+{
+	// Runs on the browser thread
+	size_t uBytes = m_xRenderer.getImageBytes();
+	
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		uBytes += getPixelBytes();
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	s_memoryBudget.setUsage( &m_budgetClient, uBytes );
+	s_memoryBudget.trim();
+}
+
+size_t CPlugin::getPixelBytes() const
+{
+	// Must be called with m_mutexImage held. Pyramid levels have a budget
+	// of their own and are not counted, nor are pixels mapped from the disk
+	// cache, which the kernel can drop and read back on its own. Pixels
+	// shared through s_imageCache count against its size, not against each
+	// instance showing them.
+	cairo_surface_t * const pSurfaces[] = { m_pImageSurface, m_pImageScaledSurface, m_pAnimNextSurface, m_pSurface };
+	
+	size_t uBytes = 0;
+	for( size_t i = 0; i < sizeof(pSurfaces) / sizeof(pSurfaces[0]); ++i )
+	{
+		// Only image surfaces live in our memory
+		if( pSurfaces[i] != NULL && pSurfaces[i] != m_pCacheSurface
+				&& cairo_surface_get_type( pSurfaces[i] ) == CAIRO_SURFACE_TYPE_IMAGE && !CDiskCache::isMapped( pSurfaces[i] ) )
+			uBytes += (size_t)cairo_image_surface_get_stride( pSurfaces[i] ) * cairo_image_surface_get_height( pSurfaces[i] );
+	}
+	
+	return uBytes;
+}
+
+void CPlugin::getImageInfo( int & iWidth, int & iHeight, int & iRows, bool & bAnimated )
+{
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		iWidth = m_iImageWidth;
+		iHeight = m_iImageHeight;
+		iRows = m_iDecodedRows;
+		bAnimated = m_pAnimation != NULL;
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+}
+
+const char * CPlugin::getDecodeState()
+{
+	if( m_bPixelsReleased )
+		return "released";
+	if( m_bDecodeFailed )
+		return "failed";
+	
+	bool bComplete = false;
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		bComplete = isImageComplete();
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	if( bComplete )
+		return "complete";
+	
+	return m_bDecodeAllowed ? "decoding" : "waiting";
+}
+
+void CPlugin::setDecodePriority( const int iPriority )
+{
+	s_decodeQueue.setPriority( &m_decodeJob, iPriority );
+}
+
+void CPlugin::setDecodeHint( const int iWidth, const int iHeight )
+{
+	bool bRedecode = false;
+	if( pthread_mutex_lock( &m_mutexImage ) == 0 )
+	{
+		m_iHintWidth = iWidth;
+		m_iHintHeight = iHeight;
+		bRedecode = needsRedecode();
+		
+		pthread_mutex_unlock( &m_mutexImage );
+	}
+	
+	if( bRedecode )
+		scheduleDecode();
+}
+
+void CPlugin::setDecodeMode( const EDecodeMode eMode )
+{
+	m_eDecodeMode = eMode;
+	
+	if( eMode == DECODE_EAGER )
+		allowDecode();
+}
+
+int16_t CPlugin::handleEvent(const void * const pEvent)
+{
+	const XEvent * const nativeEvent = static_cast<const XEvent * const>(pEvent);
+	
+	switch( nativeEvent->type )
+	{
+		case ButtonPress:
+		{
+			if( (nativeEvent->xbutton).button == Button3  )
+				spawnPopup();
+		}
+		break;
+		
+		case GraphicsExpose:
+		{
+			drawWindow( &nativeEvent->xgraphicsexpose );
+		}		
+		break;
+		
+		default:
+			return 0;
+		break;
+	}
+
+	return 1;
+}
+
+void CPlugin::drawWindow( const XGraphicsExposeEvent * const pExpose )
+{
+	CTrace::CScope scope( "drawWindow", this );
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::drawWindow() - Start\n");
+	#endif
+					
+	if(!m_npp)
+		return;
+	
+	// Painting means we are in view, unless nothing of us is. Pixels
+	// restored then would only be released again by the next trim().
+	allowDecode();
+	if( m_bPixelsReleased && isVisible() && pExpose->width > 0 && pExpose->height > 0 )
+		restorePixels();
+
+	// Paint from the last published snapshot, which never waits for a lock
+	reclaimSnapshots();
+	const SSnapshot * const pSnapshot = loadSnapshot();
+	
+	if( pSnapshot != NULL && pSnapshot->pSurface != NULL )
+	{
+		// New pixels, everything derived from the old ones is stale. The
+		// reference keeps the address from being reused for other pixels.
+		cairo_surface_t * const pImage = pSnapshot->pSurface;
+		if( pImage != m_pScaledFrom )
+		{
+			if( m_pScaledFrom != NULL )
+				cairo_surface_destroy( m_pScaledFrom );
+			
+			m_pScaledFrom = cairo_surface_reference( pImage );
+			m_iScaledRows = 0;
+			m_iSurfaceRows = 0;
+		}
+		
+		// Paint the decoded pixels as they are when they were decoded at window size
+		cairo_surface_t * pSourceImage = pImage;
+		int iSourceRows = pSnapshot->iRows;
+		
+		if( cairo_image_surface_get_width(pImage) != (int)m_window.width
+				|| cairo_image_surface_get_height(pImage) != (int)m_window.height )
+		{
+			// Scale image to window size
+			bool bScale = false;
+			
+			if( m_pImageScaledSurface == NULL )
+				bScale = true;
+			else if(cairo_image_surface_get_height(m_pImageScaledSurface) != (int)m_window.height 
+					|| cairo_image_surface_get_width(m_pImageScaledSurface) != (int)m_window.width
+					|| cairo_image_surface_get_format(m_pImageScaledSurface) != cairo_image_surface_get_format(pImage))
+				bScale = true;
+
+			if( bScale )
+			{
+				if( m_pImageScaledSurface != NULL )
+					cairo_surface_destroy(m_pImageScaledSurface);
+
+				#ifdef WEBPNPAPI_DEBUG
+					printf("CPlugin::drawWindow() - Scaling to %ix%i\n", m_window.width, m_window.height);
+				#endif		
+				
+				m_pImageScaledSurface = cairo_image_surface_create( cairo_image_surface_get_format(pImage), m_window.width, m_window.height );
+				if( cairo_surface_status(m_pImageScaledSurface) != CAIRO_STATUS_SUCCESS )
+				{
+					cairo_surface_destroy(m_pImageScaledSurface);
+					m_pImageScaledSurface = NULL;
+				}
+				
+				m_iScaledRows = 0;
+				m_iSurfaceRows = 0;
+			}
+			
+			// Scale the band of rows decoded since the last paint. While the image is
+			// incomplete we stop at the last row whose filter taps are all decoded.
+			const int iImageHeight = cairo_image_surface_get_height( pImage );
+			const int iScaledHeight = m_window.height;
+			const int iScaledBottom = CScaler::getRowsAvailable( iImageHeight, iScaledHeight, pSnapshot->iRows, m_eScaleFilter );
+			
+			if( m_pImageScaledSurface != NULL && iScaledBottom > m_iScaledRows )
+			{
+				// A complete image is scaled in one go from the nearest larger
+				// pyramid level, which stays around for the next resize
+				cairo_surface_t * pScaleSource = pImage;
+				
+				if( m_iScaledRows == 0 && pSnapshot->iRows == iImageHeight && !pSnapshot->bAnimated )
+				{
+					if( m_pImagePyramid == NULL || m_pImagePyramid->getBase() != pImage )
+					{
+						delete m_pImagePyramid;
+						m_pImagePyramid = new CImagePyramid( pImage );
+					}
+					
+					pScaleSource = m_pImagePyramid->getLevel( m_window.width, m_window.height );
+				}
+				
+				CTrace::CScope scopeScale( "scale", this, &m_traceCounters.uScaleUs );
+				CDecodeCore::scale( pScaleSource, m_pImageScaledSurface, m_eScaleFilter, m_iScaledRows, iScaledBottom );
+				
+				// Rows above iScaledBottom may have been rescaled from a pyramid level
+				if( m_iScaledRows == 0 )
+					m_iSurfaceRows = 0;
+				
+				m_iScaledRows = iScaledBottom;
 			}
+			
+			pSourceImage = m_pImageScaledSurface;
+			iSourceRows = m_iScaledRows;
+		}
+
+		// Paint to target area using Cairo, only the rows that are ready and
+		// only where the browser asked us to
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CPlugin::drawWindow() - Drawing commenced (%i rows, expose %i,%i %ix%i)\n",
+					iSourceRows, pExpose->x, pExpose->y, pExpose->width, pExpose->height);
+		#endif
+		
+		if( pSourceImage != NULL && iSourceRows > 0 )
+		{
+			CTrace::CScope scopePaint( "paint", this, &m_traceCounters.uPaintUs );
+			if( !paintXRender( pExpose, pSourceImage, iSourceRows ) )
+				paintCairo( pExpose, pSourceImage, iSourceRows );
+		}
+	}
+	else
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CPlugin::drawWindow() - No image\n");
+		#endif
+	}
+	
+	// Scaling and uploading may have allocated pixels
+	reportUsage();
+}
+
+bool CPlugin::paintXRender( const XGraphicsExposeEvent * const pExpose, cairo_surface_t * const pImage, const int iRows )
+{
+	// Only called from drawWindow(), on the browser thread
+	const NPSetWindowCallbackStruct * const pWindowInfo = static_cast<const NPSetWindowCallbackStruct *>( m_window.ws_info );
+	if( m_bXRenderFailed || pWindowInfo == NULL || !CXRenderer::isSupported( pExpose->display ) )
+		return false;
+	
+	if( m_xRenderer.upload( pExpose->display, pImage, m_iSurfaceRows, iRows )
+			&& m_xRenderer.paint( pExpose->drawable, pWindowInfo->visual, pWindowInfo->depth, m_window.x, m_window.y, iRows,
+					pExpose->x, pExpose->y, pExpose->width, pExpose->height ) )
+	{
+		m_iSurfaceRows = iRows;
+		return true;
+	}
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::paintXRender() - Falling back to cairo\n");
+	#endif
+	
+	// Stay with cairo from now on, which starts over from the first row
+	m_bXRenderFailed = true;
+	m_iSurfaceRows = 0;
+	return false;
+}
+
+void CPlugin::paintCairo( const XGraphicsExposeEvent * const pExpose, cairo_surface_t * const pImage, const int iRows )
+{
+	// Only called from drawWindow(), on the browser thread
+	GdkDrawable * const gdkDrawable = getDrawable( pExpose->drawable );
+	if( gdkDrawable == NULL )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CPlugin::paintCairo() - No drawable\n");
+		#endif
+		return;
+	}
+	
+	cairo_t * pCairoContext = gdk_cairo_create(gdkDrawable);
+	
+	if( updateSurface( cairo_get_target(pCairoContext), pImage, iRows ) )
+	{
+		cairo_rectangle( pCairoContext, pExpose->x, pExpose->y, pExpose->width, pExpose->height );
+		cairo_clip(pCairoContext);
+		
+		cairo_set_source_surface( pCairoContext, m_pSurface, m_window.x, m_window.y );
+		cairo_rectangle( pCairoContext, m_window.x, m_window.y, m_window.width, iRows );
+		cairo_fill(pCairoContext);
+	}
+
+	cairo_destroy(pCairoContext);
+}
+
+bool CPlugin::updateSurface( cairo_surface_t * const pTarget, cairo_surface_t * const pImage, const int iRows )
+{
+	// Only called from drawWindow(), on the browser thread
+	const int iWidth = cairo_image_surface_get_width( pImage );
+	const int iHeight = cairo_image_surface_get_height( pImage );
+	const bool bAlpha = cairo_image_surface_get_format( pImage ) == CAIRO_FORMAT_ARGB32;
+	
+	if( m_pSurface == NULL || m_iSurfaceWidth != iWidth || m_iSurfaceHeight != iHeight )
+	{
+		if( m_pSurface != NULL )
+			cairo_surface_destroy( m_pSurface );
+		
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CPlugin::updateSurface() - New %ix%i surface\n", iWidth, iHeight);
+		#endif
+		
+		m_pSurface = cairo_surface_create_similar( pTarget, bAlpha ? CAIRO_CONTENT_COLOR_ALPHA : CAIRO_CONTENT_COLOR, iWidth, iHeight );
+		m_iSurfaceWidth = iWidth;
+		m_iSurfaceHeight = iHeight;
+		m_iSurfaceRows = 0;
+		
+		if( cairo_surface_status( m_pSurface ) != CAIRO_STATUS_SUCCESS )
+		{
+			cairo_surface_destroy( m_pSurface );
+			m_pSurface = NULL;
+			return false;
+		}
+	}
+	
+	if( iRows <= m_iSurfaceRows )
+		return true;
+	
+	// The new rows were written behind cairo's back, by the decoder or the scaler
+	const int iBandRows = iRows - m_iSurfaceRows;
+	cairo_surface_mark_dirty_rectangle( pImage, 0, m_iSurfaceRows, iWidth, iBandRows );
+	
+	cairo_t * const pCairoContext = cairo_create( m_pSurface );
+	cairo_set_operator( pCairoContext, CAIRO_OPERATOR_SOURCE );
+	cairo_set_source_surface( pCairoContext, pImage, 0, 0 );
+	cairo_rectangle( pCairoContext, 0, m_iSurfaceRows, iWidth, iBandRows );
+	cairo_fill( pCairoContext );
+	cairo_destroy( pCairoContext );
+	
+	m_iSurfaceRows = iRows;
+	return true;
+}
+
+GdkDrawable * CPlugin::getDrawable( const XID xidDrawable )
+{
+	// Wrapping a foreign drawable costs round trips, so keep the last one
+	if( m_gdkDrawable != NULL && m_xidDrawable == xidDrawable )
+		return GDK_DRAWABLE(m_gdkDrawable);
+	
+	if( m_gdkDrawable != NULL )
+		g_object_unref(m_gdkDrawable);
+	
+	m_gdkDrawable = gdk_pixmap_foreign_new(xidDrawable);
+	m_xidDrawable = xidDrawable;
+	
+	if( m_gdkDrawable != NULL )
+		gdk_drawable_set_colormap( GDK_DRAWABLE(m_gdkDrawable), gdk_colormap_get_system() );
+	
+	return GDK_DRAWABLE(m_gdkDrawable);
+}
+
+void CPlugin::forgetDrawables()
+{
+	m_xRenderer.forgetDrawables();
+	
+	if( m_gdkDrawable != NULL )
+		g_object_unref(m_gdkDrawable);
+	
+	m_gdkDrawable = NULL;
+	m_xidDrawable = None;
+}
+
+void CPlugin::spawnPopup()
+{
+	// Popup
+	gtk_menu_popup( GTK_MENU(m_gtkMenu) , NULL, NULL, NULL, NULL, 0, gtk_get_current_event_time() );
+	gtk_widget_show(m_gtkMenu);
+		
+	// Done
+	return;
+}
+		
+void CPlugin::saveAsPNG( GtkMenuItem * pItem, gpointer pThis )
+{
+	/* The dialog runs a main loop of its own, during which the instance may
+	 * be destroyed. We take references to what we save instead of copying
+	 * it, and leave encoding and writing to s_saveQueue. */
+	 
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::saveAsPNG() - Begin\n");
+	#endif
+	
+	CPlugin * const pInstance = static_cast<CPlugin *>(pThis);
+	CTrace::CScope scope( "saveAsPNG", pInstance );
+	
+	std::string strFilename = "Unnamed";
+	std::map<std::string, std::string>::const_iterator itSrc = pInstance->m_mapArgs.find("src");
+	
+	if( itSrc != pInstance->m_mapArgs.end() )
+		strFilename = itSrc->second;
+		
+	std::string::size_type posSuffix = strFilename.rfind(".");
+	if( posSuffix != std::string::npos )
+		strFilename.erase( posSuffix );
+	strFilename.append(".png");
+	
+	SSaveRequest * const pRequest = new SSaveRequest;
+	pRequest->pPlugin = pInstance;
+	pRequest->pImage = NULL;
+	pRequest->pData = NULL;
+	pRequest->bPNG = true;
+	
+	// The snapshot never changes under us, no need to lock
+	const SSnapshot * const pSnapshot = pInstance->loadSnapshot();
+	if( pSnapshot != NULL && pSnapshot->pSurface != NULL && pSnapshot->iRows == cairo_image_surface_get_height(pSnapshot->pSurface) )
+	{
+		const bool bScaled = cairo_image_surface_get_width(pSnapshot->pSurface) != pSnapshot->iImageWidth
+				|| cairo_image_surface_get_height(pSnapshot->pSurface) != pSnapshot->iImageHeight;
+		
+		if( !bScaled )
+			pRequest->pImage = cairo_surface_reference( pSnapshot->pSurface );
+	}
+	
+	// Pixels at window size, released ones or none yet, so decode the
+	// compressed bytes at full size for saving
+	if( pRequest->pImage == NULL )
+		pRequest->pData = pInstance->shareStreamData();
+	
+	if( pRequest->pImage == NULL && pRequest->pData == NULL )
+	{
+		showSaveError( strFilename, "The image has not finished loading" );
+		deleteSave( pRequest );
+		return;
+	}
+	
+	const unsigned long uInstanceId = pInstance->m_uInstanceId;
+	pRequest->strFilename = saveFileDialog(strFilename);
+	
+	// The instance may have gone away meanwhile, the file is saved anyway
+	if( !isInstance( pInstance, uInstanceId ) )
+		pRequest->pPlugin = NULL;
+	
+	if( pRequest->strFilename.empty() )
+		deleteSave( pRequest );
+	else
+		queueSave( pRequest );
+}
+
+void CPlugin::saveAsWebP( GtkMenuItem * pItem, gpointer pThis )
+{
+	/* Like saveAsPNG(), we hold a reference to the stream data rather than
+	 * the instance, which may be gone by the time the dialog returns */
+	 
+	CPlugin * const pInstance = static_cast<CPlugin *>(pThis);
+	CTrace::CScope scope( "saveAsWebP", pInstance );
+	
+	SSaveRequest * const pRequest = new SSaveRequest;
+	pRequest->pPlugin = pInstance;
+	pRequest->pImage = NULL;
+	pRequest->pData = NULL;
+	pRequest->bPNG = false;
+	
+	std::string strFilename = "Unnamed";
+	std::map<std::string, std::string>::const_iterator itSrc = pInstance->m_mapArgs.find("src");
+	if( itSrc != pInstance->m_mapArgs.end() )
+		strFilename = itSrc->second;
+	
+	// The bytes are all we need, whatever became of the pixels
+	pRequest->pData = pInstance->shareStreamData();
+	if( pRequest->pData == NULL )
+	{
+		showSaveError( strFilename, "The image has not finished loading" );
+		deleteSave( pRequest );
+		return;
+	}
+	
+	const unsigned long uInstanceId = pInstance->m_uInstanceId;
+	pRequest->strFilename = saveFileDialog(strFilename);
+	
+	if( !isInstance( pInstance, uInstanceId ) )
+		pRequest->pPlugin = NULL;
+	
+	if( pRequest->strFilename.empty() )
+		deleteSave( pRequest );
+	else
+		queueSave( pRequest );
+}
+
+void CPlugin::queueSave( SSaveRequest * const pRequest )
+{
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::queueSave() - Saving %s\n", pRequest->strFilename.c_str());
+	#endif
+	
+	pthread_mutex_lock(&s_mutexSaves);
+	s_dequeSaves.push_back( pRequest );
+	pthread_mutex_unlock(&s_mutexSaves);
+	
+	// A running job picks it up before it returns
+	if( !s_saveQueue.push( &s_saveJob ) )
+	{
+		pthread_mutex_lock(&s_mutexSaves);
+		s_dequeSaves.erase( std::find(s_dequeSaves.begin(), s_dequeSaves.end(), pRequest) );
+		pthread_mutex_unlock(&s_mutexSaves);
+		
+		deleteSave( pRequest );
+	}
+}
+
+void CPlugin::writePendingSaves()
+{
+	// Runs on s_saveQueue
+	while( true )
+	{
+		pthread_mutex_lock(&s_mutexSaves);
+		if( s_dequeSaves.empty() )
+		{
+			pthread_mutex_unlock(&s_mutexSaves);
+			break;
+		}
+		
+		SSaveRequest * const pRequest = s_dequeSaves.front();
+		s_dequeSaves.pop_front();
+		s_pSaveWriting = pRequest;
+		pthread_mutex_unlock(&s_mutexSaves);
+		
+		writeSave( pRequest );
+		
+		// The instance can not go away while we hold the lock, so its NPP is
+		// still good for posting. The result does not need the instance.
+		bool bPosted = false;
+		pthread_mutex_lock(&s_mutexSaves);
+		s_pSaveWriting = NULL;
+		if( pRequest->pPlugin != NULL )
+		{
+			s_pBrowserFunctions->pluginthreadasynccall( pRequest->pPlugin->m_npp, asyncSaveDone, pRequest );
+			bPosted = true;
+		}
+		pthread_mutex_unlock(&s_mutexSaves);
+		
+		if( !bPosted )
+			deleteSave( pRequest );
+	}
+}
+
+void CPlugin::writeSave( SSaveRequest * const pRequest )
+{
+	CTrace::CScope scope( "writeSave" );
+	
+	// Written next to the target and renamed over it, so nobody ever sees
+	// half a file and a failed save leaves the old one alone. Not mkstemp(),
+	// whose 0600 would ignore the umask a saved image should get. The pid
+	// and a counter keep names apart, O_EXCL catches any leftovers.
+	std::string strTemp;
+	int fd = -1;
+	for( unsigned int uTry = 0; fd < 0 && uTry < 100; ++uTry )
+	{
+		char szSuffix[32];
+		snprintf( szSuffix, sizeof(szSuffix), ".%x.%lx", (unsigned int)getpid(), __sync_fetch_and_add( &s_uNextSaveTemp, 1 ) );
+		
+		strTemp = pRequest->strFilename + szSuffix;
+		fd = open( strTemp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666 );
+		
+		if( fd < 0 && errno != EEXIST )
+			break;
+	}
+	
+	if( fd < 0 )
+	{
+		pRequest->strError = strerror(errno);
+		return;
+	}
+	
+	bool bWritten = false;
+	if( pRequest->bPNG )
+	{
+		close(fd);
+		
+		cairo_surface_t * const pImage = pRequest->pImage != NULL ? cairo_surface_reference( pRequest->pImage ) : CDecodeCore::decode( pRequest->pData->getData(), pRequest->pData->getSize() );
+		if( pImage == NULL )
+			pRequest->strError = "The image could not be decoded";
+		else
+		{
+			// Cairo undoes the premultiplication
+			const cairo_status_t status = cairo_surface_write_to_png( pImage, strTemp.c_str() );
+			if( status != CAIRO_STATUS_SUCCESS )
+				pRequest->strError = cairo_status_to_string( status );
+			
+			bWritten = status == CAIRO_STATUS_SUCCESS;
+			cairo_surface_destroy( pImage );
+		}
+	}
+	else
+	{
+		const uint8_t * pData = pRequest->pData->getData();
+		size_t uLeft = pRequest->pData->getSize();
+		
+		while( uLeft > 0 )
+		{
+			const ssize_t iWritten = ::write( fd, pData, uLeft );
+			if( iWritten < 0 && errno == EINTR )
+				continue;
+			if( iWritten <= 0 )
+				break;
+			
+			pData += iWritten;
+			uLeft -= iWritten;
+		}
+		
+		bWritten = uLeft == 0;
+		if( !bWritten )
+			pRequest->strError = strerror(errno);
+		
+		if( close(fd) != 0 && bWritten )
+		{
+			pRequest->strError = strerror(errno);
+			bWritten = false;
 		}
-	} 
+	}
+	
+	if( bWritten && rename( strTemp.c_str(), pRequest->strFilename.c_str() ) != 0 )
+	{
+		pRequest->strError = strerror(errno);
+		bWritten = false;
+	}
+	
+	if( !bWritten )
+		unlink( strTemp.c_str() );
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::writeSave() - %s: %s\n", pRequest->strFilename.c_str(), bWritten ? "Saved" : pRequest->strError.c_str());
+	#endif
+}
+
+void CPlugin::asyncSaveDone( void * pRequest )
+{
+	// Runs on the browser thread. Everything we need is in the request, so
+	// it does not matter whether the instance is still around.
+	SSaveRequest * const pSave = static_cast<SSaveRequest *>(pRequest);
+	
+	if( !pSave->strError.empty() )
+		showSaveError( pSave->strFilename, pSave->strError );
+	
+	deleteSave( pSave );
+}
+
+void CPlugin::showSaveError( const std::string & strFilename, const std::string & strError )
+{
+	// Not modal, the browser carries on while it is up
+	GtkWidget * const pDialog = gtk_message_dialog_new( NULL, GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR, GTK_BUTTONS_OK,
+			"Could not save %s: %s", strFilename.c_str(), strError.c_str() );
+	g_signal_connect_swapped( pDialog, "response", G_CALLBACK( gtk_widget_destroy ), pDialog );
+	gtk_widget_show( pDialog );
+}
+
+void CPlugin::deleteSave( SSaveRequest * const pRequest )
+{
+	if( pRequest->pImage != NULL )
+		cairo_surface_destroy( pRequest->pImage );
+	if( pRequest->pData != NULL )
+		pRequest->pData->release();
+	
+	delete pRequest;
+}
+
+bool CPlugin::isInstance( const CPlugin * const pInstance, const unsigned long uInstanceId )
+{
+	// Runs on the browser thread. Only a live instance's id may be read.
+	return s_setInstances.count( const_cast<CPlugin *>(pInstance) ) != 0 && pInstance->m_uInstanceId == uInstanceId;
 }
 
 void CPlugin::spawnAbout( GtkMenuItem * pItem, gpointer pData )
@@ -559,6 +2805,16 @@ void CPlugin::spawnAbout( GtkMenuItem * pItem, gpointer pData )
 	gtk_widget_destroy(pDialog);
 }
 
+int CPlugin::getPixelArg( const std::map<std::string, std::string> & mapArgs, const std::string strName )
+{
+	// Only plain pixel counts, a percentage tells us nothing before setWindow()
+	std::map<std::string, std::string>::const_iterator it = mapArgs.find(strName);
+	if( it == mapArgs.end() || it->second.empty() || it->second.find_first_not_of("0123456789") != std::string::npos )
+		return 0;
+	
+	return atoi( it->second.c_str() );
+}
+
 std::string CPlugin::saveFileDialog(const std::string strFilename)
 {
 	#ifdef WEBPNPAPI_DEBUG
@@ -594,9 +2850,68 @@ std::string CPlugin::saveFileDialog(const std::string strFilename)
 }
 
 
-void CPlugin::streamAsFile( const NPStream * const stream, const std::string strName ) const
+void CPlugin::streamAsFile( const NPStream * const stream, const std::string strName )
 {
-
+	if( !m_bStreamAsFile || strName.empty() )
+		return;
+	
+	const int fd = open( strName.c_str(), O_RDONLY );
+	if( fd < 0 )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CPlugin::streamAsFile() - Failed to open %s\n", strName.c_str());
+		#endif
+		return;
+	}
+	
+	// The mapping stays valid after close(), and after the browser deletes the file
+	struct stat fileStat;
+	void * pMapping = MAP_FAILED;
+	
+	if( fstat(fd, &fileStat) == 0 && fileStat.st_size > 0 )
+		pMapping = mmap( NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	
+	close(fd);
+	
+	if( pMapping == MAP_FAILED )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CPlugin::streamAsFile() - Failed to map %s\n", strName.c_str());
+		#endif
+		return;
+	}
+	
+	// The decoder reads it front to back
+	madvise( pMapping, fileStat.st_size, MADV_SEQUENTIAL );
+	
+	bool bMapped = false, bHeader = false;
+	if( pthread_mutex_lock(&m_mutexStream) == 0 )
+	{
+		if( m_pStream == stream && m_pSharedData == NULL )
+		{
+			m_pSharedData = new CSharedBuffer( static_cast<const uint8_t *>(pMapping), fileStat.st_size, CSharedBuffer::unmapData );
+			m_pMappedData = m_pSharedData->getData();
+			bMapped = true;
+			bHeader = m_eHeaderStatus == VP8_STATUS_NOT_ENOUGH_DATA && sniffHeader() == VP8_STATUS_OK;
+		}
+		
+		pthread_mutex_unlock(&m_mutexStream);
+	}
+	
+	if( !bMapped )
+	{
+		munmap( pMapping, fileStat.st_size );
+		return;
+	}
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CPlugin::streamAsFile() - Mapped %u bytes from %s\n", (unsigned int)fileStat.st_size, strName.c_str());
+	#endif
+	
+	if( bHeader )
+		publishHeader();
+	
+	scheduleDecode();
 }
 
 void CPlugin::print(const NPPrint * const platformPrint) const
@@ -609,9 +2924,22 @@ void CPlugin::URLNotify(const std::string strURL, const NPReason reason, const v
 
 }
 
-NPError CPlugin::getValue(const NPPVariable variable, const void * const value) const
+NPError CPlugin::getValue(const NPPVariable variable, void * const value)
 {
-	return NPERR_GENERIC_ERROR;
+	if( variable != NPPVpluginScriptableNPObject )
+		return NPERR_GENERIC_ERROR;
+	
+	if( m_pScriptObject == NULL )
+		m_pScriptObject = CScriptObject::create( m_npp, this );
+	
+	if( m_pScriptObject == NULL )
+		return NPERR_GENERIC_ERROR;
+	
+	// The browser releases the reference it is handed
+	s_pBrowserFunctions->retainobject( m_pScriptObject );
+	*static_cast<NPObject **>(value) = m_pScriptObject;
+	
+	return NPERR_NO_ERROR;
 }
 
 NPError CPlugin::setValue(const NPNVariable variable, const void * const value) const
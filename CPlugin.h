@@ -24,19 +24,43 @@
 #include <pthread.h>
 #include <string>
 #include <map>
+#include <set>
+#include <deque>
 
-// Include for pixbuf
+#include "CWorkQueue.h"
+#include "CImageCache.h"
+#include "CDiskCache.h"
+#include "CStreamBuffer.h"
+#include "CSharedBuffer.h"
+#include "CImagePyramid.h"
+#include "CScaler.h"
+#include "CDecodeCore.h"
+#include "CXRenderer.h"
+#include "CAnimation.h"
+#include "CMemoryBudget.h"
+#include "CTrace.h"
+#include "CScriptObject.h"
+
+// Include for pixbuf and cairo
 #include <gdk/gdk.h>
 #include <gtk/gtk.h>
 
+// Include for incremental decoder
+#include <webp/decode.h>
+
 class CPlugin
 {
+	friend class CScriptObject;
+	
 	public: // Functions
 		CPlugin( const NPP instance, const NPMIMEType mimeType, const uint16_t mode, const std::map<std::string, std::string> mapArgs, const NPSavedData * const saved );
 		~CPlugin();
 		
 		static void setBrowserFunctions( NPNetscapeFuncs * const pBrowserFunctions );
 		
+		static bool initialize();
+		static void shutdown();
+		
 		static const std::string & getPluginName();
 		static const std::string & getPluginDescription();
 		static const std::string & getPluginVersion();
@@ -51,14 +75,163 @@ class CPlugin
 		
 		int16_t handleEvent(const void * const event);
 		
-		void streamAsFile( const NPStream * const stream, const std::string strName) const;
+		void streamAsFile( const NPStream * const stream, const std::string strName);
 		void print(const NPPrint * const platformPrint) const;
 		void URLNotify( const std::string strURL, const NPReason reason, const void * const notifyData) const;
-		NPError getValue(const NPPVariable variable, const void * const value) const;
+		NPError getValue(const NPPVariable variable, void * const value);
 		NPError setValue(const NPNVariable variable, const void * const value) const;
 	
+	private: // Types
+		/* The image as readers see it, swapped in atomically as a whole. It
+		 * never changes once published: the decoder only writes rows below
+		 * iRows. Freed on the browser thread, where all readers run, once
+		 * replaced and no longer referenced. */
+		struct SSnapshot
+		{
+			cairo_surface_t * pSurface; // Own reference, NULL without an image
+			int iRows;
+			int iImageWidth;
+			int iImageHeight;
+			bool bAnimated;
+			int iRefs;
+			SSnapshot * pNextRetired;
+		};
+		
+		/* When to decode, see CScriptObject */
+		enum EDecodeMode
+		{
+			DECODE_AUTO, // In view or within s_iLookAhead of it
+			DECODE_EAGER, // Right away
+			DECODE_LAZY // Only in view
+		};
+		
+		/* Runs the incremental decoder for an instance on s_decodeQueue */
+		class CDecodeJob : public CJob
+		{
+			public:
+				CDecodeJob( CPlugin * const pPlugin ) : m_pPlugin(pPlugin) {}
+				void run() { m_pPlugin->decodePending(); }
+				
+			private:
+				CPlugin * const m_pPlugin;
+		};
+		
+		/* A file chosen in a save dialog, written on s_saveQueue. It holds
+		 * references rather than copies, and outlives the instance. */
+		struct SSaveRequest
+		{
+			CPlugin * pPlugin; // NULL once the instance is gone, under s_mutexSaves
+			std::string strFilename;
+			cairo_surface_t * pImage; // Pixels to save as PNG, or else
+			CSharedBuffer * pData; // compressed bytes to save as they are or as PNG
+			bool bPNG;
+			std::string strError; // Empty on success
+		};
+		
+		/* Writes whatever is in s_dequeSaves, one file at a time */
+		class CSaveJob : public CJob
+		{
+			public:
+				void run() { CPlugin::writePendingSaves(); }
+		};
+		
+		/* A decoded image waiting on s_saveQueue to go into s_diskCache */
+		struct SDiskStore
+		{
+			uint64_t uHash;
+			size_t uDataSize;
+			cairo_surface_t * pImage;
+		};
+		
+		/* Writes one of s_dequeStores per run, after any saves */
+		class CStoreJob : public CJob
+		{
+			public:
+				void run() { CPlugin::writePendingStore(); }
+		};
+		
+		/* Lets s_memoryBudget take our pixels while we are out of view */
+		class CBudgetClient : public CMemoryBudget::CClient
+		{
+			public:
+				CBudgetClient( CPlugin * const pPlugin ) : m_pPlugin(pPlugin) {}
+				void releasePixels() { m_pPlugin->releasePixels(); }
+				
+			private:
+				CPlugin * const m_pPlugin;
+		};
+		
 	private: // Functions
-		void drawWindow( GdkDrawable * const gdkDrawable );
+		void drawWindow( const XGraphicsExposeEvent * const pExpose );
+		bool paintXRender( const XGraphicsExposeEvent * const pExpose, cairo_surface_t * const pImage, const int iRows );
+		void paintCairo( const XGraphicsExposeEvent * const pExpose, cairo_surface_t * const pImage, const int iRows );
+		bool updateSurface( cairo_surface_t * const pTarget, cairo_surface_t * const pImage, const int iRows );
+		GdkDrawable * getDrawable( const XID xidDrawable );
+		void forgetDrawables();
+		
+		void scheduleDecode();
+		void allowDecode();
+		bool isNearView( const NPRect & view ) const;
+		static void allowNearbyDecodes();
+		void decodePending();
+		bool isStreamDone();
+		void decodeStream();
+		void decodeAnimation();
+		VP8StatusCode sniffHeader();
+		void publishHeader();
+		bool createDecoder();
+		void publishRows( const bool bComplete );
+		
+		void publishSnapshot();
+		SSnapshot * loadSnapshot();
+		void reclaimSnapshots();
+		static void releaseSnapshot( SSnapshot * const pSnapshot );
+		void redecode();
+		
+		void getDecodeSize( int & iWidth, int & iHeight ) const;
+		bool needsRedecode() const;
+		
+		bool attachCachedImage();
+		bool verifyCachedImage();
+		void releaseCacheEntry();
+		void updateCache();
+		bool loadDiskImage();
+		void storeDiskImage();
+		const std::string & getSource() const;
+		
+		void requestRanges();
+		static void asyncRequestRanges( void * pThis );
+		uint32_t getNeededSize() const;
+		
+		size_t getStreamSize() const;
+		size_t getStreamSegment( const size_t uOffset, const uint8_t ** const ppData ) const;
+		const uint8_t * linearizeStreamData();
+		CSharedBuffer * shareStreamData();
+		
+		static void asyncInvalidate( void * pThis );
+		void invalidateRows( const int iFirstRow, const int iLastRow, const int iImageHeight ) const;
+		void invalidateImageRect( const int iX, const int iY, const int iWidth, const int iHeight, const int iImageWidth, const int iImageHeight ) const;
+		
+		static void asyncAnimate( void * pThis );
+		static void animationTimer( NPP instance, uint32_t uTimer );
+		void scheduleAnimationTimer();
+		void unscheduleAnimationTimer();
+		void showNextFrame();
+		bool isImageComplete() const;
+		
+		void releasePixels();
+		bool isReleasable() const;
+		bool isVisible() const;
+		void restorePixels();
+		void reportUsage();
+		size_t getPixelBytes() const;
+		
+		/* Called from script through CScriptObject */
+		void getImageInfo( int & iWidth, int & iHeight, int & iRows, bool & bAnimated );
+		const char * getDecodeState();
+		void setDecodePriority( const int iPriority );
+		void setDecodeHint( const int iWidth, const int iHeight );
+		void setDecodeMode( const EDecodeMode eMode );
 		
 		void spawnPopup();
 		
@@ -68,10 +241,68 @@ class CPlugin
 		static void spawnAbout( GtkMenuItem * pItem, gpointer pData );
 		
 		static std::string saveFileDialog(const std::string strFilename);
+		static int getPixelArg( const std::map<std::string, std::string> & mapArgs, const std::string strName );
+		
+		/* Saving happens on s_saveQueue, the browser thread only runs the dialog */
+		static void queueSave( SSaveRequest * const pRequest );
+		static void writePendingSaves();
+		static void writeSave( SSaveRequest * const pRequest );
+		static void asyncSaveDone( void * pRequest );
+		static void showSaveError( const std::string & strFilename, const std::string & strError );
+		static void deleteSave( SSaveRequest * const pRequest );
+		static bool isInstance( const CPlugin * const pInstance, const unsigned long uInstanceId );
+		
+		/* Disk cache writes go on s_saveQueue too, below saves in priority */
+		static void writePendingStore();
+		static void discardPendingStores();
 						
 	private: // Variables
 		static NPNetscapeFuncs * s_pBrowserFunctions;
 		
+		/* Background decoding shared by all instances */
+		static CWorkQueue s_decodeQueue;
+		static const size_t s_uDecodeSliceSize;
+		static const int32_t s_iMaxWriteSize;
+		
+		/* Files being saved, for all instances */
+		static CWorkQueue s_saveQueue;
+		static CSaveJob s_saveJob;
+		static pthread_mutex_t s_mutexSaves;
+		static std::deque<SSaveRequest *> s_dequeSaves;
+		static SSaveRequest * s_pSaveWriting;
+		static volatile unsigned long s_uNextSaveTemp;
+		
+		/* Decoded images shared between instances */
+		static CImageCache s_imageCache;
+		static const size_t s_uDefaultCacheSize;
+		
+		/* Decoded images kept across sessions, off unless configured */
+		static CDiskCache s_diskCache;
+		static CStoreJob s_storeJob;
+		static pthread_mutex_t s_mutexStores;
+		static std::deque<SDiskStore> s_dequeStores;
+		static const size_t s_uMaxPendingStores;
+		
+		/* Pixel memory of all instances */
+		static CMemoryBudget s_memoryBudget;
+		static const size_t s_uDefaultMemoryBudget;
+		
+		/* How far outside the visible area, in pixels, an instance may be
+		 * and still be decoded */
+		static int s_iLookAhead;
+		static const int s_iDefaultLookAhead;
+		
+		/* Whether seekable streams are fetched in NP_SEEK mode, and how much
+		 * to ask for before the header tells us the rest */
+		static bool s_bSeekStreams;
+		static const uint32_t s_uSeekHeaderSize;
+		
+		/* Instances that async calls may still be delivered to */
+		static std::set<CPlugin *> s_setInstances;
+		
+		/* Tells a live instance from a new one at a freed one's address */
+		static unsigned long s_uNextInstanceId;
+		
 		/* Plugin properties */
 		static const std::string s_strPluginName;
 		static const std::string s_strPluginDescription;
@@ -83,18 +314,128 @@ class CPlugin
 		std::map<std::string, std::string> m_mapArgs;
 	
 		NPP m_npp;
+		const unsigned long m_uInstanceId;
 		NPWindow m_window;
 	
 		/* Stream variables for image */
 		pthread_mutex_t m_mutexStream;
 		const NPStream * m_pStream;
-		std::string m_strStreamData;
+		CStreamBuffer m_streamData;
+		
+		/* With stream="file" the browser hands us a file instead of write()
+		 * calls, which we map and decode from without copying */
+		const bool m_bStreamAsFile;
+		const uint8_t * m_pMappedData; // Owned by m_pSharedData
+		
+		/* Once the stream is done its bytes move in here and never change
+		 * again, so the save paths can keep them without a copy */
+		CSharedBuffer * m_pSharedData;
+		
+		bool m_bStreamDone;
+		bool m_bStreamFailed; // Out of memory in write(), nothing more is stored
+		
+		/* A seekable stream is fetched with NPN_RequestRead(), the header
+		 * first and the rest once we may decode. One range is asked for at a
+		 * time, so write() still only appends. Browser thread only. */
+		bool m_bSeekStream;
+		uint32_t m_uStreamRequested; // End of the ranges asked for so far
 		
-		/* Pixbuf wrappers for image data */
+		/* Parsed from the first bytes by write(), so that the size is known
+		 * before the decoder runs, which for lazy embeds may be much later */
+		VP8StatusCode m_eHeaderStatus;
+		WebPBitstreamFeatures m_headerFeatures;
+		
+		/* Incremental decoder, only touched by m_decodeJob. It writes into the
+		 * pixels of m_pDecodeSurface, which becomes m_pImageSurface once the
+		 * first rows are out. */
+		CDecodeJob m_decodeJob;
+		WebPDecoderConfig m_decoderConfig;
+		WebPIDecoder * m_pIDecoder;
+		cairo_surface_t * m_pDecodeSurface;
+		size_t m_uDecodedBytes;
+		bool m_bDecodeComplete;
+		bool m_bDecodeFailed;
+		bool m_bAnimated; // Frames come from m_pAnimation instead
+		
+		/* Content hash of the finished stream, and the cache entry we share
+		 * pixels with. An entry attached in newStream() is verified against
+		 * the hash once the stream is done. */
+		uint64_t m_uStreamHash;
+		bool m_bStreamHashed;
+		CImageCache::CEntry * m_pCacheEntry;
+		cairo_surface_t * m_pCacheSurface; // Our reference to the entry's pixels
+		
+		/* Decoded image as premultiplied ARGB32 (or RGB24 when opaque) surfaces,
+		 * which cairo paints from directly. Whoever changes m_pImageSurface or
+		 * m_iDecodedRows holds m_mutexImage and publishes a new snapshot, which
+		 * is all that drawWindow() and the save paths look at. */
 		pthread_mutex_t m_mutexImage;
-		uint8_t * m_pImageRawData;
-		GdkPixbuf * m_pImagePixbuf;
-		GdkPixbuf * m_pImageScaledPixbuf;
+		cairo_surface_t * m_pImageSurface;
+		cairo_surface_t * m_pImageScaledSurface; // Browser thread only, like the pyramid
+		CImagePyramid * m_pImagePyramid; // Built from the snapshot once complete
+		const CScaler::EFilter m_eScaleFilter; // From the "filter" embed argument
+		int m_iDecodedRows; // Rows of m_pImageSurface decoded so far
+		SSnapshot * volatile m_pSnapshot;
+		SSnapshot * volatile m_pRetiredSnapshots; // Replaced, freed on the browser thread
+		
+		/* Natural size of the image, known from the header on, and the size
+		 * we would like to decode it at. That is the window size, or the
+		 * width and height of the embed until we get a window. */
+		int m_iImageWidth;
+		int m_iImageHeight;
+		int m_iTargetWidth;
+		int m_iTargetHeight;
+		int m_iHintWidth; // Set from script to override the window size
+		int m_iHintHeight;
+		int m_iScaledRows; // Rows of m_pImageScaledSurface that are up to date
+		cairo_surface_t * m_pScaledFrom; // Snapshot surface the above came from
+		
+		/* What drawWindow() paints from, in the drawable's own format so that an
+		 * expose is a plain copy. Rows are uploaded once, as they become ready,
+		 * to m_xRenderer or, where that is not supported, to m_pSurface. */
+		CXRenderer m_xRenderer;
+		bool m_bXRenderFailed;
+		cairo_surface_t * m_pSurface;
+		int m_iSurfaceWidth;
+		int m_iSurfaceHeight;
+		int m_iSurfaceRows;
+		
+		/* GDK wrapper for the drawable we last painted to through cairo */
+		XID m_xidDrawable;
+		GdkPixmap * m_gdkDrawable;
+		
+		/* Rows waiting for an invalidate on the browser thread */
+		int m_iInvalidFirstRow;
+		int m_iInvalidLastRow;
+		bool m_bInvalidatePosted;
+		bool m_bInvalidateAll;
+		
+		/* Animation playback. The decode job keeps the frame after the one on
+		 * screen ready in m_pAnimNextSurface, and the timer swaps it in. These
+		 * are guarded by m_mutexImage. */
+		CAnimation * m_pAnimation;
+		int m_iAnimFrame;
+		int m_iAnimWanted; // Frame the decode job should prepare, -1 when done
+		int m_iAnimLoops;
+		cairo_surface_t * m_pAnimNextSurface;
+		bool m_bAnimFrameLate; // The timer fired before the frame was ready
+		
+		/* Only touched on the browser thread */
+		uint32_t m_uAnimTimer;
+		bool m_bAnimPaused; // The clip rectangle is empty
+		
+		/* Our share of s_memoryBudget, only touched on the browser thread */
+		CBudgetClient m_budgetClient;
+		bool m_bPixelsReleased; // Decoded again once we are back in view
+		bool m_bDecodeAllowed; // Set once we come near view or are asked to paint
+		EDecodeMode m_eDecodeMode;
+		
+		/* Handed to the page, we hold one reference */
+		CScriptObject * m_pScriptObject;
+		
+		/* Totals reported to CTrace when we are destroyed */
+		CTrace::SCounters m_traceCounters;
+		uint64_t m_uStreamStart;
 		
 		/* Temporary */
 		GtkWidget * m_gtkMenu;	
@@ -0,0 +1,265 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CScaler.h"
+
+// Includes
+#include <algorithm>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+	double getSupport( const CScaler::EFilter eFilter )
+	{
+		return eFilter == CScaler::FILTER_LANCZOS3 ? 3.0 : 1.0;
+	}
+	
+	double getWeight( const CScaler::EFilter eFilter, double t )
+	{
+		t = fabs(t);
+		
+		if( eFilter == CScaler::FILTER_LANCZOS3 )
+		{
+			if( t < 1e-8 )
+				return 1.0;
+			if( t >= 3.0 )
+				return 0.0;
+			
+			const double dPiT = M_PI * t;
+			return 3.0 * sin(dPiT) * sin(dPiT / 3.0) / (dPiT * dPiT);
+		}
+		
+		return t < 1.0 ? 1.0 - t : 0.0;
+	}
+	
+	/* Which source pixels, and how much of each, make up every target pixel
+	 * along one axis. Every target pixel uses the same number of taps. */
+	struct SContributions
+	{
+		int iTaps;
+		std::vector<int> vecFirst;
+		std::vector<float> vecWeights;
+	};
+	
+	void computeContributions( const int iSourceSize, const int iTargetSize, const CScaler::EFilter eFilter, SContributions & contrib )
+	{
+		// Widen the filter when downscaling so that every source pixel counts
+		const double dScale = (double)iTargetSize / iSourceSize;
+		const double dFilterScale = std::min( dScale, 1.0 );
+		const double dSupport = getSupport(eFilter) / dFilterScale;
+		
+		contrib.iTaps = std::min( (int)ceil(2.0 * dSupport) + 1, iSourceSize );
+		contrib.vecFirst.resize( iTargetSize );
+		contrib.vecWeights.resize( (size_t)iTargetSize * contrib.iTaps );
+		
+		for( int x = 0; x < iTargetSize; ++x )
+		{
+			const double dCenter = (x + 0.5) / dScale - 0.5;
+			
+			int iFirst = (int)ceil(dCenter - dSupport);
+			iFirst = std::max( 0, std::min(iFirst, iSourceSize - contrib.iTaps) );
+			contrib.vecFirst[x] = iFirst;
+			
+			float * const pWeights = &contrib.vecWeights[(size_t)x * contrib.iTaps];
+			double dSum = 0.0;
+			
+			for( int t = 0; t < contrib.iTaps; ++t )
+			{
+				pWeights[t] = getWeight( eFilter, (iFirst + t - dCenter) * dFilterScale );
+				dSum += pWeights[t];
+			}
+			
+			// Weights that fell outside the image are spread over the rest
+			if( dSum > 1e-8 )
+			{
+				for( int t = 0; t < contrib.iTaps; ++t )
+					pWeights[t] /= dSum;
+			}
+			else
+			{
+				const int iNearest = std::max( 0, std::min((int)floor(dCenter + 0.5) - iFirst, contrib.iTaps - 1) );
+				pWeights[iNearest] = 1.0f;
+			}
+		}
+	}
+	
+	void horizontalPortable( const uint8_t * pIn, float * pOut, const int * piFirst, const float * pWeights, const int iTaps, const int iWidth )
+	{
+		for( int x = 0; x < iWidth; ++x )
+		{
+			const uint8_t * pPixel = pIn + piFirst[x] * 4;
+			float fSum[4] = { 0 };
+			
+			for( int t = 0; t < iTaps; ++t )
+			{
+				for( int c = 0; c < 4; ++c )
+					fSum[c] += pWeights[t] * pPixel[c];
+				
+				pPixel += 4;
+			}
+			
+			for( int c = 0; c < 4; ++c )
+				pOut[c] = fSum[c];
+			
+			pOut += 4;
+			pWeights += iTaps;
+		}
+	}
+	
+	void verticalPortable( const float * const * ppRows, const float * pWeights, const int iTaps, uint8_t * pOut, const int iCount )
+	{
+		for( int i = 0; i < iCount; ++i )
+		{
+			float fSum = 0.5f;
+			for( int t = 0; t < iTaps; ++t )
+				fSum += pWeights[t] * ppRows[t][i];
+			
+			pOut[i] = fSum <= 0.0f ? 0 : ( fSum >= 255.0f ? 255 : (uint8_t)fSum );
+		}
+	}
+	
+	/* Negative lobes can push a colour channel past alpha at edges, which
+	 * is no valid premultiplied pixel. Alpha is the top byte whatever the
+	 * byte order. */
+	void clampToAlpha( uint8_t * const pRow, const int iWidth )
+	{
+		uint32_t * const pPixels = reinterpret_cast<uint32_t *>(pRow);
+		
+		for( int x = 0; x < iWidth; ++x )
+		{
+			const uint32_t uPixel = pPixels[x];
+			const uint32_t uAlpha = uPixel >> 24;
+			
+			const uint32_t uRed = std::min( (uPixel >> 16) & 0xff, uAlpha );
+			const uint32_t uGreen = std::min( (uPixel >> 8) & 0xff, uAlpha );
+			const uint32_t uBlue = std::min( uPixel & 0xff, uAlpha );
+			
+			pPixels[x] = (uAlpha << 24) | (uRed << 16) | (uGreen << 8) | uBlue;
+		}
+	}
+}
+
+const CScaler::SKernels CScaler::s_kernelsPortable =
+{
+	"portable",
+	horizontalPortable,
+	verticalPortable
+};
+
+const CScaler::SKernels * CScaler::s_pKernels = &CScaler::s_kernelsPortable;
+
+void CScaler::initialize()
+{
+	s_pKernels = &s_kernelsPortable;
+	
+	#ifdef WEBPNPAPI_X86_SIMD
+		__builtin_cpu_init();
+		
+		if( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") )
+			s_pKernels = &s_kernelsAVX2;
+		else if( __builtin_cpu_supports("sse2") )
+			s_pKernels = &s_kernelsSSE2;
+	#endif
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CScaler::initialize() - Using %s kernels\n", s_pKernels->szName);
+	#endif
+}
+
+const char * CScaler::getKernelName()
+{
+	return s_pKernels->szName;
+}
+
+bool CScaler::scale( const uint8_t * const pSource, const int iSourceWidth, const int iSourceHeight, const int iSourceStride,
+		uint8_t * const pTarget, const int iTargetWidth, const int iTargetHeight, const int iTargetStride,
+		const bool bPremultiplied, const EFilter eFilter, const int iFirstRow, const int iLastRow )
+{
+	if( iSourceWidth <= 0 || iSourceHeight <= 0 || iTargetWidth <= 0 || iTargetHeight <= 0 )
+		return false;
+	
+	const int iFirst = std::max( iFirstRow, 0 );
+	const int iLast = std::min( iLastRow, iTargetHeight );
+	if( iFirst >= iLast )
+		return true;
+	
+	SContributions horizontal, vertical;
+	computeContributions( iSourceWidth, iTargetWidth, eFilter, horizontal );
+	computeContributions( iSourceHeight, iTargetHeight, eFilter, vertical );
+	
+	// Ring of horizontally filtered rows
+	const size_t uRowFloats = (size_t)iTargetWidth * 4;
+	std::vector<float> vecRing( uRowFloats * vertical.iTaps );
+	std::vector<const float *> vecRows( vertical.iTaps );
+	
+	// Only filters with negative lobes can overshoot
+	const bool bClamp = bPremultiplied && eFilter == FILTER_LANCZOS3;
+	
+	int iNextSourceRow = 0;
+	
+	for( int y = iFirst; y < iLast; ++y )
+	{
+		// First source rows only move forward, so the ring still holds
+		// whatever the previous target row had in common with this one
+		const int iSourceFirst = vertical.vecFirst[y];
+		
+		for( int iRow = std::max(iNextSourceRow, iSourceFirst); iRow < iSourceFirst + vertical.iTaps; ++iRow )
+			s_pKernels->pfnHorizontal( pSource + (size_t)iRow * iSourceStride, &vecRing[(iRow % vertical.iTaps) * uRowFloats],
+					&horizontal.vecFirst[0], &horizontal.vecWeights[0], horizontal.iTaps, iTargetWidth );
+		
+		iNextSourceRow = iSourceFirst + vertical.iTaps;
+		
+		for( int t = 0; t < vertical.iTaps; ++t )
+			vecRows[t] = &vecRing[((iSourceFirst + t) % vertical.iTaps) * uRowFloats];
+		
+		uint8_t * const pTargetRow = pTarget + (size_t)y * iTargetStride;
+		s_pKernels->pfnVertical( &vecRows[0], &vertical.vecWeights[(size_t)y * vertical.iTaps], vertical.iTaps,
+				pTargetRow, iTargetWidth * 4 );
+		
+		if( bClamp )
+			clampToAlpha( pTargetRow, iTargetWidth );
+	}
+	
+	return true;
+}
+
+int CScaler::getRowsAvailable( const int iSourceHeight, const int iTargetHeight, const int iSourceRows, const EFilter eFilter )
+{
+	if( iSourceRows >= iSourceHeight )
+		return iTargetHeight;
+	
+	if( iSourceHeight <= 0 || iTargetHeight <= 0 )
+		return 0;
+	
+	SContributions vertical;
+	computeContributions( iSourceHeight, iTargetHeight, eFilter, vertical );
+	
+	int iRows = 0;
+	while( iRows < iTargetHeight && vertical.vecFirst[iRows] + vertical.iTaps <= iSourceRows )
+		++iRows;
+	
+	return iRows;
+}
+
+CScaler::EFilter CScaler::getFilter( const char * const szName )
+{
+	if( szName != NULL && strcmp(szName, "lanczos") == 0 )
+		return FILTER_LANCZOS3;
+	
+	return FILTER_BILINEAR;
+}
@@ -0,0 +1,75 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_CSCALER
+#define H_CSCALER
+
+// Includes
+#include <stdint.h>
+
+/* Separable image resampler for rows of four 8-bit channels, as in cairo's
+ * ARGB32 and RGB24. Each source row is filtered horizontally into a float
+ * row, and output rows are weighted sums of those. The inner loops are
+ * picked at runtime by initialize(). */
+class CScaler
+{
+	public: // Types
+		enum EFilter
+		{
+			FILTER_BILINEAR,	// Triangle, widened when downscaling
+			FILTER_LANCZOS3		// Sharper, three lobes
+		};
+		
+		/* Inner loops, see CScalerSSE2.cpp and CScalerAVX2.cpp */
+		struct SKernels
+		{
+			const char * szName;
+			
+			/* One row: pOut[x] = sum of pWeights[x * iTaps + t] * pIn[piFirst[x] + t] */
+			void (*pfnHorizontal)( const uint8_t * pIn, float * pOut, const int * piFirst, const float * pWeights, const int iTaps, const int iWidth );
+			
+			/* pOut[i] = clamp(sum of pWeights[t] * ppRows[t][i]) */
+			void (*pfnVertical)( const float * const * ppRows, const float * pWeights, const int iTaps, uint8_t * pOut, const int iCount );
+		};
+		
+	public: // Functions
+		/* Picks the fastest kernels this CPU supports */
+		static void initialize();
+		static const char * getKernelName();
+		
+		/* Scales rows [iFirstRow, iLastRow) of the target. The source rows
+		 * those depend on must be valid, see getRowsAvailable(). With
+		 * bPremultiplied the pixels are ARGB32, whose colour channels are
+		 * kept at or below alpha. */
+		static bool scale( const uint8_t * const pSource, const int iSourceWidth, const int iSourceHeight, const int iSourceStride,
+				uint8_t * const pTarget, const int iTargetWidth, const int iTargetHeight, const int iTargetStride,
+				const bool bPremultiplied, const EFilter eFilter, const int iFirstRow, const int iLastRow );
+		
+		/* Number of target rows that only depend on the first iSourceRows rows */
+		static int getRowsAvailable( const int iSourceHeight, const int iTargetHeight, const int iSourceRows, const EFilter eFilter );
+		
+		static EFilter getFilter( const char * const szName );
+		
+	private: // Variables
+		static const SKernels * s_pKernels;
+		static const SKernels s_kernelsPortable;
+		
+		#ifdef WEBPNPAPI_X86_SIMD
+			static const SKernels s_kernelsSSE2;
+			static const SKernels s_kernelsAVX2;
+		#endif
+};
+
+#endif
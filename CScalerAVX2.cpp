@@ -0,0 +1,94 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CScaler.h"
+
+// Includes
+#include <immintrin.h>
+#include <cstring>
+
+namespace
+{
+	void horizontalAVX2( const uint8_t * pIn, float * pOut, const int * piFirst, const float * pWeights, const int iTaps, const int iWidth )
+	{
+		for( int x = 0; x < iWidth; ++x )
+		{
+			const uint8_t * pPixel = pIn + piFirst[x] * 4;
+			__m256 sum = _mm256_setzero_ps();
+			int t = 0;
+			
+			// Two pixels per step, one in each 128-bit lane
+			for( ; t + 2 <= iTaps; t += 2 )
+			{
+				const __m256 pixels = _mm256_cvtepi32_ps( _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)pPixel)) );
+				const __m256 weights = _mm256_insertf128_ps( _mm256_castps128_ps256(_mm_set1_ps(pWeights[t])), _mm_set1_ps(pWeights[t + 1]), 1 );
+				
+				sum = _mm256_fmadd_ps( pixels, weights, sum );
+				pPixel += 8;
+			}
+			
+			__m128 sum128 = _mm_add_ps( _mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1) );
+			
+			if( t < iTaps )
+			{
+				int iPixel;
+				memcpy( &iPixel, pPixel, 4 );
+				
+				const __m128 pixel = _mm_cvtepi32_ps( _mm_cvtepu8_epi32(_mm_cvtsi32_si128(iPixel)) );
+				sum128 = _mm_fmadd_ps( pixel, _mm_set1_ps(pWeights[t]), sum128 );
+			}
+			
+			_mm_storeu_ps( pOut, sum128 );
+			
+			pOut += 4;
+			pWeights += iTaps;
+		}
+	}
+	
+	void verticalAVX2( const float * const * ppRows, const float * pWeights, const int iTaps, uint8_t * pOut, const int iCount )
+	{
+		const __m256 half = _mm256_set1_ps( 0.5f );
+		int i = 0;
+		
+		for( ; i + 8 <= iCount; i += 8 )
+		{
+			__m256 sum = half;
+			
+			for( int t = 0; t < iTaps; ++t )
+				sum = _mm256_fmadd_ps( _mm256_set1_ps(pWeights[t]), _mm256_loadu_ps(ppRows[t] + i), sum );
+			
+			// Truncate like the portable loop, saturating on both packs
+			const __m256i ints = _mm256_cvttps_epi32( sum );
+			const __m128i words = _mm_packs_epi32( _mm256_castsi256_si128(ints), _mm256_extracti128_si256(ints, 1) );
+			_mm_storel_epi64( (__m128i *)(pOut + i), _mm_packus_epi16(words, words) );
+		}
+		
+		for( ; i < iCount; ++i )
+		{
+			float fSum = 0.5f;
+			for( int t = 0; t < iTaps; ++t )
+				fSum += pWeights[t] * ppRows[t][i];
+			
+			pOut[i] = fSum <= 0.0f ? 0 : ( fSum >= 255.0f ? 255 : (uint8_t)fSum );
+		}
+	}
+}
+
+const CScaler::SKernels CScaler::s_kernelsAVX2 =
+{
+	"avx2",
+	horizontalAVX2,
+	verticalAVX2
+};
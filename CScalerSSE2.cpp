@@ -0,0 +1,91 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CScaler.h"
+
+// Includes
+#include <emmintrin.h>
+#include <cstring>
+
+namespace
+{
+	inline __m128 loadPixel( const uint8_t * const pPixel )
+	{
+		int iPixel;
+		memcpy( &iPixel, pPixel, 4 );
+		
+		const __m128i zero = _mm_setzero_si128();
+		return _mm_cvtepi32_ps( _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(iPixel), zero), zero) );
+	}
+	
+	void horizontalSSE2( const uint8_t * pIn, float * pOut, const int * piFirst, const float * pWeights, const int iTaps, const int iWidth )
+	{
+		for( int x = 0; x < iWidth; ++x )
+		{
+			const uint8_t * pPixel = pIn + piFirst[x] * 4;
+			__m128 sum = _mm_setzero_ps();
+			
+			for( int t = 0; t < iTaps; ++t )
+			{
+				sum = _mm_add_ps( sum, _mm_mul_ps(loadPixel(pPixel), _mm_set1_ps(pWeights[t])) );
+				pPixel += 4;
+			}
+			
+			_mm_storeu_ps( pOut, sum );
+			
+			pOut += 4;
+			pWeights += iTaps;
+		}
+	}
+	
+	void verticalSSE2( const float * const * ppRows, const float * pWeights, const int iTaps, uint8_t * pOut, const int iCount )
+	{
+		const __m128 half = _mm_set1_ps( 0.5f );
+		int i = 0;
+		
+		for( ; i + 8 <= iCount; i += 8 )
+		{
+			__m128 sumLow = half;
+			__m128 sumHigh = half;
+			
+			for( int t = 0; t < iTaps; ++t )
+			{
+				const __m128 weight = _mm_set1_ps( pWeights[t] );
+				sumLow = _mm_add_ps( sumLow, _mm_mul_ps(weight, _mm_loadu_ps(ppRows[t] + i)) );
+				sumHigh = _mm_add_ps( sumHigh, _mm_mul_ps(weight, _mm_loadu_ps(ppRows[t] + i + 4)) );
+			}
+			
+			// Truncate like the portable loop, saturating on both packs
+			const __m128i words = _mm_packs_epi32( _mm_cvttps_epi32(sumLow), _mm_cvttps_epi32(sumHigh) );
+			_mm_storel_epi64( (__m128i *)(pOut + i), _mm_packus_epi16(words, words) );
+		}
+		
+		for( ; i < iCount; ++i )
+		{
+			float fSum = 0.5f;
+			for( int t = 0; t < iTaps; ++t )
+				fSum += pWeights[t] * ppRows[t][i];
+			
+			pOut[i] = fSum <= 0.0f ? 0 : ( fSum >= 255.0f ? 255 : (uint8_t)fSum );
+		}
+	}
+}
+
+const CScaler::SKernels CScaler::s_kernelsSSE2 =
+{
+	"sse2",
+	horizontalSSE2,
+	verticalSSE2
+};
@@ -0,0 +1,267 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CScriptObject.h"
+
+// Includes
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "CPlugin.h"
+
+NPNetscapeFuncs * CScriptObject::s_pBrowserFunctions = NULL;
+
+NPClass CScriptObject::s_class =
+{
+	NP_CLASS_STRUCT_VERSION,
+	allocate,
+	deallocate,
+	NULL, // invalidate
+	hasMethod,
+	invoke,
+	NULL, // invokeDefault
+	hasProperty,
+	getProperty,
+	NULL, // setProperty
+	NULL, // removeProperty
+	NULL, // enumerate
+	NULL  // construct
+};
+
+const char * const CScriptObject::s_szMembers[MEMBER_COUNT] =
+{
+	"naturalWidth",
+	"naturalHeight",
+	"decodeState",
+	"decodedRows",
+	"animated",
+	"setPriority",
+	"setDecodeSize",
+	"setDecodeMode",
+	"release"
+};
+
+NPIdentifier CScriptObject::s_identifiers[MEMBER_COUNT];
+bool CScriptObject::s_bIdentifiers = false;
+
+void CScriptObject::setBrowserFunctions( NPNetscapeFuncs * const pBrowserFunctions )
+{
+	s_pBrowserFunctions = pBrowserFunctions;
+}
+
+CScriptObject * CScriptObject::create( const NPP instance, CPlugin * const pPlugin )
+{
+	// Older browsers have no scripting
+	if( s_pBrowserFunctions == NULL || s_pBrowserFunctions->size < ( offsetof(NPNetscapeFuncs, releasevariantvalue) + sizeof(void*) )
+			|| s_pBrowserFunctions->createobject == NULL )
+		return NULL;
+	
+	if( !s_bIdentifiers )
+	{
+		// Identifiers are interned by the browser and never change
+		for( int i = 0; i < MEMBER_COUNT; ++i )
+			s_identifiers[i] = s_pBrowserFunctions->getstringidentifier( s_szMembers[i] );
+		s_bIdentifiers = true;
+	}
+	
+	CScriptObject * const pObject = static_cast<CScriptObject *>( s_pBrowserFunctions->createobject( instance, &s_class ) );
+	if( pObject != NULL )
+		pObject->m_pPlugin = pPlugin;
+	
+	return pObject;
+}
+
+void CScriptObject::detach()
+{
+	m_pPlugin = NULL;
+}
+
+CScriptObject::CScriptObject()
+	:	m_pPlugin(NULL)
+{
+}
+
+CScriptObject::EMember CScriptObject::findMember( const NPIdentifier name )
+{
+	for( int i = 0; i < MEMBER_COUNT; ++i )
+	{
+		if( s_identifiers[i] == name )
+			return static_cast<EMember>(i);
+	}
+	
+	return MEMBER_COUNT;
+}
+
+bool CScriptObject::toInt( const NPVariant & variant, int & iValue )
+{
+	// Numbers from script are usually doubles
+	if( NPVARIANT_IS_INT32(variant) )
+		iValue = NPVARIANT_TO_INT32(variant);
+	else if( NPVARIANT_IS_DOUBLE(variant) )
+		iValue = (int)NPVARIANT_TO_DOUBLE(variant);
+	else
+		return false;
+	
+	return true;
+}
+
+void CScriptObject::toString( const char * const szValue, NPVariant * const pResult )
+{
+	// The browser frees the characters, so they must come from it
+	const size_t uLength = strlen( szValue );
+	char * const szCopy = static_cast<char *>( s_pBrowserFunctions->memalloc( uLength + 1 ) );
+	
+	if( szCopy == NULL )
+	{
+		NULL_TO_NPVARIANT(*pResult);
+		return;
+	}
+	
+	memcpy( szCopy, szValue, uLength + 1 );
+	STRINGN_TO_NPVARIANT( szCopy, uLength, *pResult );
+}
+
+NPObject * CScriptObject::allocate( NPP instance, NPClass * pClass )
+{
+	return new CScriptObject();
+}
+
+void CScriptObject::deallocate( NPObject * pObject )
+{
+	delete static_cast<CScriptObject *>(pObject);
+}
+
+bool CScriptObject::hasMethod( NPObject * pObject, NPIdentifier name )
+{
+	const EMember eMember = findMember( name );
+	return eMember >= MEMBER_SET_PRIORITY && eMember < MEMBER_COUNT;
+}
+
+bool CScriptObject::invoke( NPObject * pObject, NPIdentifier name, const NPVariant * pArgs, uint32_t uArgCount, NPVariant * pResult )
+{
+	CPlugin * const pPlugin = static_cast<CScriptObject *>(pObject)->m_pPlugin;
+	VOID_TO_NPVARIANT(*pResult);
+	
+	if( pPlugin == NULL )
+		return false;
+	
+	switch( findMember( name ) )
+	{
+		case MEMBER_SET_PRIORITY:
+		{
+			int iPriority;
+			if( uArgCount != 1 || !toInt( pArgs[0], iPriority ) )
+				return false;
+			
+			pPlugin->setDecodePriority( iPriority );
+		}
+		break;
+		
+		case MEMBER_SET_DECODE_SIZE:
+		{
+			int iWidth, iHeight;
+			if( uArgCount != 2 || !toInt( pArgs[0], iWidth ) || !toInt( pArgs[1], iHeight ) || iWidth < 0 || iHeight < 0 )
+				return false;
+			
+			pPlugin->setDecodeHint( iWidth, iHeight );
+		}
+		break;
+		
+		case MEMBER_SET_DECODE_MODE:
+		{
+			if( uArgCount != 1 || !NPVARIANT_IS_STRING(pArgs[0]) )
+				return false;
+			
+			const NPString & strMode = NPVARIANT_TO_STRING(pArgs[0]);
+			const std::string strValue( strMode.UTF8Characters, strMode.UTF8Length );
+			
+			if( strValue == "eager" )
+				pPlugin->setDecodeMode( CPlugin::DECODE_EAGER );
+			else if( strValue == "lazy" )
+				pPlugin->setDecodeMode( CPlugin::DECODE_LAZY );
+			else if( strValue == "auto" )
+				pPlugin->setDecodeMode( CPlugin::DECODE_AUTO );
+			else
+				return false;
+		}
+		break;
+		
+		case MEMBER_RELEASE:
+		{
+			pPlugin->releasePixels();
+		}
+		break;
+		
+		default:
+			return false;
+		break;
+	}
+	
+	return true;
+}
+
+bool CScriptObject::hasProperty( NPObject * pObject, NPIdentifier name )
+{
+	return findMember( name ) < MEMBER_SET_PRIORITY;
+}
+
+bool CScriptObject::getProperty( NPObject * pObject, NPIdentifier name, NPVariant * pResult )
+{
+	CPlugin * const pPlugin = static_cast<CScriptObject *>(pObject)->m_pPlugin;
+	const EMember eMember = findMember( name );
+	
+	if( eMember >= MEMBER_SET_PRIORITY )
+		return false;
+	
+	if( pPlugin == NULL )
+	{
+		NULL_TO_NPVARIANT(*pResult);
+		return true;
+	}
+	
+	int iWidth = 0, iHeight = 0, iRows = 0;
+	bool bAnimated = false;
+	pPlugin->getImageInfo( iWidth, iHeight, iRows, bAnimated );
+	
+	switch( eMember )
+	{
+		case MEMBER_NATURAL_WIDTH:
+			INT32_TO_NPVARIANT( iWidth, *pResult );
+		break;
+		
+		case MEMBER_NATURAL_HEIGHT:
+			INT32_TO_NPVARIANT( iHeight, *pResult );
+		break;
+		
+		case MEMBER_DECODE_STATE:
+			toString( pPlugin->getDecodeState(), pResult );
+		break;
+		
+		case MEMBER_DECODED_ROWS:
+			INT32_TO_NPVARIANT( iRows, *pResult );
+		break;
+		
+		case MEMBER_ANIMATED:
+			BOOLEAN_TO_NPVARIANT( bAnimated, *pResult );
+		break;
+		
+		default:
+			return false;
+		break;
+	}
+	
+	return true;
+}
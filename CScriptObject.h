@@ -0,0 +1,96 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_CSCRIPTOBJECT
+#define H_CSCRIPTOBJECT
+
+// Includes for NPAPI
+#include "../../include/npapi.h"
+#include "../../include/npfunctions.h"
+#include "../../include/npruntime.h"
+
+class CPlugin;
+
+/* The object pages get from the embed element. Properties:
+ *
+ *   naturalWidth, naturalHeight  Size of the image, 0 until the header is in
+ *   decodeState                  "waiting", "decoding", "complete", "failed"
+ *                                or "released"
+ *   decodedRows                  Rows decoded so far, at the decode size
+ *   animated                     Whether the image is animated
+ *
+ * and methods:
+ *
+ *   setPriority(n)               Decode before instances with a lower n,
+ *                                the default is 0
+ *   setDecodeSize(w, h)          Decode at this size instead of the window
+ *                                size, 0, 0 to go back
+ *   setDecodeMode(mode)          "eager" decodes now, "lazy" only once in
+ *                                view and "auto" also slightly off-screen
+ *   release()                    Drops the decoded pixels until painted again
+ *
+ * The object may outlive its instance, after which it does nothing. */
+class CScriptObject : public NPObject
+{
+	public: // Functions
+		static void setBrowserFunctions( NPNetscapeFuncs * const pBrowserFunctions );
+		
+		static CScriptObject * create( const NPP instance, CPlugin * const pPlugin );
+		
+		/* Called by the instance as it is destroyed */
+		void detach();
+		
+	private: // Types
+		enum EMember
+		{
+			MEMBER_NATURAL_WIDTH,
+			MEMBER_NATURAL_HEIGHT,
+			MEMBER_DECODE_STATE,
+			MEMBER_DECODED_ROWS,
+			MEMBER_ANIMATED,
+			MEMBER_SET_PRIORITY, // Methods from here on
+			MEMBER_SET_DECODE_SIZE,
+			MEMBER_SET_DECODE_MODE,
+			MEMBER_RELEASE,
+			MEMBER_COUNT
+		};
+		
+	private: // Functions
+		CScriptObject();
+		
+		static EMember findMember( const NPIdentifier name );
+		static bool toInt( const NPVariant & variant, int & iValue );
+		static void toString( const char * const szValue, NPVariant * const pResult );
+		
+		/* NPClass callbacks */
+		static NPObject * allocate( NPP instance, NPClass * pClass );
+		static void deallocate( NPObject * pObject );
+		static bool hasMethod( NPObject * pObject, NPIdentifier name );
+		static bool invoke( NPObject * pObject, NPIdentifier name, const NPVariant * pArgs, uint32_t uArgCount, NPVariant * pResult );
+		static bool hasProperty( NPObject * pObject, NPIdentifier name );
+		static bool getProperty( NPObject * pObject, NPIdentifier name, NPVariant * pResult );
+		
+	private: // Variables
+		CPlugin * m_pPlugin;
+		
+		static NPNetscapeFuncs * s_pBrowserFunctions;
+		static NPClass s_class;
+		
+		static const char * const s_szMembers[MEMBER_COUNT];
+		static NPIdentifier s_identifiers[MEMBER_COUNT];
+		static bool s_bIdentifiers;
+};
+
+#endif
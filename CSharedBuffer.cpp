@@ -0,0 +1,66 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CSharedBuffer.h"
+
+// Includes
+#include <cstdlib>
+#include <sys/mman.h>
+
+CSharedBuffer::CSharedBuffer( const uint8_t * const pData, const size_t uSize, const FRelease pfnRelease )
+	:	m_pData(pData),
+		m_uSize(uSize),
+		m_pfnRelease(pfnRelease),
+		m_iRefs(1)
+{
+}
+
+CSharedBuffer::~CSharedBuffer()
+{
+	if( m_pData != NULL && m_pfnRelease != NULL )
+		m_pfnRelease( m_pData, m_uSize );
+}
+
+CSharedBuffer * CSharedBuffer::retain()
+{
+	__sync_fetch_and_add( &m_iRefs, 1 );
+	return this;
+}
+
+void CSharedBuffer::release()
+{
+	if( __sync_sub_and_fetch( &m_iRefs, 1 ) == 0 )
+		delete this;
+}
+
+const uint8_t * CSharedBuffer::getData() const
+{
+	return m_pData;
+}
+
+size_t CSharedBuffer::getSize() const
+{
+	return m_uSize;
+}
+
+void CSharedBuffer::freeData( const uint8_t * const pData, const size_t )
+{
+	free( (void *)pData );
+}
+
+void CSharedBuffer::unmapData( const uint8_t * const pData, const size_t uSize )
+{
+	munmap( (void *)pData, uSize );
+}
@@ -0,0 +1,61 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_CSHAREDBUFFER
+#define H_CSHAREDBUFFER
+
+// Includes
+#include <stdint.h>
+#include <cstddef>
+
+/* Bytes that never change once wrapped, shared by reference count. Whoever
+ * holds a reference may read them from any thread, after the instance that
+ * produced them is long gone. */
+class CSharedBuffer
+{
+	public: // Types
+		typedef void (*FRelease)( const uint8_t * const pData, const size_t uSize );
+		
+	public: // Functions
+		/* Takes over pData, which pfnRelease frees with the last reference.
+		 * The creator holds the first one. */
+		CSharedBuffer( const uint8_t * const pData, const size_t uSize, const FRelease pfnRelease );
+		
+		CSharedBuffer * retain();
+		void release();
+		
+		const uint8_t * getData() const;
+		size_t getSize() const;
+		
+		/* Releasers for malloc() and mmap() memory */
+		static void freeData( const uint8_t * const pData, const size_t uSize );
+		static void unmapData( const uint8_t * const pData, const size_t uSize );
+		
+	private: // Functions
+		~CSharedBuffer();
+		
+		// Not copyable
+		CSharedBuffer( const CSharedBuffer & );
+		CSharedBuffer & operator=( const CSharedBuffer & );
+		
+	private: // Variables
+		const uint8_t * const m_pData;
+		const size_t m_uSize;
+		const FRelease m_pfnRelease;
+		
+		int m_iRefs;
+};
+
+#endif
@@ -0,0 +1,182 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CStreamBuffer.h"
+
+// Includes
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+const size_t CStreamBuffer::s_uBlockSize = 64 * 1024;
+const size_t CStreamBuffer::s_uMaxPoolBlocks = 64;
+
+pthread_mutex_t CStreamBuffer::s_mutexPool = PTHREAD_MUTEX_INITIALIZER;
+std::vector<uint8_t *> CStreamBuffer::s_vecPool;
+
+CStreamBuffer::CStreamBuffer()
+	:	m_uSize(0)
+{
+}
+
+CStreamBuffer::~CStreamBuffer()
+{
+	for( std::vector<SBlock>::const_iterator it = m_vecBlocks.begin(); it != m_vecBlocks.end(); ++it )
+		freeBlock(*it);
+}
+
+void CStreamBuffer::reserve( const size_t uSize )
+{
+	if( !m_vecBlocks.empty() || uSize == 0 )
+		return;
+	
+	SBlock block;
+	block.pData = static_cast<uint8_t *>( malloc(uSize) );
+	block.uStart = 0;
+	block.uSize = 0;
+	block.uCapacity = uSize;
+	
+	if( block.pData != NULL )
+		m_vecBlocks.push_back(block);
+}
+
+bool CStreamBuffer::append( const void * const pData, const size_t uSize )
+{
+	const uint8_t * pSource = static_cast<const uint8_t *>(pData);
+	size_t uLeft = uSize;
+	
+	while( uLeft > 0 )
+	{
+		if( m_vecBlocks.empty() || m_vecBlocks.back().uSize == m_vecBlocks.back().uCapacity )
+		{
+			SBlock block;
+			block.pData = allocBlock();
+			if( block.pData == NULL )
+				return false;
+			
+			block.uStart = m_uSize;
+			block.uSize = 0;
+			block.uCapacity = s_uBlockSize;
+			
+			m_vecBlocks.push_back(block);
+		}
+		
+		SBlock & block = m_vecBlocks.back();
+		const size_t uCopy = std::min( uLeft, block.uCapacity - block.uSize );
+		
+		memcpy( block.pData + block.uSize, pSource, uCopy );
+		block.uSize += uCopy;
+		m_uSize += uCopy;
+		
+		pSource += uCopy;
+		uLeft -= uCopy;
+	}
+	
+	return true;
+}
+
+size_t CStreamBuffer::size() const
+{
+	return m_uSize;
+}
+
+size_t CStreamBuffer::getSegment( const size_t uOffset, const uint8_t ** const ppData ) const
+{
+	*ppData = NULL;
+	if( uOffset >= m_uSize )
+		return 0;
+	
+	// Find the last block starting at or before uOffset
+	size_t uLow = 0, uHigh = m_vecBlocks.size();
+	while( uHigh - uLow > 1 )
+	{
+		const size_t uMid = (uLow + uHigh) / 2;
+		if( m_vecBlocks[uMid].uStart <= uOffset )
+			uLow = uMid;
+		else
+			uHigh = uMid;
+	}
+	
+	const SBlock & block = m_vecBlocks[uLow];
+	*ppData = block.pData + (uOffset - block.uStart);
+	return block.uSize - (uOffset - block.uStart);
+}
+
+uint8_t * CStreamBuffer::detach()
+{
+	if( m_vecBlocks.empty() )
+		return NULL;
+	
+	uint8_t * pData = NULL;
+	if( m_vecBlocks.size() == 1 )
+	{
+		// Pool blocks come from malloc() too, they just never go back
+		pData = m_vecBlocks.front().pData;
+	}
+	else
+	{
+		pData = static_cast<uint8_t *>( malloc(m_uSize) );
+		if( pData == NULL )
+			return NULL;
+		
+		for( std::vector<SBlock>::const_iterator it = m_vecBlocks.begin(); it != m_vecBlocks.end(); ++it )
+		{
+			memcpy( pData + it->uStart, it->pData, it->uSize );
+			freeBlock(*it);
+		}
+	}
+	
+	m_vecBlocks.clear();
+	m_uSize = 0;
+	return pData;
+}
+
+uint8_t * CStreamBuffer::allocBlock()
+{
+	uint8_t * pData = NULL;
+	
+	pthread_mutex_lock(&s_mutexPool);
+	if( !s_vecPool.empty() )
+	{
+		pData = s_vecPool.back();
+		s_vecPool.pop_back();
+	}
+	pthread_mutex_unlock(&s_mutexPool);
+	
+	// NULL when out of memory, this ends up in NPAPI callbacks where
+	// exceptions must not go
+	if( pData == NULL )
+		pData = static_cast<uint8_t *>( malloc(s_uBlockSize) );
+	
+	return pData;
+}
+
+void CStreamBuffer::freeBlock( const SBlock & block )
+{
+	// Only pool-sized blocks go back to the pool
+	if( block.uCapacity == s_uBlockSize )
+	{
+		pthread_mutex_lock(&s_mutexPool);
+		if( s_vecPool.size() < s_uMaxPoolBlocks )
+		{
+			s_vecPool.push_back(block.pData);
+			pthread_mutex_unlock(&s_mutexPool);
+			return;
+		}
+		pthread_mutex_unlock(&s_mutexPool);
+	}
+	
+	free(block.pData);
+}
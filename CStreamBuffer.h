@@ -0,0 +1,79 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_CSTREAMBUFFER
+#define H_CSTREAMBUFFER
+
+// Includes
+#include <pthread.h>
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+
+/* Stream data kept as a list of fixed-size blocks drawn from a process-wide
+ * pool. Appending never moves bytes that are already stored, so a pointer
+ * returned by getSegment() stays valid until detach() or destruction. */
+class CStreamBuffer
+{
+	public: // Functions
+		CStreamBuffer();
+		~CStreamBuffer();
+		
+		/* Allocates one contiguous block up front when the size is known */
+		void reserve( const size_t uSize );
+		/* Returns false when out of memory, with only part of pData stored */
+		bool append( const void * const pData, const size_t uSize );
+		
+		size_t size() const;
+		
+		/* Returns the length of the contiguous run of bytes at uOffset */
+		size_t getSegment( const size_t uOffset, const uint8_t ** const ppData ) const;
+		
+		/* Hands the whole buffer over as one malloc()ed block, copying it at
+		 * most once, and leaves it empty. Frees the blocks, so no segment may
+		 * be in use by another thread. */
+		uint8_t * detach();
+		
+	public: // Variables
+		static const size_t s_uBlockSize;
+		
+	private: // Types
+		struct SBlock
+		{
+			uint8_t * pData;
+			size_t uStart;
+			size_t uSize;
+			size_t uCapacity;
+		};
+		
+	private: // Functions
+		static uint8_t * allocBlock();
+		static void freeBlock( const SBlock & block );
+		
+		// Not copyable
+		CStreamBuffer( const CStreamBuffer & );
+		CStreamBuffer & operator=( const CStreamBuffer & );
+		
+	private: // Variables
+		std::vector<SBlock> m_vecBlocks;
+		size_t m_uSize;
+		
+		/* Free blocks kept around for the next stream */
+		static pthread_mutex_t s_mutexPool;
+		static std::vector<uint8_t *> s_vecPool;
+		static const size_t s_uMaxPoolBlocks;
+};
+
+#endif
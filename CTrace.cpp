@@ -0,0 +1,214 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CTrace.h"
+
+// Includes
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+bool CTrace::s_bEnabled = false;
+
+pthread_mutex_t CTrace::s_mutexEvents = PTHREAD_MUTEX_INITIALIZER;
+std::vector<CTrace::SEvent> CTrace::s_vecEvents;
+uint64_t CTrace::s_uLastFlush = 0;
+size_t CTrace::s_uRecorded = 0;
+const size_t CTrace::s_uMaxEvents = 4 * 1024 * 1024;
+const size_t CTrace::s_uFlushEvents = 4096;
+const uint64_t CTrace::s_uFlushIntervalUs = 1000000;
+
+pthread_mutex_t CTrace::s_mutexFile = PTHREAD_MUTEX_INITIALIZER;
+FILE * CTrace::s_pFile = NULL;
+bool CTrace::s_bFirstEvent = true;
+
+void CTrace::initialize()
+{
+	const char * const szPath = getenv("WEBPNPAPI_TRACE");
+	if( szPath == NULL || szPath[0] == '\0' )
+		return;
+	
+	s_pFile = fopen( szPath, "w" );
+	if( s_pFile == NULL )
+	{
+		#ifdef WEBPNPAPI_DEBUG
+			printf("CTrace::initialize() - Cannot write %s\n", szPath);
+		#endif
+		return;
+	}
+	
+	fprintf( s_pFile, "[\n" );
+	fflush( s_pFile );
+	
+	s_vecEvents.reserve( s_uFlushEvents );
+	s_uLastFlush = now();
+	s_bEnabled = true;
+}
+
+void CTrace::shutdown()
+{
+	if( !s_bEnabled )
+		return;
+	
+	s_bEnabled = false;
+	flush();
+	
+	pthread_mutex_lock(&s_mutexFile);
+	fprintf( s_pFile, "\n]\n" );
+	fclose( s_pFile );
+	s_pFile = NULL;
+	pthread_mutex_unlock(&s_mutexFile);
+}
+
+void CTrace::flush()
+{
+	std::vector<SEvent> vecEvents;
+	vecEvents.reserve( s_uFlushEvents );
+	
+	// Recording carries on into the fresh vector while we write
+	pthread_mutex_lock(&s_mutexEvents);
+	vecEvents.swap( s_vecEvents );
+	s_uLastFlush = now();
+	pthread_mutex_unlock(&s_mutexEvents);
+	
+	pthread_mutex_lock(&s_mutexFile);
+	
+	// A late flush after shutdown() has nowhere to go
+	if( s_pFile == NULL )
+	{
+		pthread_mutex_unlock(&s_mutexFile);
+		return;
+	}
+	
+	const int iProcess = getpid();
+	for( size_t i = 0; i < vecEvents.size(); ++i )
+	{
+		const SEvent & event = vecEvents[i];
+		
+		// Separators go first, so the file is valid at every batch boundary
+		const char * const szSeparator = s_bFirstEvent ? "" : ",\n";
+		s_bFirstEvent = false;
+		
+		switch( event.cPhase )
+		{
+			case 'X':
+				fprintf( s_pFile, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%i,\"tid\":%li,\"ts\":%llu,\"dur\":%llu,\"args\":{\"instance\":\"%p\"}}",
+						szSeparator, event.szName, iProcess, event.lThread, (unsigned long long)event.uStart, (unsigned long long)event.uDuration,
+						event.pInstance );
+			break;
+			
+			case 'C':
+				// One series per instance
+				fprintf( s_pFile, "%s{\"name\":\"%s\",\"ph\":\"C\",\"pid\":%i,\"tid\":%li,\"ts\":%llu,\"args\":{\"%p\":%llu}}",
+						szSeparator, event.szName, iProcess, event.lThread, (unsigned long long)event.uStart, event.pInstance,
+						(unsigned long long)event.uDuration );
+			break;
+		}
+	}
+	
+	fflush( s_pFile );
+	pthread_mutex_unlock(&s_mutexFile);
+}
+
+uint64_t CTrace::now()
+{
+	timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void CTrace::complete( const char * const szName, const void * const pInstance, const uint64_t uStart, const uint64_t uDuration )
+{
+	if( !s_bEnabled )
+		return;
+	
+	SEvent event = SEvent();
+	event.szName = szName;
+	event.cPhase = 'X';
+	event.pInstance = pInstance;
+	event.uStart = uStart;
+	event.uDuration = uDuration;
+	record( event );
+}
+
+void CTrace::counter( const char * const szName, const void * const pInstance, const uint64_t uValue )
+{
+	if( !s_bEnabled )
+		return;
+	
+	SEvent event = SEvent();
+	event.szName = szName;
+	event.cPhase = 'C';
+	event.pInstance = pInstance;
+	event.uStart = now();
+	event.uDuration = uValue;
+	record( event );
+}
+
+void CTrace::summary( const void * const pInstance, const SCounters & counters )
+{
+	if( !s_bEnabled )
+		return;
+	
+	counter( "bytes_received", pInstance, counters.uBytesReceived );
+	counter( "time_to_first_byte_us", pInstance, counters.uFirstByteUs );
+	counter( "decode_us", pInstance, counters.uDecodeUs );
+	counter( "scale_us", pInstance, counters.uScaleUs );
+	counter( "paint_us", pInstance, counters.uPaintUs );
+	counter( "lock_wait_us", pInstance, counters.uLockWaitUs );
+}
+
+int CTrace::lock( pthread_mutex_t * const pMutex, uint64_t * const puWait )
+{
+	if( !s_bEnabled )
+		return pthread_mutex_lock( pMutex );
+	
+	// Only time the locks we actually have to wait for
+	if( pthread_mutex_trylock( pMutex ) == 0 )
+		return 0;
+	
+	const uint64_t uStart = now();
+	const int iResult = pthread_mutex_lock( pMutex );
+	__sync_fetch_and_add( puWait, now() - uStart );
+	
+	return iResult;
+}
+
+void CTrace::record( const SEvent & event )
+{
+	SEvent copy = event;
+	copy.lThread = syscall( SYS_gettid );
+	const uint64_t uNow = now();
+	
+	pthread_mutex_lock(&s_mutexEvents);
+	
+	// Stop recording rather than grow the file without bound
+	if( s_uRecorded < s_uMaxEvents )
+	{
+		s_vecEvents.push_back( copy );
+		++s_uRecorded;
+	}
+	
+	// Write out a batch when it is full, or now and then, so that little
+	// is lost when the host is killed
+	const bool bFlush = s_vecEvents.size() >= s_uFlushEvents || uNow >= s_uLastFlush + s_uFlushIntervalUs;
+	
+	pthread_mutex_unlock(&s_mutexEvents);
+	
+	if( bFlush && s_bEnabled )
+		flush();
+}
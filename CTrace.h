@@ -0,0 +1,126 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_CTRACE
+#define H_CTRACE
+
+// Includes
+#include <pthread.h>
+#include <stdint.h>
+#include <cstdio>
+#include <vector>
+
+/* Runtime tracing in Chrome's trace event format, for chrome://tracing or
+ * Perfetto. Set WEBPNPAPI_TRACE to the file to write. Events are appended
+ * in batches as they come in, in the JSON array form whose closing bracket
+ * is optional, so a host killed before shutdown still leaves a trace. When
+ * it is unset every call is a test of one static flag. */
+class CTrace
+{
+	public: // Types
+		/* Per instance totals, updated from any thread */
+		struct SCounters
+		{
+			uint64_t uBytesReceived;
+			uint64_t uFirstByteUs; // From newStream() to the first write()
+			uint64_t uDecodeUs;
+			uint64_t uScaleUs;
+			uint64_t uPaintUs;
+			uint64_t uLockWaitUs;
+		};
+		
+		/* Records the time until it goes out of scope as a complete event,
+		 * and adds it to a counter if one is given */
+		class CScope
+		{
+			public:
+				CScope( const char * const szName, const void * const pInstance = NULL, uint64_t * const puTotal = NULL )
+					:	m_szName(szName),
+						m_pInstance(pInstance),
+						m_puTotal(puTotal),
+						m_uStart( s_bEnabled ? now() : 0 )
+				{
+				}
+				
+				~CScope()
+				{
+					if( !s_bEnabled )
+						return;
+					
+					const uint64_t uDuration = now() - m_uStart;
+					complete( m_szName, m_pInstance, m_uStart, uDuration );
+					if( m_puTotal != NULL )
+						__sync_fetch_and_add( m_puTotal, uDuration );
+				}
+				
+			private:
+				const char * const m_szName;
+				const void * const m_pInstance;
+				uint64_t * const m_puTotal;
+				const uint64_t m_uStart;
+		};
+		
+	public: // Functions
+		static void initialize();
+		static void shutdown();
+		
+		static bool isEnabled() { return s_bEnabled; }
+		
+		/* Monotonic time in microseconds */
+		static uint64_t now();
+		
+		/* Names must be string literals, they are kept until shutdown */
+		static void complete( const char * const szName, const void * const pInstance, const uint64_t uStart, const uint64_t uDuration );
+		static void counter( const char * const szName, const void * const pInstance, const uint64_t uValue );
+		/* Records each of the totals as a counter */
+		static void summary( const void * const pInstance, const SCounters & counters );
+		
+		/* pthread_mutex_lock() that adds the time spent waiting to *puWait */
+		static int lock( pthread_mutex_t * const pMutex, uint64_t * const puWait );
+		
+	private: // Types
+		struct SEvent
+		{
+			const char * szName;
+			char cPhase;
+			long lThread;
+			const void * pInstance;
+			uint64_t uStart;
+			uint64_t uDuration; // Or the value of a counter
+		};
+		
+	private: // Functions
+		static void record( const SEvent & event );
+		static void flush();
+		
+	private: // Variables
+		static bool s_bEnabled;
+		
+		/* Events waiting to be written, swapped out by flush() */
+		static pthread_mutex_t s_mutexEvents;
+		static std::vector<SEvent> s_vecEvents;
+		static uint64_t s_uLastFlush;
+		static size_t s_uRecorded;
+		static const size_t s_uMaxEvents;
+		static const size_t s_uFlushEvents;
+		static const uint64_t s_uFlushIntervalUs;
+		
+		/* The trace file, written by one flush() at a time */
+		static pthread_mutex_t s_mutexFile;
+		static FILE * s_pFile;
+		static bool s_bFirstEvent;
+};
+
+#endif
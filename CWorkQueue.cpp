@@ -0,0 +1,213 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CWorkQueue.h"
+
+// Includes
+#include <algorithm>
+#include <cstdio>
+
+CJob::CJob()
+	:	m_eState(STATE_IDLE),
+		m_bCancelled(false),
+		m_iPriority(0)
+{
+}
+
+CJob::~CJob()
+{
+}
+
+bool CJob::isCancelled() const
+{
+	return m_bCancelled;
+}
+
+CWorkQueue::CWorkQueue()
+	:	m_bStopping(false)
+{
+	pthread_mutex_init(&m_mutexQueue, NULL);
+	pthread_cond_init(&m_condWork, NULL);
+	pthread_cond_init(&m_condIdle, NULL);
+}
+
+CWorkQueue::~CWorkQueue()
+{
+	stop();
+	
+	pthread_cond_destroy(&m_condIdle);
+	pthread_cond_destroy(&m_condWork);
+	pthread_mutex_destroy(&m_mutexQueue);
+}
+
+bool CWorkQueue::start( const unsigned int uThreads )
+{
+	pthread_mutex_lock(&m_mutexQueue);
+	m_bStopping = false;
+	pthread_mutex_unlock(&m_mutexQueue);
+	
+	while( m_vecThreads.size() < uThreads )
+	{
+		pthread_t thread;
+		if( pthread_create(&thread, NULL, threadMain, this) != 0 )
+		{
+			#ifdef WEBPNPAPI_DEBUG
+				printf("CWorkQueue::start() - Failed to create thread\n");
+			#endif
+			break;
+		}
+		
+		m_vecThreads.push_back(thread);
+	}
+	
+	return !m_vecThreads.empty();
+}
+
+void CWorkQueue::stop()
+{
+	pthread_mutex_lock(&m_mutexQueue);
+	m_bStopping = true;
+	pthread_cond_broadcast(&m_condWork);
+	pthread_mutex_unlock(&m_mutexQueue);
+	
+	for( std::vector<pthread_t>::iterator it = m_vecThreads.begin(); it != m_vecThreads.end(); ++it )
+		pthread_join(*it, NULL);
+	
+	m_vecThreads.clear();
+}
+
+bool CWorkQueue::push( CJob * const pJob )
+{
+	bool bPushed = false;
+	
+	pthread_mutex_lock(&m_mutexQueue);
+	
+	if( !m_bStopping && !pJob->m_bCancelled )
+	{
+		switch( pJob->m_eState )
+		{
+			case CJob::STATE_IDLE:
+				pJob->m_eState = CJob::STATE_QUEUED;
+				enqueue(pJob);
+				pthread_cond_signal(&m_condWork);
+			break;
+			
+			case CJob::STATE_RUNNING:
+				pJob->m_eState = CJob::STATE_RERUN;
+			break;
+			
+			default: // Already going to run
+			break;
+		}
+		
+		bPushed = true;
+	}
+	
+	pthread_mutex_unlock(&m_mutexQueue);
+	return bPushed;
+}
+
+void CWorkQueue::cancel( CJob * const pJob )
+{
+	pthread_mutex_lock(&m_mutexQueue);
+	
+	pJob->m_bCancelled = true;
+	
+	if( pJob->m_eState == CJob::STATE_QUEUED )
+	{
+		m_dequeJobs.erase( std::find(m_dequeJobs.begin(), m_dequeJobs.end(), pJob) );
+		pJob->m_eState = CJob::STATE_IDLE;
+	}
+	
+	while( pJob->m_eState != CJob::STATE_IDLE )
+		pthread_cond_wait(&m_condIdle, &m_mutexQueue);
+	
+	pthread_mutex_unlock(&m_mutexQueue);
+}
+
+void CWorkQueue::withdraw( CJob * const pJob )
+{
+	cancel( pJob );
+	
+	pthread_mutex_lock(&m_mutexQueue);
+	pJob->m_bCancelled = false;
+	pthread_mutex_unlock(&m_mutexQueue);
+}
+
+void CWorkQueue::setPriority( CJob * const pJob, const int iPriority )
+{
+	pthread_mutex_lock(&m_mutexQueue);
+	
+	pJob->m_iPriority = iPriority;
+	
+	// Move a waiting job to its new place
+	if( pJob->m_eState == CJob::STATE_QUEUED )
+	{
+		m_dequeJobs.erase( std::find(m_dequeJobs.begin(), m_dequeJobs.end(), pJob) );
+		enqueue(pJob);
+	}
+	
+	pthread_mutex_unlock(&m_mutexQueue);
+}
+
+void * CWorkQueue::threadMain( void * pThis )
+{
+	CWorkQueue * const pQueue = static_cast<CWorkQueue *>(pThis);
+	
+	pthread_mutex_lock(&pQueue->m_mutexQueue);
+	
+	while( true )
+	{
+		while( pQueue->m_dequeJobs.empty() && !pQueue->m_bStopping )
+			pthread_cond_wait(&pQueue->m_condWork, &pQueue->m_mutexQueue);
+		
+		if( pQueue->m_dequeJobs.empty() )
+			break; // Stopping and nothing left to do
+		
+		CJob * const pJob = pQueue->m_dequeJobs.front();
+		pQueue->m_dequeJobs.pop_front();
+		pJob->m_eState = CJob::STATE_RUNNING;
+		
+		pthread_mutex_unlock(&pQueue->m_mutexQueue);
+		pJob->run();
+		pthread_mutex_lock(&pQueue->m_mutexQueue);
+		
+		// Data may have arrived while we were running
+		if( pJob->m_eState == CJob::STATE_RERUN && !pJob->m_bCancelled && !pQueue->m_bStopping )
+		{
+			pJob->m_eState = CJob::STATE_QUEUED;
+			pQueue->enqueue(pJob);
+		}
+		else
+		{
+			pJob->m_eState = CJob::STATE_IDLE;
+			pthread_cond_broadcast(&pQueue->m_condIdle);
+		}
+	}
+	
+	pthread_mutex_unlock(&pQueue->m_mutexQueue);
+	return NULL;
+}
+
+void CWorkQueue::enqueue( CJob * const pJob )
+{
+	// Must be called with m_mutexQueue held. Behind every job of at least
+	// the same priority, so equal priorities keep their order.
+	std::deque<CJob *>::iterator it = m_dequeJobs.end();
+	while( it != m_dequeJobs.begin() && (*(it - 1))->m_iPriority < pJob->m_iPriority )
+		--it;
+	
+	m_dequeJobs.insert( it, pJob );
+}
@@ -0,0 +1,84 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_CWORKQUEUE
+#define H_CWORKQUEUE
+
+// Includes
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+/* A unit of work run by a CWorkQueue. The owner keeps the job alive and must
+ * cancel it through the queue before destroying it. */
+class CJob
+{
+	friend class CWorkQueue;
+	
+	public: // Functions
+		CJob();
+		virtual ~CJob();
+		
+		virtual void run() = 0;
+		
+		/* Polled by run() implementations to bail out early */
+		bool isCancelled() const;
+		
+	private: // Variables
+		enum EState { STATE_IDLE, STATE_QUEUED, STATE_RUNNING, STATE_RERUN };
+		
+		EState m_eState;
+		volatile bool m_bCancelled;
+		int m_iPriority;
+};
+
+/* A pool of worker threads running jobs by priority, then in FIFO order. A
+ * job is never run by two threads at once; pushing a running job makes it
+ * run once more after. */
+class CWorkQueue
+{
+	public: // Functions
+		CWorkQueue();
+		~CWorkQueue();
+		
+		bool start( const unsigned int uThreads );
+		void stop();
+		
+		bool push( CJob * const pJob );
+		
+		/* Removes a pending job, or waits for a running one to return */
+		void cancel( CJob * const pJob );
+		
+		/* Like cancel(), but the job can be pushed again afterwards */
+		void withdraw( CJob * const pJob );
+		
+		/* Jobs with a higher priority run first, the default is 0 */
+		void setPriority( CJob * const pJob, const int iPriority );
+		
+	private: // Functions
+		static void * threadMain( void * pThis );
+		void enqueue( CJob * const pJob );
+		
+	private: // Variables
+		pthread_mutex_t m_mutexQueue;
+		pthread_cond_t m_condWork;
+		pthread_cond_t m_condIdle;
+		
+		std::deque<CJob *> m_dequeJobs;
+		std::vector<pthread_t> m_vecThreads;
+		bool m_bStopping;
+};
+
+#endif
@@ -0,0 +1,331 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CXRenderer.h"
+
+// Includes
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+std::map<Display *, bool> CXRenderer::s_mapSupported;
+bool CXRenderer::s_bXError = false;
+
+CXRenderer::CXRenderer()
+	:	m_pDisplay(NULL),
+		m_pixmap(None),
+		m_picture(None),
+		m_gc(NULL),
+		m_pShmImage(NULL),
+		m_iWidth(0),
+		m_iHeight(0),
+		m_bAlpha(false),
+		m_bShmPending(false)
+{
+	memset( &m_shmInfo, 0, sizeof(m_shmInfo) );
+}
+
+CXRenderer::~CXRenderer()
+{
+	destroyImage();
+	forgetDrawables();
+}
+
+bool CXRenderer::isSupported( Display * const pDisplay )
+{
+	std::map<Display *, bool>::const_iterator it = s_mapSupported.find(pDisplay);
+	if( it != s_mapSupported.end() )
+		return it->second;
+	
+	bool bSupported = false;
+	int iEventBase, iErrorBase;
+	
+	if( XRenderQueryExtension(pDisplay, &iEventBase, &iErrorBase) && XShmQueryExtension(pDisplay) )
+	{
+		// A remote server says it has MIT-SHM but fails to attach, so try it
+		XShmSegmentInfo info;
+		info.shmid = shmget( IPC_PRIVATE, 1, IPC_CREAT | 0600 );
+		
+		if( info.shmid >= 0 )
+		{
+			info.shmaddr = static_cast<char *>( shmat(info.shmid, NULL, 0) );
+			info.readOnly = True;
+			
+			if( info.shmaddr != (char *)-1 )
+			{
+				XSync( pDisplay, False );
+				s_bXError = false;
+				
+				int (* const pfnOldHandler)( Display *, XErrorEvent * ) = XSetErrorHandler( ignoreError );
+				const Bool bAttached = XShmAttach( pDisplay, &info );
+				XSync( pDisplay, False );
+				XSetErrorHandler( pfnOldHandler );
+				
+				bSupported = bAttached && !s_bXError;
+				if( bSupported )
+				{
+					XShmDetach( pDisplay, &info );
+					XSync( pDisplay, False );
+				}
+				
+				shmdt( info.shmaddr );
+			}
+			
+			shmctl( info.shmid, IPC_RMID, NULL );
+		}
+	}
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CXRenderer::isSupported() - XRender with MIT-SHM %s\n", bSupported ? "available" : "unavailable");
+	#endif
+	
+	s_mapSupported[pDisplay] = bSupported;
+	return bSupported;
+}
+
+bool CXRenderer::upload( Display * const pDisplay, cairo_surface_t * const pImage, const int iFirstRow, const int iLastRow )
+{
+	const int iWidth = cairo_image_surface_get_width( pImage );
+	const int iHeight = cairo_image_surface_get_height( pImage );
+	const bool bAlpha = cairo_image_surface_get_format( pImage ) == CAIRO_FORMAT_ARGB32;
+	int iFirst = iFirstRow;
+	
+	if( pDisplay != m_pDisplay )
+	{
+		destroyImage();
+		forgetDrawables();
+		m_pDisplay = pDisplay;
+	}
+	
+	if( m_pixmap == None || iWidth != m_iWidth || iHeight != m_iHeight || bAlpha != m_bAlpha )
+	{
+		destroyImage();
+		if( !createImage( iWidth, iHeight, bAlpha ) )
+			return false;
+		
+		iFirst = 0;
+	}
+	
+	const int iLast = std::min( iLastRow, iHeight );
+	if( iFirst >= iLast )
+		return true;
+	
+	// Rows are only written again after starting over, by which time the
+	// server must be done reading the previous ones
+	if( iFirst == 0 && m_bShmPending )
+		XSync( m_pDisplay, False );
+	
+	const int iSourceStride = cairo_image_surface_get_stride( pImage );
+	const size_t uRowBytes = std::min( (size_t)iWidth * 4, (size_t)m_pShmImage->bytes_per_line );
+	const unsigned char * const pSource = cairo_image_surface_get_data( pImage );
+	
+	for( int y = iFirst; y < iLast; ++y )
+		memcpy( m_pShmImage->data + (size_t)y * m_pShmImage->bytes_per_line, pSource + (size_t)y * iSourceStride, uRowBytes );
+	
+	XShmPutImage( m_pDisplay, m_pixmap, m_gc, m_pShmImage, 0, iFirst, 0, iFirst, iWidth, iLast - iFirst, False );
+	m_bShmPending = true;
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CXRenderer::upload() - Rows %i to %i\n", iFirst, iLast);
+	#endif
+	
+	return true;
+}
+
+bool CXRenderer::paint( const Drawable drawable, Visual * const pVisual, const int iDepth, const int iX, const int iY, const int iRows,
+		const int iClipX, const int iClipY, const int iClipWidth, const int iClipHeight )
+{
+	if( m_picture == None )
+		return false;
+	
+	Picture target = None;
+	std::map<Drawable, Picture>::const_iterator it = m_mapTargets.find(drawable);
+	
+	if( it != m_mapTargets.end() )
+		target = it->second;
+	else
+	{
+		// The drawable should match the window's visual, otherwise go by depth
+		XRenderPictFormat * pFormat = pVisual != NULL ? XRenderFindVisualFormat( m_pDisplay, pVisual ) : NULL;
+		
+		if( pFormat == NULL || pFormat->depth != iDepth )
+		{
+			if( iDepth == 32 )
+				pFormat = XRenderFindStandardFormat( m_pDisplay, PictStandardARGB32 );
+			else if( iDepth == 24 )
+				pFormat = XRenderFindStandardFormat( m_pDisplay, PictStandardRGB24 );
+			else
+				pFormat = NULL;
+		}
+		
+		if( pFormat == NULL )
+			return false;
+		
+		// Browsers paint into one or two drawables, anything beyond that is stale
+		if( m_mapTargets.size() >= 4 )
+			forgetDrawables();
+		
+		// The browser's drawable may be stale already, and an error would
+		// go to the browser's handler, which usually aborts
+		XSync( m_pDisplay, False );
+		s_bXError = false;
+		int (* const pfnOldHandler)( Display *, XErrorEvent * ) = XSetErrorHandler( ignoreError );
+		
+		target = XRenderCreatePicture( m_pDisplay, drawable, pFormat, 0, NULL );
+		
+		XSync( m_pDisplay, False );
+		XSetErrorHandler( pfnOldHandler );
+		
+		// Painting falls back to cairo
+		if( s_bXError )
+			return false;
+		
+		m_mapTargets[drawable] = target;
+	}
+	
+	const int iLeft = std::max( iClipX, iX );
+	const int iTop = std::max( iClipY, iY );
+	const int iRight = std::min( iClipX + iClipWidth, iX + m_iWidth );
+	const int iBottom = std::min( iClipY + iClipHeight, iY + std::min(iRows, m_iHeight) );
+	
+	if( iLeft < iRight && iTop < iBottom )
+		XRenderComposite( m_pDisplay, m_bAlpha ? PictOpOver : PictOpSrc, m_picture, None, target,
+				iLeft - iX, iTop - iY, 0, 0, iLeft, iTop, iRight - iLeft, iBottom - iTop );
+	
+	return true;
+}
+
+void CXRenderer::forgetDrawables()
+{
+	if( m_mapTargets.empty() )
+		return;
+	
+	// Pictures go away with their drawable, so ours may be gone already
+	XSync( m_pDisplay, False );
+	int (* const pfnOldHandler)( Display *, XErrorEvent * ) = XSetErrorHandler( ignoreError );
+	
+	for( std::map<Drawable, Picture>::iterator it = m_mapTargets.begin(); it != m_mapTargets.end(); ++it )
+		XRenderFreePicture( m_pDisplay, it->second );
+	
+	XSync( m_pDisplay, False );
+	XSetErrorHandler( pfnOldHandler );
+	
+	m_mapTargets.clear();
+}
+
+bool CXRenderer::createImage( const int iWidth, const int iHeight, const bool bAlpha )
+{
+	const int iDepth = bAlpha ? 32 : 24;
+	
+	m_pShmImage = XShmCreateImage( m_pDisplay, NULL, iDepth, ZPixmap, NULL, &m_shmInfo, iWidth, iHeight );
+	if( m_pShmImage == NULL )
+		return false;
+	
+	m_shmInfo.shmid = shmget( IPC_PRIVATE, (size_t)m_pShmImage->bytes_per_line * iHeight, IPC_CREAT | 0600 );
+	if( m_shmInfo.shmid < 0 )
+	{
+		XDestroyImage( m_pShmImage );
+		m_pShmImage = NULL;
+		return false;
+	}
+	
+	m_shmInfo.shmaddr = m_pShmImage->data = static_cast<char *>( shmat(m_shmInfo.shmid, NULL, 0) );
+	m_shmInfo.readOnly = False;
+	
+	const bool bAttached = m_shmInfo.shmaddr != (char *)-1 && XShmAttach( m_pDisplay, &m_shmInfo );
+	
+	// The segment lives on until both sides have detached
+	XSync( m_pDisplay, False );
+	shmctl( m_shmInfo.shmid, IPC_RMID, NULL );
+	
+	if( !bAttached )
+	{
+		if( m_shmInfo.shmaddr != (char *)-1 )
+			shmdt( m_shmInfo.shmaddr );
+		
+		m_pShmImage->data = NULL;
+		XDestroyImage( m_pShmImage );
+		m_pShmImage = NULL;
+		return false;
+	}
+	
+	XRenderPictFormat * const pFormat = XRenderFindStandardFormat( m_pDisplay, bAlpha ? PictStandardARGB32 : PictStandardRGB24 );
+	if( pFormat == NULL )
+	{
+		destroyImage();
+		return false;
+	}
+	
+	m_pixmap = XCreatePixmap( m_pDisplay, DefaultRootWindow(m_pDisplay), iWidth, iHeight, iDepth );
+	m_picture = XRenderCreatePicture( m_pDisplay, m_pixmap, pFormat, 0, NULL );
+	m_gc = XCreateGC( m_pDisplay, m_pixmap, 0, NULL );
+	
+	m_iWidth = iWidth;
+	m_iHeight = iHeight;
+	m_bAlpha = bAlpha;
+	m_bShmPending = false;
+	
+	#ifdef WEBPNPAPI_DEBUG
+		printf("CXRenderer::createImage() - %ix%i, depth %i\n", iWidth, iHeight, iDepth);
+	#endif
+	
+	return true;
+}
+
+void CXRenderer::destroyImage()
+{
+	if( m_pDisplay == NULL )
+		return;
+	
+	if( m_picture != None )
+		XRenderFreePicture( m_pDisplay, m_picture );
+	if( m_pixmap != None )
+		XFreePixmap( m_pDisplay, m_pixmap );
+	if( m_gc != NULL )
+		XFreeGC( m_pDisplay, m_gc );
+	
+	if( m_pShmImage != NULL )
+	{
+		XShmDetach( m_pDisplay, &m_shmInfo );
+		XSync( m_pDisplay, False );
+		shmdt( m_shmInfo.shmaddr );
+		
+		m_pShmImage->data = NULL;
+		XDestroyImage( m_pShmImage );
+	}
+	
+	m_picture = None;
+	m_pixmap = None;
+	m_gc = NULL;
+	m_pShmImage = NULL;
+	m_iWidth = m_iHeight = 0;
+	m_bShmPending = false;
+}
+
+size_t CXRenderer::getImageBytes() const
+{
+	if( m_pShmImage == NULL )
+		return 0;
+	
+	return (size_t)m_pShmImage->bytes_per_line * m_pShmImage->height;
+}
+
+int CXRenderer::ignoreError( Display * pDisplay, XErrorEvent * pEvent )
+{
+	s_bXError = true;
+	return 0;
+}
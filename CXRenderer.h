@@ -0,0 +1,94 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef H_CXRENDERER
+#define H_CXRENDERER
+
+// Includes
+#include <map>
+
+// Includes for X
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xrender.h>
+
+// Include for image surfaces
+#include <cairo/cairo.h>
+
+/* Keeps a copy of the image in a server side picture and composites it
+ * onto the browser's drawable with XRender, so an expose costs no round
+ * trips and no pixel transfer. Rows are uploaded once through a MIT-SHM
+ * segment. Only used on the browser thread. */
+class CXRenderer
+{
+	public: // Functions
+		CXRenderer();
+		~CXRenderer();
+		
+		/* Whether pDisplay has XRender and MIT-SHM that we can attach to,
+		 * which rules out remote displays. Probed once per display. */
+		static bool isSupported( Display * const pDisplay );
+		
+		/* Copies rows [iFirstRow, iLastRow) of pImage to the server. A new
+		 * size or format starts over from the first row. */
+		bool upload( Display * const pDisplay, cairo_surface_t * const pImage, const int iFirstRow, const int iLastRow );
+		
+		/* Composites the uploaded image with its top left corner at iX, iY,
+		 * clipped to the given rectangle and to the first iRows rows */
+		bool paint( const Drawable drawable, Visual * const pVisual, const int iDepth, const int iX, const int iY, const int iRows,
+				const int iClipX, const int iClipY, const int iClipWidth, const int iClipHeight );
+		
+		/* Drops the cached pictures for the browser's drawables, whose XIDs
+		 * may be reused once it replaces them */
+		void forgetDrawables();
+		
+		/* Frees the server side copy and its shared memory, the next
+		 * upload() starts over */
+		void destroyImage();
+		
+		/* Size of the shared memory segment mapped into our process */
+		size_t getImageBytes() const;
+		
+	private: // Functions
+		bool createImage( const int iWidth, const int iHeight, const bool bAlpha );
+		
+		static int ignoreError( Display * pDisplay, XErrorEvent * pEvent );
+		
+		// Not copyable
+		CXRenderer( const CXRenderer & );
+		CXRenderer & operator=( const CXRenderer & );
+		
+	private: // Variables
+		Display * m_pDisplay;
+		
+		/* Server side copy of the image, and the shared memory its rows go through */
+		Pixmap m_pixmap;
+		Picture m_picture;
+		GC m_gc;
+		XImage * m_pShmImage;
+		XShmSegmentInfo m_shmInfo;
+		int m_iWidth;
+		int m_iHeight;
+		bool m_bAlpha;
+		bool m_bShmPending; // The server may still be reading the segment
+		
+		/* Pictures for the browser's drawables, by XID */
+		std::map<Drawable, Picture> m_mapTargets;
+		
+		static std::map<Display *, bool> s_mapSupported;
+		static bool s_bXError;
+};
+
+#endif
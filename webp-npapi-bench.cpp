@@ -0,0 +1,540 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Headless benchmark driver. Loads the plugin through its NPAPI entry
+ * points against a stub browser, streams a corpus of WebP files into it
+ * and paints to an offscreen pixmap, timing each stage:
+ *
+ *   ingest  NPP_NewStream, the NPP_WriteReady/NPP_Write loop and
+ *           NPP_DestroyStream, as seen by the browser thread
+ *   decode  from NPP_NewStream until the plugin asks for the final redraw
+ *   scale   the first expose after shrinking the window, which scales the
+ *           decoded image and uploads it
+ *   paint   a repeated expose of the same area
+ *
+ * With -r the stream is offered as seekable and the plugin's byte range
+ * requests are served from the file, as a file:// URL or an HTTP server
+ * with range support would.
+ *
+ * It needs an X display, run it under xvfb-run on a headless machine. */
+
+#include "webp-npapi.h"
+
+// Includes
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+// Includes for the offscreen drawable
+#include <X11/Xlib.h>
+#include <gtk/gtk.h>
+
+// Include for the image size
+#include <webp/decode.h>
+
+namespace
+{
+	/* Async calls from the decode threads, run by pump() as the browser would */
+	struct SAsyncCall
+	{
+		void (* pfnCall)( void * );
+		void * pData;
+	};
+	
+	pthread_mutex_t s_mutexCalls = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t s_condCalls = PTHREAD_COND_INITIALIZER;
+	std::deque<SAsyncCall> s_dequeCalls;
+	
+	bool s_bRedrawForced = false;
+	uint32_t s_uNextTimer = 1;
+	
+	/* Byte ranges asked for with NPN_RequestRead, and how the plugin closed
+	 * a seekable stream */
+	std::deque<NPByteRange> s_dequeRanges;
+	bool s_bStreamClosed = false;
+	NPReason s_closeReason = NPRES_DONE;
+	uint32_t s_uBytesServed = 0;
+	
+	double now()
+	{
+		timespec ts;
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+		return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+	}
+	
+	// Stub browser functions
+	NPError getValue( NPP instance, NPNVariable variable, void * pValue )
+	{
+		if( variable == NPNVSupportsWindowless )
+		{
+			*static_cast<NPBool *>(pValue) = true;
+			return NPERR_NO_ERROR;
+		}
+		
+		return NPERR_GENERIC_ERROR;
+	}
+	
+	NPError setValue( NPP instance, NPPVariable variable, void * pValue )
+	{
+		return NPERR_NO_ERROR;
+	}
+	
+	void invalidateRect( NPP instance, NPRect * pRect )
+	{
+	}
+	
+	void forceRedraw( NPP instance )
+	{
+		s_bRedrawForced = true;
+	}
+	
+	void asyncCall( NPP instance, void (* pfnCall)( void * ), void * pData )
+	{
+		SAsyncCall call;
+		call.pfnCall = pfnCall;
+		call.pData = pData;
+		
+		pthread_mutex_lock(&s_mutexCalls);
+		s_dequeCalls.push_back(call);
+		pthread_cond_signal(&s_condCalls);
+		pthread_mutex_unlock(&s_mutexCalls);
+	}
+	
+	uint32_t scheduleTimer( NPP instance, uint32_t uInterval, NPBool bRepeat, void (* pfnTimer)( NPP, uint32_t ) )
+	{
+		// Animations stay on their first frame
+		return s_uNextTimer++;
+	}
+	
+	void unscheduleTimer( NPP instance, uint32_t uTimer )
+	{
+	}
+	
+	NPError requestRead( NPStream * pStream, NPByteRange * pRangeList )
+	{
+		for( const NPByteRange * pRange = pRangeList; pRange != NULL; pRange = pRange->next )
+		{
+			if( pRange->offset < 0 || pRange->offset + pRange->length > pStream->end )
+				return NPERR_GENERIC_ERROR;
+			
+			s_dequeRanges.push_back( *pRange );
+		}
+		
+		return NPERR_NO_ERROR;
+	}
+	
+	NPError destroyStream( NPP instance, NPStream * pStream, NPReason reason )
+	{
+		// The browser calls NPP_DestroyStream back later, main() does that
+		s_bStreamClosed = true;
+		s_closeReason = reason;
+		return NPERR_NO_ERROR;
+	}
+	
+	/* Runs async calls on this thread until the redraw was forced, or until
+	 * nothing has arrived for dTimeout milliseconds */
+	bool pump( const double dTimeout )
+	{
+		double dDeadline = now() + dTimeout;
+		
+		while( !s_bRedrawForced )
+		{
+			pthread_mutex_lock(&s_mutexCalls);
+			
+			while( s_dequeCalls.empty() && now() < dDeadline )
+			{
+				timespec ts;
+				clock_gettime( CLOCK_REALTIME, &ts );
+				ts.tv_nsec += 1000000;
+				if( ts.tv_nsec >= 1000000000 )
+				{
+					ts.tv_sec += 1;
+					ts.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&s_condCalls, &s_mutexCalls, &ts);
+			}
+			
+			if( s_dequeCalls.empty() )
+			{
+				pthread_mutex_unlock(&s_mutexCalls);
+				return false;
+			}
+			
+			const SAsyncCall call = s_dequeCalls.front();
+			s_dequeCalls.pop_front();
+			pthread_mutex_unlock(&s_mutexCalls);
+			
+			call.pfnCall( call.pData );
+			dDeadline = now() + dTimeout;
+		}
+		
+		return true;
+	}
+	
+	/* Latencies of one stage in milliseconds */
+	struct SStage
+	{
+		const char * szName;
+		std::vector<double> vecSamples;
+	};
+	
+	double percentile( const std::vector<double> & vecSorted, const double dFraction )
+	{
+		const size_t uIndex = std::min( vecSorted.size() - 1, (size_t)(dFraction * vecSorted.size()) );
+		return vecSorted[uIndex];
+	}
+	
+	void report( SStage & stage )
+	{
+		if( stage.vecSamples.empty() )
+		{
+			printf("%-8s %8s\n", stage.szName, "-");
+			return;
+		}
+		
+		std::vector<double> & vecSorted = stage.vecSamples;
+		std::sort( vecSorted.begin(), vecSorted.end() );
+		
+		double dSum = 0;
+		for( size_t i = 0; i < vecSorted.size(); ++i )
+			dSum += vecSorted[i];
+		
+		printf("%-8s %8u %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", stage.szName, (unsigned int)vecSorted.size(),
+				vecSorted.front(), dSum / vecSorted.size(), percentile(vecSorted, 0.5), percentile(vecSorted, 0.9),
+				percentile(vecSorted, 0.99), vecSorted.back());
+	}
+	
+	bool readFile( const char * const szPath, std::string & strData )
+	{
+		FILE * const pFile = fopen( szPath, "rb" );
+		if( pFile == NULL )
+			return false;
+		
+		char buffer[65536];
+		size_t uRead;
+		while( (uRead = fread(buffer, 1, sizeof(buffer), pFile)) > 0 )
+			strData.append( buffer, uRead );
+		
+		fclose( pFile );
+		return true;
+	}
+	
+	void usage( const char * const szName )
+	{
+		fprintf(stderr, "Usage: %s [-n iterations] [-c chunk[,chunk...]] [-s WIDTHxHEIGHT] [-r] file.webp...\n", szName);
+		fprintf(stderr, "  -n  Runs per file and chunk size (default 10)\n");
+		fprintf(stderr, "  -c  Bytes per NPP_Write call (default 4096,65536)\n");
+		fprintf(stderr, "  -s  Window size to scale to (default half the image size)\n");
+		fprintf(stderr, "  -r  Offer seekable streams and serve the byte ranges the plugin asks for\n");
+	}
+}
+
+int main( int argc, char * argv[] )
+{
+	int iIterations = 10;
+	int iWindowWidth = 0, iWindowHeight = 0;
+	bool bSeekable = false;
+	std::vector<int32_t> vecChunkSizes;
+	std::vector<std::string> vecFiles;
+	
+	for( int i = 1; i < argc; ++i )
+	{
+		if( strcmp(argv[i], "-n") == 0 && i + 1 < argc )
+			iIterations = std::max( 1, atoi(argv[++i]) );
+		else if( strcmp(argv[i], "-c") == 0 && i + 1 < argc )
+		{
+			for( char * szChunk = strtok(argv[++i], ","); szChunk != NULL; szChunk = strtok(NULL, ",") )
+			{
+				if( atoi(szChunk) > 0 )
+					vecChunkSizes.push_back( atoi(szChunk) );
+			}
+		}
+		else if( strcmp(argv[i], "-s") == 0 && i + 1 < argc )
+			sscanf( argv[++i], "%ix%i", &iWindowWidth, &iWindowHeight );
+		else if( strcmp(argv[i], "-r") == 0 )
+			bSeekable = true;
+		else if( argv[i][0] == '-' )
+		{
+			usage( argv[0] );
+			return 1;
+		}
+		else
+			vecFiles.push_back( argv[i] );
+	}
+	
+	if( vecFiles.empty() )
+	{
+		usage( argv[0] );
+		return 1;
+	}
+	
+	if( vecChunkSizes.empty() )
+	{
+		vecChunkSizes.push_back( 4096 );
+		vecChunkSizes.push_back( 65536 );
+	}
+	
+	// The plugin builds its popup menu with GTK and paints through X
+	if( !gtk_init_check( &argc, &argv ) )
+	{
+		fprintf(stderr, "Cannot open a display, try running under xvfb-run\n");
+		return 1;
+	}
+	
+	Display * const pDisplay = XOpenDisplay( NULL );
+	if( pDisplay == NULL )
+	{
+		fprintf(stderr, "Cannot open a display, try running under xvfb-run\n");
+		return 1;
+	}
+	
+	NPNetscapeFuncs browserFuncs;
+	memset( &browserFuncs, 0, sizeof(browserFuncs) );
+	browserFuncs.size = sizeof(browserFuncs);
+	browserFuncs.getvalue = getValue;
+	browserFuncs.setvalue = setValue;
+	browserFuncs.invalidaterect = invalidateRect;
+	browserFuncs.forceredraw = forceRedraw;
+	browserFuncs.pluginthreadasynccall = asyncCall;
+	browserFuncs.scheduletimer = scheduleTimer;
+	browserFuncs.unscheduletimer = unscheduleTimer;
+	browserFuncs.requestread = requestRead;
+	browserFuncs.destroystream = destroyStream;
+	
+	NPPluginFuncs pluginFuncs;
+	memset( &pluginFuncs, 0, sizeof(pluginFuncs) );
+	pluginFuncs.size = sizeof(pluginFuncs);
+	
+	if( NP_Initialize( &browserFuncs, &pluginFuncs ) != NPERR_NO_ERROR )
+	{
+		fprintf(stderr, "NP_Initialize failed\n");
+		return 1;
+	}
+	
+	const int iScreen = DefaultScreen( pDisplay );
+	
+	NPSetWindowCallbackStruct windowInfo;
+	windowInfo.type = 0;
+	windowInfo.display = pDisplay;
+	windowInfo.visual = DefaultVisual( pDisplay, iScreen );
+	windowInfo.colormap = DefaultColormap( pDisplay, iScreen );
+	windowInfo.depth = DefaultDepth( pDisplay, iScreen );
+	
+	SStage stages[] = { { "ingest" }, { "decode" }, { "scale" }, { "paint" } };
+	unsigned int uTimeouts = 0;
+	unsigned int uStalls = 0;
+	uint64_t uBytesOffered = 0, uBytesServed = 0;
+	
+	for( size_t uFile = 0; uFile < vecFiles.size(); ++uFile )
+	{
+		std::string strData;
+		if( !readFile( vecFiles[uFile].c_str(), strData ) || strData.empty() )
+		{
+			fprintf(stderr, "Cannot read %s\n", vecFiles[uFile].c_str());
+			continue;
+		}
+		
+		int iWidth = iWindowWidth, iHeight = iWindowHeight;
+		if( iWidth <= 0 || iHeight <= 0 )
+		{
+			if( !WebPGetInfo( (const uint8_t *)strData.data(), strData.size(), &iWidth, &iHeight ) )
+			{
+				fprintf(stderr, "Cannot read the header of %s\n", vecFiles[uFile].c_str());
+				continue;
+			}
+			
+			iWidth = std::max( 1, iWidth / 2 );
+			iHeight = std::max( 1, iHeight / 2 );
+		}
+		
+		const Pixmap pixmap = XCreatePixmap( pDisplay, RootWindow(pDisplay, iScreen), iWidth, iHeight, windowInfo.depth );
+		
+		for( size_t uChunk = 0; uChunk < vecChunkSizes.size(); ++uChunk )
+		{
+			for( int iRun = 0; iRun < iIterations; ++iRun )
+			{
+				NPP_t npp;
+				memset( &npp, 0, sizeof(npp) );
+				
+				char szMimeType[] = "image/webp";
+				if( pluginFuncs.newp( szMimeType, &npp, NP_EMBED, 0, NULL, NULL, NULL ) != NPERR_NO_ERROR )
+				{
+					fprintf(stderr, "NPP_New failed\n");
+					return 1;
+				}
+				
+				NPWindow window;
+				memset( &window, 0, sizeof(window) );
+				window.window = (void *)pixmap;
+				window.width = iWidth;
+				window.height = iHeight;
+				window.clipRect.right = iWidth;
+				window.clipRect.bottom = iHeight;
+				window.ws_info = &windowInfo;
+				window.type = NPWindowTypeDrawable;
+				pluginFuncs.setwindow( &npp, &window );
+				
+				s_bRedrawForced = false;
+				
+				NPStream stream;
+				memset( &stream, 0, sizeof(stream) );
+				stream.url = vecFiles[uFile].c_str();
+				stream.end = strData.size();
+				
+				// Ingest, as the browser would deliver the bytes
+				const double dStart = now();
+				
+				uint16_t uType = NP_NORMAL;
+				pluginFuncs.newstream( &npp, szMimeType, &stream, bSeekable, &uType );
+				
+				NPReason reason = NPRES_DONE;
+				if( uType == NP_SEEK )
+				{
+					s_dequeRanges.clear();
+					s_bStreamClosed = false;
+					s_uBytesServed = 0;
+					
+					// Serve ranges until the plugin closes the stream, running
+					// its async calls in between as the browser would
+					while( !s_bStreamClosed )
+					{
+						if( s_dequeRanges.empty() )
+						{
+							// Nothing asked for once the plugin has gone quiet
+							pump( 1 );
+							
+							if( s_dequeRanges.empty() && !s_bStreamClosed )
+							{
+								++uStalls;
+								reason = NPRES_NETWORK_ERR;
+								break;
+							}
+							
+							continue;
+						}
+						
+						const NPByteRange range = s_dequeRanges.front();
+						s_dequeRanges.pop_front();
+						
+						int32_t iOffset = range.offset;
+						const int32_t iEnd = range.offset + range.length;
+						while( iOffset < iEnd )
+						{
+							int32_t iLength = std::min( vecChunkSizes[uChunk], iEnd - iOffset );
+							iLength = std::min( iLength, pluginFuncs.writeready( &npp, &stream ) );
+							
+							const int32_t iWritten = iLength > 0 ? pluginFuncs.write( &npp, &stream, iOffset, iLength, &strData[iOffset] ) : 0;
+							if( iWritten <= 0 )
+								break;
+							
+							iOffset += iWritten;
+							s_uBytesServed += iWritten;
+						}
+					}
+					
+					if( s_bStreamClosed )
+						reason = s_closeReason;
+					
+					uBytesOffered += strData.size();
+					uBytesServed += s_uBytesServed;
+				}
+				else
+				{
+					int32_t iOffset = 0;
+					while( iOffset < (int32_t)strData.size() )
+					{
+						int32_t iLength = std::min( vecChunkSizes[uChunk], (int32_t)strData.size() - iOffset );
+						iLength = std::min( iLength, pluginFuncs.writeready( &npp, &stream ) );
+						
+						const int32_t iWritten = iLength > 0 ? pluginFuncs.write( &npp, &stream, iOffset, iLength, &strData[iOffset] ) : 0;
+						if( iWritten <= 0 )
+							break;
+						
+						iOffset += iWritten;
+					}
+				}
+				
+				pluginFuncs.destroystream( &npp, &stream, reason );
+				stages[0].vecSamples.push_back( now() - dStart );
+				
+				// Decode, until the plugin asks for the final redraw
+				if( pump( 10000 ) )
+					stages[1].vecSamples.push_back( now() - dStart );
+				else
+					++uTimeouts;
+				
+				// Scale, by shrinking the window below the size we decoded at
+				window.width = std::max( 1, iWidth * 3 / 4 );
+				window.height = std::max( 1, iHeight * 3 / 4 );
+				window.clipRect.right = window.width;
+				window.clipRect.bottom = window.height;
+				pluginFuncs.setwindow( &npp, &window );
+				
+				s_bRedrawForced = false;
+				pump( 0 );
+				
+				XGraphicsExposeEvent expose;
+				memset( &expose, 0, sizeof(expose) );
+				expose.type = GraphicsExpose;
+				expose.display = pDisplay;
+				expose.drawable = pixmap;
+				expose.width = window.width;
+				expose.height = window.height;
+				
+				double dPaint = now();
+				pluginFuncs.event( &npp, &expose );
+				XSync( pDisplay, False );
+				stages[2].vecSamples.push_back( now() - dPaint );
+				
+				// Paint, with nothing left to scale or upload
+				dPaint = now();
+				pluginFuncs.event( &npp, &expose );
+				XSync( pDisplay, False );
+				stages[3].vecSamples.push_back( now() - dPaint );
+				
+				pluginFuncs.destroy( &npp, NULL );
+				
+				s_bRedrawForced = false;
+				pump( 0 );
+			}
+		}
+		
+		XFreePixmap( pDisplay, pixmap );
+	}
+	
+	printf("%-8s %8s %10s %10s %10s %10s %10s %10s\n", "stage", "samples", "min ms", "mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+	for( size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); ++i )
+		report( stages[i] );
+	
+	if( uTimeouts > 0 )
+		printf("%u runs did not finish decoding within 10s\n", uTimeouts);
+	
+	if( uBytesOffered > 0 )
+		printf("Fetched %llu of %llu bytes offered as seekable streams\n", (unsigned long long)uBytesServed, (unsigned long long)uBytesOffered);
+	
+	if( uStalls > 0 )
+		printf("%u seekable streams stalled before the plugin closed them\n", uStalls);
+	
+	NP_Shutdown();
+	XCloseDisplay( pDisplay );
+	return 0;
+}
@@ -0,0 +1,432 @@
+/* Copyright 2011 Filip Reesalu, Johan Gustafsson, Jonas Bornold
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Batch converter built on the plugin's decode core, so the PNG fallbacks
+ * and thumbnails it writes match what the plugin shows. Files and
+ * directory trees are spread over a work-stealing thread pool: every
+ * thread works depth first through its own deque, and idle threads take
+ * the oldest task, usually a whole directory, from a busy one.
+ *
+ *   webp-npapi-tool [-j threads] [-o outdir] [-t WIDTHxHEIGHT] [-f filter] path...
+ *
+ * Each foo.webp becomes foo.png, next to it or at the same relative path
+ * under outdir. With -t the image is shrunk to fit; by default libwebp
+ * scales while decoding, as the plugin does for the window size, while -f
+ * decodes at full size and resamples with that filter, as the plugin does
+ * on resize. */
+
+#include "CDecodeCore.h"
+
+// Includes
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+namespace
+{
+	struct STask
+	{
+		std::string strPath;
+		std::string strOutput; // Without the extension for files
+		bool bDirectory;
+	};
+	
+	/* One pool thread, with the tasks it found itself */
+	struct SWorker
+	{
+		pthread_t thread;
+		unsigned int uIndex;
+		
+		pthread_mutex_t mutexTasks;
+		std::deque<STask> dequeTasks;
+		
+		unsigned int uImages;
+		unsigned int uFailed;
+		unsigned int uSteals;
+		uint64_t uBytes;
+	};
+	
+	std::vector<SWorker *> s_vecWorkers;
+	volatile long s_lPending = 0; // Tasks pushed but not finished
+	
+	// Idle threads sleep until a push or the last task finishing
+	pthread_mutex_t s_mutexIdle = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t s_condIdle = PTHREAD_COND_INITIALIZER;
+	volatile unsigned long s_uPushes = 0;
+	
+	int s_iMaxWidth = 0, s_iMaxHeight = 0;
+	bool s_bResample = false;
+	CScaler::EFilter s_eFilter = CScaler::FILTER_BILINEAR;
+	bool s_bOutputTree = false;
+	
+	double now()
+	{
+		timespec ts;
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+		return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+	}
+	
+	void push( SWorker * const pWorker, const STask & task )
+	{
+		// Counted first, so nobody sees the pool empty while it is in flight
+		__sync_fetch_and_add( &s_lPending, 1 );
+		
+		pthread_mutex_lock( &pWorker->mutexTasks );
+		pWorker->dequeTasks.push_back( task );
+		pthread_mutex_unlock( &pWorker->mutexTasks );
+		
+		pthread_mutex_lock( &s_mutexIdle );
+		++s_uPushes;
+		pthread_cond_signal( &s_condIdle );
+		pthread_mutex_unlock( &s_mutexIdle );
+	}
+	
+	/* Newest of our own tasks, or the oldest of someone else's */
+	bool take( SWorker * const pWorker, STask & task )
+	{
+		pthread_mutex_lock( &pWorker->mutexTasks );
+		const bool bOwn = !pWorker->dequeTasks.empty();
+		if( bOwn )
+		{
+			task = pWorker->dequeTasks.back();
+			pWorker->dequeTasks.pop_back();
+		}
+		pthread_mutex_unlock( &pWorker->mutexTasks );
+		
+		if( bOwn )
+			return true;
+		
+		for( size_t i = 1; i < s_vecWorkers.size(); ++i )
+		{
+			SWorker * const pVictim = s_vecWorkers[ (pWorker->uIndex + i) % s_vecWorkers.size() ];
+			
+			pthread_mutex_lock( &pVictim->mutexTasks );
+			const bool bStolen = !pVictim->dequeTasks.empty();
+			if( bStolen )
+			{
+				task = pVictim->dequeTasks.front();
+				pVictim->dequeTasks.pop_front();
+			}
+			pthread_mutex_unlock( &pVictim->mutexTasks );
+			
+			if( bStolen )
+			{
+				++pWorker->uSteals;
+				return true;
+			}
+		}
+		
+		return false;
+	}
+	
+	bool isWebP( const char * const szName )
+	{
+		const size_t uLength = strlen( szName );
+		return uLength > 5 && strcasecmp( szName + uLength - 5, ".webp" ) == 0;
+	}
+	
+	void listDirectory( SWorker * const pWorker, const STask & task )
+	{
+		if( s_bOutputTree && mkdir( task.strOutput.c_str(), 0755 ) != 0 && errno != EEXIST )
+		{
+			fprintf(stderr, "Cannot create %s: %s\n", task.strOutput.c_str(), strerror(errno));
+			return;
+		}
+		
+		DIR * const pDir = opendir( task.strPath.c_str() );
+		if( pDir == NULL )
+		{
+			fprintf(stderr, "Cannot open %s: %s\n", task.strPath.c_str(), strerror(errno));
+			return;
+		}
+		
+		while( const dirent * const pEntry = readdir(pDir) )
+		{
+			if( strcmp(pEntry->d_name, ".") == 0 || strcmp(pEntry->d_name, "..") == 0 )
+				continue;
+			
+			STask child;
+			child.strPath = task.strPath + "/" + pEntry->d_name;
+			child.strOutput = task.strOutput + "/" + pEntry->d_name;
+			
+			// Symlinks are skipped, so a link back up the tree cannot send
+			// us round forever
+			struct stat fileStat;
+			if( lstat( child.strPath.c_str(), &fileStat ) != 0 )
+				continue;
+			
+			child.bDirectory = S_ISDIR( fileStat.st_mode );
+			if( !child.bDirectory && !( S_ISREG( fileStat.st_mode ) && isWebP( pEntry->d_name ) ) )
+				continue;
+			
+			if( !child.bDirectory )
+				child.strOutput.erase( child.strOutput.size() - 5 );
+			
+			push( pWorker, child );
+		}
+		
+		closedir( pDir );
+	}
+	
+	bool convert( SWorker * const pWorker, const STask & task )
+	{
+		const int fd = open( task.strPath.c_str(), O_RDONLY );
+		if( fd < 0 )
+			return false;
+		
+		struct stat fileStat;
+		void * pMapping = MAP_FAILED;
+		if( fstat(fd, &fileStat) == 0 && fileStat.st_size > 0 )
+			pMapping = mmap( NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		close( fd );
+		
+		if( pMapping == MAP_FAILED )
+			return false;
+		
+		const uint8_t * const pData = static_cast<const uint8_t *>(pMapping);
+		const size_t uSize = fileStat.st_size;
+		pWorker->uBytes += uSize;
+		
+		int iWidth = 0, iHeight = 0;
+		cairo_surface_t * pImage = NULL;
+		
+		if( WebPGetInfo( pData, uSize, &iWidth, &iHeight ) )
+		{
+			int iFitWidth = iWidth, iFitHeight = iHeight;
+			CDecodeCore::fitSize( iFitWidth, iFitHeight, s_iMaxWidth, s_iMaxHeight );
+			
+			if( !s_bResample || ( iFitWidth == iWidth && iFitHeight == iHeight ) )
+				pImage = CDecodeCore::decode( pData, uSize, iFitWidth, iFitHeight );
+			else
+			{
+				cairo_surface_t * const pFull = CDecodeCore::decode( pData, uSize );
+				if( pFull != NULL )
+				{
+					pImage = CDecodeCore::createScaled( pFull, iFitWidth, iFitHeight, s_eFilter );
+					cairo_surface_destroy( pFull );
+				}
+			}
+		}
+		
+		munmap( pMapping, uSize );
+		
+		if( pImage == NULL )
+			return false;
+		
+		const std::string strOutput = task.strOutput + ".png";
+		const bool bWritten = cairo_surface_write_to_png( pImage, strOutput.c_str() ) == CAIRO_STATUS_SUCCESS;
+		cairo_surface_destroy( pImage );
+		
+		return bWritten;
+	}
+	
+	void * threadMain( void * pData )
+	{
+		SWorker * const pWorker = static_cast<SWorker *>(pData);
+		
+		while( true )
+		{
+			// Read before looking, so a push while we look is not missed
+			const unsigned long uPushes = __sync_fetch_and_add( &s_uPushes, 0 );
+			
+			STask task;
+			if( !take( pWorker, task ) )
+			{
+				// Someone may still turn up more work
+				pthread_mutex_lock( &s_mutexIdle );
+				while( s_uPushes == uPushes && s_lPending != 0 )
+					pthread_cond_wait( &s_condIdle, &s_mutexIdle );
+				const bool bDone = s_lPending == 0;
+				pthread_mutex_unlock( &s_mutexIdle );
+				
+				if( bDone )
+					break;
+				continue;
+			}
+			
+			if( task.bDirectory )
+				listDirectory( pWorker, task );
+			else if( convert( pWorker, task ) )
+				++pWorker->uImages;
+			else
+			{
+				fprintf(stderr, "Cannot convert %s\n", task.strPath.c_str());
+				++pWorker->uFailed;
+			}
+			
+			if( __sync_sub_and_fetch( &s_lPending, 1 ) == 0 )
+			{
+				// All done, wake everyone to leave
+				pthread_mutex_lock( &s_mutexIdle );
+				pthread_cond_broadcast( &s_condIdle );
+				pthread_mutex_unlock( &s_mutexIdle );
+			}
+		}
+		
+		return NULL;
+	}
+	
+	void usage( const char * const szName )
+	{
+		fprintf(stderr, "Usage: %s [-j threads] [-o outdir] [-t WIDTHxHEIGHT] [-f filter] path...\n", szName);
+		fprintf(stderr, "  -j  Threads to use (default one per core)\n");
+		fprintf(stderr, "  -o  Writes the PNG files under outdir instead of next to the input\n");
+		fprintf(stderr, "  -t  Shrinks images to fit, for thumbnails\n");
+		fprintf(stderr, "  -f  Resamples with bilinear or lanczos instead of scaling in libwebp\n");
+	}
+}
+
+int main( int argc, char * argv[] )
+{
+	long lThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	std::string strOutputDir;
+	std::vector<std::string> vecPaths;
+	
+	for( int i = 1; i < argc; ++i )
+	{
+		if( strcmp(argv[i], "-j") == 0 && i + 1 < argc )
+			lThreads = atoi(argv[++i]);
+		else if( strcmp(argv[i], "-o") == 0 && i + 1 < argc )
+			strOutputDir = argv[++i];
+		else if( strcmp(argv[i], "-t") == 0 && i + 1 < argc )
+			sscanf( argv[++i], "%ix%i", &s_iMaxWidth, &s_iMaxHeight );
+		else if( strcmp(argv[i], "-f") == 0 && i + 1 < argc )
+		{
+			s_eFilter = CScaler::getFilter( argv[++i] );
+			s_bResample = true;
+		}
+		else if( argv[i][0] == '-' )
+		{
+			usage( argv[0] );
+			return 1;
+		}
+		else
+			vecPaths.push_back( argv[i] );
+	}
+	
+	if( vecPaths.empty() )
+	{
+		usage( argv[0] );
+		return 1;
+	}
+	
+	if( lThreads < 1 )
+		lThreads = 1;
+	
+	CScaler::initialize();
+	
+	// Resampling a huge image is split into strips, which idle threads help
+	// with once the pool runs out of files
+	CWorkQueue stripQueue;
+	if( stripQueue.start( lThreads ) )
+		CDecodeCore::setStripQueue( &stripQueue, lThreads );
+	
+	s_bOutputTree = !strOutputDir.empty();
+	if( s_bOutputTree && mkdir( strOutputDir.c_str(), 0755 ) != 0 && errno != EEXIST )
+	{
+		fprintf(stderr, "Cannot create %s: %s\n", strOutputDir.c_str(), strerror(errno));
+		return 1;
+	}
+	
+	for( long i = 0; i < lThreads; ++i )
+	{
+		SWorker * const pWorker = new SWorker;
+		pWorker->uIndex = i;
+		pthread_mutex_init( &pWorker->mutexTasks, NULL );
+		pWorker->uImages = pWorker->uFailed = pWorker->uSteals = 0;
+		pWorker->uBytes = 0;
+		s_vecWorkers.push_back( pWorker );
+	}
+	
+	// All roots start out on the first thread, the others steal them
+	for( size_t i = 0; i < vecPaths.size(); ++i )
+	{
+		std::string strPath = vecPaths[i];
+		while( strPath.size() > 1 && strPath[strPath.size() - 1] == '/' )
+			strPath.erase( strPath.size() - 1 );
+		
+		struct stat fileStat;
+		if( stat( strPath.c_str(), &fileStat ) != 0 )
+		{
+			fprintf(stderr, "Cannot read %s\n", strPath.c_str());
+			continue;
+		}
+		
+		STask task;
+		task.strPath = strPath;
+		task.bDirectory = S_ISDIR( fileStat.st_mode );
+		
+		// Under outdir, a root keeps its own name
+		const std::string::size_type posSlash = strPath.rfind('/');
+		const std::string strName = posSlash == std::string::npos ? strPath : strPath.substr( posSlash + 1 );
+		task.strOutput = s_bOutputTree ? strOutputDir + "/" + strName : strPath;
+		
+		if( !task.bDirectory )
+		{
+			const std::string::size_type posSuffix = task.strOutput.rfind('.');
+			if( posSuffix != std::string::npos && task.strOutput.find('/', posSuffix) == std::string::npos )
+				task.strOutput.erase( posSuffix );
+		}
+		
+		push( s_vecWorkers[0], task );
+	}
+	
+	const double dStart = now();
+	
+	for( size_t i = 0; i < s_vecWorkers.size(); ++i )
+		pthread_create( &s_vecWorkers[i]->thread, NULL, threadMain, s_vecWorkers[i] );
+	
+	unsigned int uImages = 0, uFailed = 0, uSteals = 0;
+	uint64_t uBytes = 0;
+	
+	for( size_t i = 0; i < s_vecWorkers.size(); ++i )
+	{
+		SWorker * const pWorker = s_vecWorkers[i];
+		pthread_join( pWorker->thread, NULL );
+		
+		uImages += pWorker->uImages;
+		uFailed += pWorker->uFailed;
+		uSteals += pWorker->uSteals;
+		uBytes += pWorker->uBytes;
+		
+		pthread_mutex_destroy( &pWorker->mutexTasks );
+		delete pWorker;
+	}
+	
+	const double dSeconds = std::max( now() - dStart, 1e-9 );
+	
+	CDecodeCore::setStripQueue( NULL, 0 );
+	stripQueue.stop();
+	
+	printf("%u images, %u failed, %.1f MB read in %.3f s on %u threads (%u steals)\n",
+			uImages, uFailed, uBytes / (1024.0 * 1024.0), dSeconds, (unsigned int)s_vecWorkers.size(), uSteals);
+	printf("%.1f images/s, %.1f MB/s\n", uImages / dSeconds, uBytes / (1024.0 * 1024.0) / dSeconds);
+	
+	return uFailed > 0 ? 1 : 0;
+}
@@ -52,6 +52,10 @@ NP_EXPORT(NPError) NP_Initialize(NPNetscapeFuncs * bFuncs, NPPluginFuncs * pFunc
 	pFuncs->urlnotify = NPP_URLNotify;
 	pFuncs->getvalue = NPP_GetValue;
 	pFuncs->setvalue = NPP_SetValue;
+	
+	// Start decode threads
+	if( !CPlugin::initialize() )
+		return NPERR_MODULE_LOAD_FAILED_ERROR;
 
 	return NPERR_NO_ERROR;
 }
@@ -88,6 +92,7 @@ NP_EXPORT(NPError) NP_GetValue(void* future, NPPVariable aVariable, void* aValue
 
 NP_EXPORT(NPError) NP_Shutdown()
 {
+	CPlugin::shutdown();
 	return NPERR_NO_ERROR;
 }
 
@@ -154,7 +159,7 @@ int32_t NPP_Write(NPP instance, NPStream* stream, int32_t offset, int32_t len, v
 void NPP_StreamAsFile(NPP instance, NPStream* stream, const char* fname)
 {
 	CPlugin * pPlugin = static_cast<CPlugin *>(instance->pdata);
-	return pPlugin->streamAsFile( stream, fname );
+	return pPlugin->streamAsFile( stream, fname ? fname : "" );
 }
 
 void NPP_Print(NPP instance, NPPrint* platformPrint)